@@ -0,0 +1,377 @@
+// Throughput of the SIMD row kernels and the BMP reader at every SIMD level the CPU has, and
+// of the image operations that run in row bands on the shared pool from one thread up to a
+// maximum. Every result is checked against the scalar or single-thread one.
+// Usage: ImgConvBench [max_threads] (default one per hardware core). Exits with 1 on a mismatch.
+
+#include "bmp_image.h"
+#include "image.h"
+#include "pixel_ops.h"
+#include "resample.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+using img_lib::Image;
+using img_lib::PixelFormat;
+using img_lib::SimdLevel;
+using img_lib::resample::Filter;
+
+static const int REPEATS = 3;
+static const int SOURCE_WIDTH = 6000;
+static const int SOURCE_HEIGHT = 4000;
+
+static const int KERNEL_ROW_PIXELS = 4096; // source and destination rows stay in L1/L2
+static const int KERNEL_PASSES = 20000;
+
+static const SimdLevel SIMD_LEVELS[] = { SimdLevel::SCALAR, SimdLevel::SSE2, SimdLevel::SSSE3, SimdLevel::AVX2 };
+static const char* const SIMD_LEVEL_NAMES[] = { "scalar", "sse2", "ssse3", "avx2" };
+
+struct KernelCase
+{
+    string name;
+    int src_bytes = 0; // per pixel
+    int dst_bytes = 0;
+    function<void(const uint8_t* src_, uint8_t* dst_, int count_)> run;
+};
+
+struct ParallelCase
+{
+    string name;
+    function<Image(const Image&)> run;
+};
+
+// Best wall time of REPEATS runs in milliseconds; the last result is kept in result_.
+double TimeBest(const ParallelCase& case_, const Image& source_, Image& result_)
+{
+    double best = 0.0;
+    for (int i = 0; i < REPEATS; ++i)
+    {
+        result_ = Image();
+
+        const auto start = chrono::steady_clock::now();
+        result_ = case_.run(source_);
+        const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        best = i == 0 ? ms : min(best, ms);
+    }
+    return best;
+}
+
+// FNV-1a over the pixels of every row, without the row padding.
+uint64_t HashImage(const Image& image_)
+{
+    const size_t row_bytes = static_cast<size_t>(image_.GetWidth()) * img_lib::GetBytesPerPixel(image_.GetFormat());
+
+    uint64_t hash = 14695981039346656037ull;
+    for (int y = 0; y < image_.GetHeight(); ++y)
+    {
+        const uint8_t* row = image_.GetRow(y);
+        for (size_t i = 0; i < row_bytes; ++i)
+        {
+            hash = (hash ^ row[i]) * 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+// Gradients with a little noise, so the filters have detail to work on and no row repeats.
+Image MakeSource(int width_, int height_)
+{
+    Image image(width_, height_, PixelFormat::RGBA8);
+
+    uint32_t noise = 12345;
+    for (int y = 0; y < height_; ++y)
+    {
+        uint8_t* row = image.GetRow(y);
+        for (int x = 0; x < width_; ++x, row += 4)
+        {
+            noise = noise * 1664525u + 1013904223u;
+            row[0] = static_cast<uint8_t>(x * 255 / width_ + (noise >> 28));
+            row[1] = static_cast<uint8_t>(y * 255 / height_ + (noise >> 24 & 15));
+            row[2] = static_cast<uint8_t>((x + y) & 255);
+            row[3] = static_cast<uint8_t>(255 - (noise >> 30));
+        }
+    }
+    return image;
+}
+
+// Levels from scalar up to the best one the CPU supports; leaves that one selected.
+vector<SimdLevel> GetSimdLevels()
+{
+    img_lib::SetSimdLevel(SimdLevel::AVX2);
+    const SimdLevel best = img_lib::GetSimdLevel();
+
+    vector<SimdLevel> levels;
+    for (const SimdLevel level : SIMD_LEVELS)
+    {
+        if (level <= best)
+        {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+void PrintLevelHeader(const char* title_, const vector<SimdLevel>& levels_)
+{
+    printf("%-20s", title_);
+    for (const SimdLevel level : levels_)
+    {
+        printf("%10s", SIMD_LEVEL_NAMES[static_cast<int>(level)]);
+    }
+    printf("\n");
+}
+
+// Output GB/s of every kernel at every level, on rows that stay in cache.
+bool BenchKernels(const vector<SimdLevel>& levels_)
+{
+    static uint32_t palette[256];
+    for (int i = 0; i < 256; ++i)
+    {
+        palette[i] = static_cast<uint32_t>(i * 0x01030507u);
+    }
+
+    const vector<KernelCase> kernels =
+    {
+        { "bgr to rgba"s, 3, 4, img_lib::pixel_ops::BgrToRgba },
+        { "rgb to rgba"s, 3, 4, img_lib::pixel_ops::RgbToRgba },
+        { "bgra to rgba"s, 4, 4, img_lib::pixel_ops::BgraToRgba },
+        { "bgr to rgb"s, 3, 3, img_lib::pixel_ops::BgrToRgb },
+        { "rgba to rgb"s, 4, 3, img_lib::pixel_ops::RgbaToRgb },
+        { "bgra to rgb"s, 4, 3, img_lib::pixel_ops::BgraToRgb },
+        { "palette to rgba"s, 1, 4, [](const uint8_t* src_, uint8_t* dst_, int count_) { img_lib::pixel_ops::PaletteToRgba(src_, palette, dst_, count_); } },
+        { "palette to rgb"s, 1, 3, [](const uint8_t* src_, uint8_t* dst_, int count_) { img_lib::pixel_ops::PaletteToRgb(src_, palette, dst_, count_); } },
+    };
+
+    vector<uint8_t> src(KERNEL_ROW_PIXELS * 4);
+    uint32_t noise = 54321;
+    for (uint8_t& byte : src)
+    {
+        noise = noise * 1664525u + 1013904223u;
+        byte = static_cast<uint8_t>(noise >> 24);
+    }
+
+    printf("%d-pixel rows, best of %d, output GB/s\n", KERNEL_ROW_PIXELS, REPEATS);
+    PrintLevelHeader("kernel", levels_);
+
+    bool identical = true;
+    for (const KernelCase& kernel : kernels)
+    {
+        printf("%-20s", kernel.name.c_str());
+
+        const size_t dst_size = static_cast<size_t>(KERNEL_ROW_PIXELS) * kernel.dst_bytes;
+        vector<uint8_t> reference(dst_size);
+        vector<uint8_t> dst(dst_size);
+
+        for (const SimdLevel level : levels_)
+        {
+            img_lib::SetSimdLevel(level);
+
+            double best = 0.0;
+            for (int i = 0; i < REPEATS; ++i)
+            {
+                const auto start = chrono::steady_clock::now();
+                for (int pass = 0; pass < KERNEL_PASSES; ++pass)
+                {
+                    kernel.run(src.data(), dst.data(), KERNEL_ROW_PIXELS);
+                }
+                const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                best = i == 0 ? seconds : min(best, seconds);
+            }
+
+            if (level == SimdLevel::SCALAR)
+            {
+                reference = dst;
+            }
+
+            const bool same = dst == reference;
+            identical = identical && same;
+            printf("%9.1f%s", static_cast<double>(dst_size) * KERNEL_PASSES / best / 1e9, same ? " " : "!");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    img_lib::SetSimdLevel(levels_.back());
+    return identical;
+}
+
+// Reads the whole BMP as format_ (RGB8 or RGBA8), top down.
+Image ReadBmp(img_lib::bmp_image::BmpImage& reader_, const img_lib::Path& path_, PixelFormat format_)
+{
+    const img_lib::ImageInfo info = reader_.BeginDecode(path_);
+    reader_.SetReadFormat(format_);
+    reader_.SetReadOrder(img_lib::RowOrder::TOP_DOWN);
+
+    Image image(info.width, info.height, reader_.GetReadFormat());
+    for (int y = 0; y < info.height;)
+    {
+        const int count = reader_.ReadRows(image.GetRow(y), static_cast<ptrdiff_t>(image.GetStrideBytes()), info.height - y);
+        if (count <= 0)
+        {
+            throw runtime_error("Unexpected end of BMP data"s);
+        }
+        y += count;
+    }
+    reader_.EndDecode();
+    return image;
+}
+
+// File GB/s of decoding a 24-bit BMP from the page cache at every level.
+bool BenchBmpRead(const Image& source_, const vector<SimdLevel>& levels_)
+{
+    const img_lib::Path path = filesystem::temp_directory_path() / "ImgConvBench.bmp";
+
+    img_lib::bmp_image::BmpImage bmp;
+    bmp.SaveImageBMP(path, source_);
+    const double file_size = static_cast<double>(filesystem::file_size(path));
+
+    printf("%dx%d 24-bit BMP, best of %d, file GB/s\n", source_.GetWidth(), source_.GetHeight(), REPEATS);
+    PrintLevelHeader("read as", levels_);
+
+    bool identical = true;
+    for (const PixelFormat format : { PixelFormat::RGB8, PixelFormat::RGBA8 })
+    {
+        printf("%-20s", format == PixelFormat::RGB8 ? "rgb8" : "rgba8");
+
+        uint64_t reference = 0;
+        for (const SimdLevel level : levels_)
+        {
+            img_lib::SetSimdLevel(level);
+
+            double best = 0.0;
+            uint64_t hash = 0;
+            for (int i = 0; i < REPEATS; ++i)
+            {
+                const auto start = chrono::steady_clock::now();
+                const Image image = ReadBmp(bmp, path, format);
+                const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+                best = i == 0 ? seconds : min(best, seconds);
+                hash = HashImage(image);
+            }
+
+            if (level == SimdLevel::SCALAR)
+            {
+                reference = hash;
+            }
+
+            const bool same = hash == reference;
+            identical = identical && same;
+            printf("%9.2f%s", file_size / best / 1e9, same ? " " : "!");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    error_code error;
+    filesystem::remove(path, error);
+
+    img_lib::SetSimdLevel(levels_.back());
+    return identical;
+}
+
+// 1, 2, 4, ... below max_threads_, then max_threads_.
+vector<int> GetThreadCounts(int max_threads_)
+{
+    vector<int> counts;
+    for (int threads = 1; threads < max_threads_; threads *= 2)
+    {
+        counts.push_back(threads);
+    }
+    counts.push_back(max_threads_);
+    return counts;
+}
+
+bool BenchParallel(const Image& source_, int max_threads_)
+{
+    const vector<ParallelCase> cases =
+    {
+        { "bilinear 1920x1080"s, [](const Image& image_) { return image_.ResizeImage(1920, 1080); } },
+        { "lanczos3 1920x1080"s, [](const Image& image_) { return image_.ResizeImage(1920, 1080, Filter::LANCZOS3); } },
+        { "catmull 7000x5000"s, [](const Image& image_) { return image_.ResizeImage(7000, 5000, Filter::CATMULL_ROM); } },
+        { "rgba8 to rgb8"s, [](const Image& image_) { return image_.ConvertTo(PixelFormat::RGB8); } },
+        { "rgba8 to gray8"s, [](const Image& image_) { return image_.ConvertTo(PixelFormat::GRAY8); } },
+        { "rgba8 to rgba16"s, [](const Image& image_) { return image_.ConvertTo(PixelFormat::RGBA16); } },
+    };
+
+    printf("%dx%d RGBA8 source, best of %d, ms\n", source_.GetWidth(), source_.GetHeight(), REPEATS);
+    printf("%-20s", "threads");
+    for (const int threads : GetThreadCounts(max_threads_))
+    {
+        printf("%10d", threads);
+    }
+    printf("\n");
+
+    bool identical = true;
+    for (const ParallelCase& bench_case : cases)
+    {
+        printf("%-20s", bench_case.name.c_str());
+
+        uint64_t reference = 0;
+        for (const int threads : GetThreadCounts(max_threads_))
+        {
+            img_lib::SetParallelThreads(threads);
+
+            Image result;
+            const double ms = TimeBest(bench_case, source_, result);
+            const uint64_t hash = HashImage(result);
+
+            if (threads == 1)
+            {
+                reference = hash;
+            }
+
+            const bool same = hash == reference;
+            identical = identical && same;
+            printf("%9.1f%s", ms, same ? " " : "!");
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    return identical;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+    if (argc > 1)
+    {
+        max_threads = atoi(argv[1]);
+        if (max_threads < 1)
+        {
+            fprintf(stderr, "Usage: %s [max_threads]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const Image source = MakeSource(SOURCE_WIDTH, SOURCE_HEIGHT);
+    const vector<SimdLevel> levels = GetSimdLevels();
+
+    bool identical = BenchKernels(levels);
+    printf("\n");
+    identical = BenchBmpRead(source, levels) && identical;
+    printf("\n");
+    identical = BenchParallel(source, max_threads) && identical;
+
+    if (!identical)
+    {
+        printf("! marks output that differs from the scalar or single-thread result\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "encode_options.h"
+#include "image.h"
+
+#include <cstdint>
+#include <ostream>
+
+namespace img_lib
+{
+    struct BatchJob
+    {
+        Path input;
+        Path output;
+    };
+
+    struct BatchStats
+    {
+        size_t converted = 0;
+        size_t failed = 0;
+        uintmax_t input_bytes = 0;
+        uintmax_t output_bytes = 0;
+        double seconds = 0.0;
+    };
+
+    // One job per line: "<input_file> <output_file>", tab separated when paths contain spaces.
+    // Empty lines and lines starting with '#' are skipped.
+    std::vector<BatchJob> ReadManifest(const Path& manifest_);
+
+    // Every image file of in_dir_ (recognized by content), written to out_dir_ with extension to_.
+    // Inputs sharing a stem keep their extension (x.bmp.png); files already at their output are skipped.
+    std::vector<BatchJob> ListDirectoryJobs(const Path& in_dir_, const Path& out_dir_, const std::string& to_);
+
+    // Runs the jobs on a work-stealing pool (threads_ == 0: one per core); failures are reported to errors_.
+    BatchStats RunBatch(const std::vector<BatchJob>& jobs_, int threads_, std::ostream& errors_, const EncodeOptions& options_ = {});
+
+    void PrintBatchStats(const BatchStats& stats_, std::ostream& out_);
+
+} // end namespace img_lib
@@ -1,17 +1,35 @@
 #pragma once
 #include "image.h"
+#include "input_source.h"
 #include "pack_defines.h"
+#include "scanline.h"
 
 namespace img_lib
 {
 	namespace bmp_image
 	{
-		class BmpImage
+		class BmpImage : public ScanlineReader, public ScanlineWriter
 		{
 		public:
 
             const Image LoadImageBMP(const Path& file_);
-			bool SaveImageBMP(const Path& file_, const Image& image_) const;
+			bool SaveImageBMP(const Path& file_, const ImageView& image_);
+
+            ImageInfo BeginDecode(const Path& path_) override;
+            int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndDecode() override;
+            PixelFormat GetReadFormat() const noexcept override;
+            bool SetReadFormat(PixelFormat format_) override;
+            RowOrder GetReadOrder() const noexcept override;
+            bool SetReadOrder(RowOrder order_) override;
+
+            void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+            void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndEncode() override;
+            void AbortEncode() noexcept override;
+            PixelFormat GetWriteFormat() const noexcept override;
+            RowOrder GetWriteOrder() const noexcept override;
+            bool SetWriteOrder(RowOrder order_) override;
 
 		private:
 
@@ -40,6 +58,29 @@ namespace img_lib
                 uint32_t colors_important;  // Number of important colors (0 - all)
             }
             PACKED_STRUCT_END
+
+            // rows are seekable in both directions, so either order can be served without buffering
+            struct RowCursor
+            {
+                RowOrder native = RowOrder::BOTTOM_UP;
+                RowOrder order = RowOrder::BOTTOM_UP;
+                std::streamoff offset = 0;  // file offset of the first stored row
+                int stride = 0;
+                int height = 0;
+                int row = 0;                // rows transferred so far
+
+                std::streamoff NextRowOffset() const noexcept;
+            };
+
+            InputSource decode_source;
+            ImageInfo decode_info;
+            int decode_bytes_per_pixel = 0;
+            RowCursor decode_cursor;
+
+            std::ofstream encode_file;
+            ImageInfo encode_info;
+            RowCursor encode_cursor;
+            std::vector<uint8_t> encode_buffer;
 		};
 
 	} // end namespace bmp_image
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "encode_options.h"
+#include "image.h"
+#include "scanline.h"
+
+#include <memory>
+
+namespace img_lib
+{
+    enum class Format { PPM, BMP, TIFF, PNG, JPEG, ICO, GIF, UNKNOWN };
+
+    // Enough bytes to tell every registered format apart.
+    static const size_t SNIFF_PREFIX_SIZE = 16;
+
+    // Uniform front end over the codec classes; readers and writers are null for
+    // formats without a row interface.
+    class ImageCodec
+    {
+    public:
+
+        virtual ~ImageCodec() = default;
+
+        virtual Image Load(const Path& path_) = 0;
+        virtual void Save(const Path& path_, const ImageView& image_) = 0;
+
+        virtual ScanlineReader* GetReader() noexcept = 0;
+        virtual ScanlineWriter* GetWriter() noexcept = 0;
+
+        // Applies the codec's part of options_ to every following Save() and writer encode.
+        virtual void SetEncodeOptions(const EncodeOptions& options_) = 0;
+    };
+
+    struct CodecEntry
+    {
+        Format format = Format::UNKNOWN;
+        std::string name;
+        std::vector<std::string> extensions;                   // output hints, with the leading dot
+        bool (*sniff)(const uint8_t* data_, size_t size_) = nullptr;
+        std::unique_ptr<ImageCodec> (*create)() = nullptr;
+        int largest_saved = 0;  // sides above it are resampled away on save (ICO), 0 when kept
+    };
+
+    const std::vector<CodecEntry>& GetRegisteredCodecs();
+
+    const CodecEntry* FindCodec(Format format_) noexcept;
+    const CodecEntry* FindCodecByExtension(const Path& file_);
+
+    // Matches the magic bytes at the start of the data, nullptr when no codec claims them.
+    const CodecEntry* SniffCodec(const uint8_t* data_, size_t size_) noexcept;
+    const CodecEntry* SniffCodec(const Path& file_);
+
+    Format GetFormatByExtension(const Path& file_);
+
+} // end namespace img_lib
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "image.h"
+#include "codec_registry.h"
+#include "resample.h"
+
+#include <array>
+#include <memory>
+
+namespace img_lib
+{
+    // Creates each codec on first use and keeps it, together with a pixel buffer shared by the
+    // rows in flight, spill images and loaded images, so a long-lived Converter (one per worker
+    // thread) pays codec setup and allocations once.
+    class Converter
+    {
+    public:
+
+        // The input format is taken from the file contents, the output format from its extension.
+        Image LoadImage(const Path& input_file_);
+        void SaveImage(const Path& output_file_, const ImageView& image_);
+
+        // Hands a finished image's storage back for the next LoadImage() or Convert().
+        void Recycle(Image&& image_);
+
+        void Convert(const Path& input_file_, const Path& output_file_);
+
+        // Makes Convert() resize to width_ x height_ with filter_ between decoding and encoding.
+        void SetResize(int width_, int height_, resample::Filter filter_);
+
+        // Makes Convert() keep only the width_ x height_ pixels at x_, y_ of the input, decoded
+        // alone when the reader supports it (see DecodeRegion()); a resize applies after it.
+        void SetRegion(int x_, int y_, int width_, int height_);
+
+        // Encoder settings for every following SaveImage() and Convert().
+        void SetEncodeOptions(const EncodeOptions& options_);
+
+    private:
+
+        const CodecEntry& DetectInput(const Path& input_file_) const;
+        const CodecEntry& DetectOutput(const Path& output_file_) const;
+
+        // Convert() in the format of output_file_, written to target_file_.
+        void ConvertInto(const Path& input_file_, const Path& output_file_, const Path& target_file_);
+
+        ImageCodec& GetCodec(const CodecEntry& entry_);
+        Image LoadWith(ImageCodec& codec_, const Path& input_file_, int min_width_ = 0, int min_height_ = 0);
+        Image LoadRegion(ImageCodec& codec_, const Path& input_file_);
+
+        std::array<std::unique_ptr<ImageCodec>, static_cast<size_t>(Format::UNKNOWN)> codecs;
+        PixelBuffer buffer;
+
+        EncodeOptions encode_options;
+
+        int resize_width = 0;
+        int resize_height = 0;
+        resample::Filter resize_filter = resample::Filter::TRIANGLE;
+
+        int region_x = 0;
+        int region_y = 0;
+        int region_width = 0;   // 0 for the whole image
+        int region_height = 0;
+    };
+
+} // end namespace img_lib
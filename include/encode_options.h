@@ -0,0 +1,80 @@
+#pragma once
+
+namespace img_lib
+{
+    // zlib deflate strategies (Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY).
+    enum class PngStrategy { DEFAULT, FILTERED, RLE, HUFFMAN_ONLY };
+
+    // Row filter of every row, or ADAPTIVE to pick the best one per row with libpng's heuristic.
+    enum class PngFilter { NONE, SUB, UP, AVG, PAETH, ADAPTIVE };
+
+    // When to store an image in the smallest color type and bit depth that keep every pixel (gray,
+    // no alpha, 8 instead of 16 bits, or a palette). Choosing needs the whole image, so ALWAYS
+    // holds streamed rows until the end, and WHOLE_IMAGE only reduces images saved at once.
+    enum class PngReduce { OFF, WHOLE_IMAGE, ALWAYS };
+
+    // The deflate and filter defaults are what libpng does on its own.
+    struct PngEncodeOptions
+    {
+        int level = 6;                              // zlib level 0 (store) to 9
+        PngStrategy strategy = PngStrategy::FILTERED;
+        PngFilter filter = PngFilter::ADAPTIVE;
+        int mem_level = 8;                          // zlib memLevel 1 to 9
+        int window_bits = 15;                       // zlib window 9 to 15
+        PngReduce reduce = PngReduce::WHOLE_IMAGE;
+
+        // Throughput over size, for files that are read once: the fastest deflate level and the
+        // Up filter on every row instead of trying all five. RLE is a little faster still on
+        // photos but falls apart on repetitive synthetic content, so it is left to the caller.
+        static PngEncodeOptions Fast() noexcept
+        {
+            PngEncodeOptions options;
+            options.level = 1;
+            options.filter = PngFilter::UP;
+            return options;
+        }
+    };
+
+    // Chroma resolution of color JPEGs: full, half across, or half across and down.
+    enum class JpegSubsampling { S444, S422, S420 };
+
+    // libjpeg forward DCT (JDCT_ISLOW, JDCT_IFAST, JDCT_FLOAT).
+    enum class JpegDct { SLOW, FAST, FLOAT };
+
+    // The defaults are what jpeg_set_defaults() does on its own.
+    struct JpegEncodeOptions
+    {
+        int quality = 75;                           // IJG quality 1 to 100
+        JpegSubsampling subsampling = JpegSubsampling::S420; // color only
+        bool progressive = false;                   // libjpeg's standard progressive scan script
+        bool optimize_coding = false;               // Huffman tables built for the image, one more pass
+        JpegDct dct = JpegDct::SLOW;
+        int restart_rows = 0;                       // MCU rows between restart markers, 0 for none
+
+        // For intermediate files: the fast integer DCT, standard Huffman tables and one scan.
+        static JpegEncodeOptions Fast() noexcept
+        {
+            JpegEncodeOptions options;
+            options.dct = JpegDct::FAST;
+            return options;
+        }
+
+        // For published files: optimized Huffman tables and a progressive scan script, smaller
+        // for the same quality at the cost of buffering the coefficients.
+        static JpegEncodeOptions Compact() noexcept
+        {
+            JpegEncodeOptions options;
+            options.progressive = true;
+            options.optimize_coding = true;
+            return options;
+        }
+    };
+
+    // Encoder settings of every codec that has some; each codec picks its own member.
+    struct EncodeOptions
+    {
+        PngEncodeOptions png;
+        JpegEncodeOptions jpeg;
+    };
+
+} // end namespace img_lib
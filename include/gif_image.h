@@ -1,6 +1,11 @@
 #pragma once
 
 #include "image.h"
+#include "scanline.h"
+
+#include <array>
+#include <cstdint>
+#include <vector>
 
 extern "C"
 {
@@ -11,12 +16,56 @@ namespace img_lib
 {
 	namespace gif_image
 	{
-		class GifImage
+		class GifImage : public ScanlineReader, public ScanlineWriter
 		{
 		public:
 
+			GifImage() = default;
+			GifImage(const GifImage&) = delete;
+			GifImage& operator=(const GifImage&) = delete;
+			~GifImage() override;
+
 			const Image LoadImageGIF(const Path& path_);
-			bool SaveImageGIF(const Path& path_, const Image& image_) const;
+			bool SaveImageGIF(const Path& path_, const ImageView& image_);
+
+			ImageInfo BeginDecode(const Path& path_) override;
+			int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndDecode() override;
+			PixelFormat GetReadFormat() const noexcept override;
+			bool SetReadFormat(PixelFormat format_) override;
+
+			void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+			void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndEncode() override;
+			void AbortEncode() noexcept override;
+			PixelFormat GetWriteFormat() const noexcept override;
+
+		private:
+
+			void ReadFrameHeader(const Path& path_);
+			void SetPalette(const ColorMapObject* color_map_, int transparent_);
+			void ReleaseDecode() noexcept;
+			void ReleaseEncode() noexcept;
+
+			// The first frame is read record by record, a line at a time, onto a canvas of the
+			// logical screen; pixels outside the frame get the background color (transparent
+			// when the frame has a transparent index).
+			GifFileType* decode_gif = nullptr;
+			ImageInfo decode_info;
+			int decode_row = 0;
+			int frame_left = 0;
+			int frame_top = 0;
+			int frame_width = 0;
+			int frame_height = 0;
+			bool frame_interlaced = false;
+			std::array<uint32_t, 256> decode_palette{}; // R | G << 8 | B << 16 | A << 24
+			uint32_t decode_background = 0;
+			std::vector<GifPixelType> decode_indices; // one frame line, or the whole frame when interlaced
+
+			GifFileType* encode_gif = nullptr;
+			ColorMapObject* encode_color_map = nullptr;
+			ImageInfo encode_info;
+			std::vector<GifPixelType> encode_buffer;
 		};
 	}
-}
\ No newline at end of file
+}
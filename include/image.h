@@ -8,9 +8,15 @@
 #include <stdexcept>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "pixel_format.h"
+
 namespace img_lib
 {
     using namespace std::string_literals;
@@ -79,6 +85,169 @@ namespace img_lib
         }
     };
 
+    // Rows start on this boundary so vector kernels can use aligned loads and run whole registers
+    // into the row padding.
+    static const size_t IMAGE_ROW_ALIGNMENT = 64;
+
+    // std::allocator that default-initializes, so growing a vector of trivial types such as
+    // Color leaves the new elements unwritten instead of zero-filling them, and that can
+    // over-align the storage.
+    template <typename T, size_t ALIGNMENT = alignof(T)>
+    class DefaultInitAllocator : public std::allocator<T>
+    {
+    public:
+
+        template <typename U>
+        struct rebind
+        {
+            using other = DefaultInitAllocator<U, ALIGNMENT>;
+        };
+
+        using std::allocator<T>::allocator;
+
+        T* allocate(size_t count_)
+        {
+            if constexpr (ALIGNMENT > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            {
+                return static_cast<T*>(::operator new(count_ * sizeof(T), std::align_val_t(ALIGNMENT)));
+            }
+            else
+            {
+                return std::allocator<T>::allocate(count_);
+            }
+        }
+
+        void deallocate(T* ptr_, size_t count_) noexcept
+        {
+            if constexpr (ALIGNMENT > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+            {
+                ::operator delete(ptr_, std::align_val_t(ALIGNMENT));
+            }
+            else
+            {
+                std::allocator<T>::deallocate(ptr_, count_);
+            }
+        }
+
+        template <typename U>
+        void construct(U* ptr_) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            ::new (static_cast<void*>(ptr_)) U;
+        }
+
+        template <typename U, typename... Args>
+        void construct(U* ptr_, Args&&... args_)
+        {
+            ::new (static_cast<void*>(ptr_)) U(std::forward<Args>(args_)...);
+        }
+    };
+
+    using PixelBuffer = std::vector<uint8_t, DefaultInitAllocator<uint8_t, IMAGE_ROW_ALIGNMENT>>;
+
+    class Image;
+
+    namespace resample
+    {
+        enum class Filter; // defined in resample.h
+    }
+
+    // Non-owning window onto rows of pixels: a pointer to the first pixel, the size, the pixel
+    // format and the distance between rows in bytes. Views are cheap to copy and must not
+    // outlive the pixels they show. The Color accessors require PixelFormat::RGBA8.
+    class ImageView
+    {
+    public:
+
+        ImageView() = default;
+        ImageView(const Color* data_, int w_, int h_, int step_) noexcept;
+        ImageView(const uint8_t* data_, int w_, int h_, size_t stride_, PixelFormat format_) noexcept;
+
+        explicit operator bool() const noexcept
+        {
+            return GetWidth() > 0 && GetHeight() > 0;
+        }
+
+        bool operator!() const noexcept
+        {
+            return !operator bool();
+        }
+
+        const Color& GetPixel(int x_, int y_) const;
+        const Color* GetLine(int y_) const;
+        const uint8_t* GetRow(int y_) const noexcept;
+
+        int GetWidth() const noexcept;
+        int GetHeight() const noexcept;
+        PixelFormat GetFormat() const noexcept;
+
+        int GetStep() const noexcept;
+        size_t GetStrideBytes() const noexcept;
+
+        // Sub-rectangle sharing these pixels; rows of a crop are not necessarily aligned.
+        ImageView Crop(int x_, int y_, int w_, int h_) const;
+
+        Image ConvertTo(PixelFormat format_) const;
+
+        // Bilinear unless a filter is given; destination rows are split across GetParallelThreads().
+        Image ResizeImage(int new_width_, int new_height_) const;
+        Image ResizeImage(int new_width_, int new_height_, resample::Filter filter_) const;
+
+    private:
+
+        const uint8_t* data = nullptr;
+        int width = 0;
+        int height = 0;
+        size_t stride = 0;
+        PixelFormat format = PixelFormat::RGBA8;
+    };
+
+    // ImageView that may write the pixels it shows.
+    class MutableImageView
+    {
+    public:
+
+        MutableImageView() = default;
+        MutableImageView(Color* data_, int w_, int h_, int step_) noexcept;
+        MutableImageView(uint8_t* data_, int w_, int h_, size_t stride_, PixelFormat format_) noexcept;
+
+        operator ImageView() const noexcept;
+
+        explicit operator bool() const noexcept
+        {
+            return GetWidth() > 0 && GetHeight() > 0;
+        }
+
+        bool operator!() const noexcept
+        {
+            return !operator bool();
+        }
+
+        Color& GetPixel(int x_, int y_) const;
+        Color* GetLine(int y_) const;
+        uint8_t* GetRow(int y_) const noexcept;
+
+        int GetWidth() const noexcept;
+        int GetHeight() const noexcept;
+        PixelFormat GetFormat() const noexcept;
+
+        int GetStep() const noexcept;
+        size_t GetStrideBytes() const noexcept;
+
+        void SetPixel(int x_, int y_, const Color& pixel_) const;
+
+        MutableImageView Crop(int x_, int y_, int w_, int h_) const;
+
+    private:
+
+        uint8_t* data = nullptr;
+        int width = 0;
+        int height = 0;
+        size_t stride = 0;
+        PixelFormat format = PixelFormat::RGBA8;
+    };
+
+    // Owning image in any PixelFormat; the Color accessors require PixelFormat::RGBA8, which is
+    // what the constructors without a format produce.
     class Image
     {
     public:
@@ -87,6 +256,15 @@ namespace img_lib
         explicit Image(int w_, int h_);
         Image(int w_, int h_, Color fill_);
 
+        // Takes over buffer_ (recycled storage, or an empty PixelBuffer) without initializing
+        // the pixels; the caller must write every pixel.
+        Image(int w_, int h_, PixelBuffer&& buffer_);
+        Image(int w_, int h_, PixelFormat format_, PixelBuffer&& buffer_ = {});
+
+        // Same with an explicit RGBA8 row step in pixels (at least w_); rows stay 64-byte
+        // aligned only when step_ is a multiple of GetAlignedStep(1).
+        Image(int w_, int h_, int step_, PixelBuffer&& buffer_);
+
         Image(const Image& other_);
         Image& operator=(const Image& other_);
 
@@ -103,33 +281,63 @@ namespace img_lib
             return !operator bool();
         }
 
+        operator ImageView() const noexcept;
+        operator MutableImageView() noexcept;
+
+        ImageView GetView() const noexcept;
+        MutableImageView GetView() noexcept;
+
+        // Views of a sub-rectangle, without copying.
+        ImageView Crop(int x_, int y_, int w_, int h_) const;
+        MutableImageView Crop(int x_, int y_, int w_, int h_);
+
         const Color& GetPixel(int x_, int y_) const;
         Color& GetPixel(int x_, int y_);
 
-        std::vector<Color>& GetPixels() noexcept;
-        const std::vector<Color>& GetPixels() const noexcept;
+        PixelBuffer& GetPixels() noexcept;
+        const PixelBuffer& GetPixels() const noexcept;
+
+        // Leaves the image empty and returns its storage for reuse.
+        PixelBuffer ReleasePixels() noexcept;
 
-        Color* GetLine(int y_) noexcept;
-        const Color* GetLine(int y_) const noexcept;
+        Color* GetLine(int y_);
+        const Color* GetLine(int y_) const;
+
+        uint8_t* GetRow(int y_) noexcept;
+        const uint8_t* GetRow(int y_) const noexcept;
 
         int GetWidth() const noexcept;
         int GetHeight() const noexcept;
+        PixelFormat GetFormat() const noexcept;
 
+        // Pixels from the start of one row to the next; the padding past the width is writable
+        // scratch whose contents are unspecified.
         int GetStep() const noexcept;
+        size_t GetStrideBytes() const noexcept;
+
+        // Smallest RGBA8 step >= width_ that keeps every row IMAGE_ROW_ALIGNMENT-aligned.
+        static int GetAlignedStep(int width_) noexcept;
+
+        // Smallest row size in bytes >= width_ pixels of format_ that keeps every row
+        // IMAGE_ROW_ALIGNMENT-aligned and is a whole number of pixels.
+        static size_t GetAlignedStride(int width_, PixelFormat format_) noexcept;
 
         const uint8_t* GetData() const noexcept;
 
         void SetPixel(int x_, int y_, const Color& pixel_);
 
+        Image ConvertTo(PixelFormat format_) const;
         Image ResizeImage(int new_width_, int new_height_) const;
+        Image ResizeImage(int new_width_, int new_height_, resample::Filter filter_) const;
 
     private:
 
         int width = 0;
         int height = 0;
-        int step = 0;
+        size_t stride = 0;
+        PixelFormat format = PixelFormat::RGBA8;
 
-        std::vector<Color> pixels;
+        PixelBuffer pixels;
 
         void CheckBounds(int x_, int y_) const;
     };
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "image.h"
+
+#include <cstdint>
+
+namespace img_lib
+{
+    // Read-only random access to a file. The file is memory-mapped when possible (with
+    // sequential read-ahead advice), so views point straight into the page cache; otherwise
+    // views are filled with ordinary reads into an internal buffer. Setting the environment
+    // variable IMG_LIB_MMAP=0 forces the read path.
+    class InputSource
+    {
+    public:
+
+        InputSource() = default;
+        InputSource(const InputSource&) = delete;
+        InputSource& operator=(const InputSource&) = delete;
+        ~InputSource();
+
+        void Open(const Path& path_);
+        void Close() noexcept;
+
+        bool IsOpen() const noexcept;
+        bool IsMapped() const noexcept;
+        uint64_t GetSize() const noexcept;
+
+        // size_ bytes starting at offset_, or nullptr if they run past the end of the file.
+        // The pointer stays valid until the next View() or Close().
+        const uint8_t* View(uint64_t offset_, size_t size_);
+
+    private:
+
+        bool Map(const Path& path_);
+
+        uint64_t size = 0;
+        const uint8_t* mapping = nullptr;
+        uint64_t resident_begin = 0;    // mapped range that may still be resident
+        uint64_t resident_end = 0;
+
+    #ifdef _WIN32
+        void* file_handle = nullptr;
+        void* mapping_handle = nullptr;
+    #endif
+
+        std::ifstream file;
+        std::vector<uint8_t> buffer;
+    };
+
+} // end namespace img_lib
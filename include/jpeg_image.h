@@ -1,6 +1,10 @@
 #pragma once
 
+#include "encode_options.h"
 #include "image.h"
+#include "scanline.h"
+
+#include <setjmp.h>
 
 extern "C"
 {
@@ -11,14 +15,115 @@ namespace img_lib
 {
     namespace jpeg_image
     {
-        class JpegImage
+        // Lossless rearrangements of the DCT blocks; ROTATE_* turn clockwise.
+        enum class JpegTransform { NONE, FLIP_H, FLIP_V, TRANSPOSE, TRANSVERSE, ROTATE_90, ROTATE_180, ROTATE_270 };
+
+        // Area of the transformed image to keep; the corner moves up and left to a whole MCU and a
+        // zero width or height reaches the right or bottom edge.
+        struct JpegCrop
+        {
+            int x = 0;
+            int y = 0;
+            int width = 0;
+            int height = 0;
+        };
+
+        class JpegImage : public ScanlineReader, public ScanlineWriter
         {
         public:
 
+            JpegImage() = default;
+            JpegImage(const JpegImage&) = delete;
+            JpegImage& operator=(const JpegImage&) = delete;
+            ~JpegImage() override;
+
             const Image LoadImageJPEG(const Path& path_);
-            bool SaveImageJPEG(const Path& path_, const Image& image_) const;
+            bool SaveImageJPEG(const Path& path_, const ImageView& image_);
+
+            ImageInfo BeginDecode(const Path& path_) override;
+            int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndDecode() override;
+            PixelFormat GetReadFormat() const noexcept override;
+            bool SetReadFormat(PixelFormat format_) override;
+            bool SetReadSize(int& width_, int& height_) override;
+            bool SetReadRegion(int& x_, int& y_, int& width_, int& height_) override;
+
+            void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+            void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndEncode() override;
+            void AbortEncode() noexcept override;
+            PixelFormat GetWriteFormat() const noexcept override;
+
+            // Used by every following encode; throws std::invalid_argument for out of range values.
+            void SetEncodeOptions(const JpegEncodeOptions& options_);
+
+            // JPEG to JPEG on the quantized coefficients, without decoding to pixels or any loss.
+            // Edge blocks that would have to move to the top or left are dropped (jpegtran -trim).
+            // Only the progressive, optimize_coding and restart settings apply to the output.
+            void TransformJPEG(const Path& input_, const Path& output_, JpegTransform transform_, const JpegCrop& crop_ = {});
+
+        private:
+
+            struct ErrorManager
+            {
+                jpeg_error_mgr pub;
+                jmp_buf setjmp_buffer;
+                char message[JMSG_LENGTH_MAX];
+            };
+
+            struct CropPlan;
+            struct CoefficientCopy;
+
+            static void ErrorExit(j_common_ptr cinfo_);
+            static CropPlan PlanCrop(const jpeg_decompress_struct& cinfo_, JpegTransform transform_, const JpegCrop& crop_) noexcept;
+
+            // Reads all the coefficients of decode_cinfo, whose header has been read, along with
+            // the arrays plan_ is cut into; the input file is no longer needed after this.
+            CoefficientCopy ReadCoefficients(const CropPlan& plan_);
+
+            // Writes the cut of copy_ with cinfo_, created with its destination set. Only the
+            // progressive, optimize_coding and restart settings of options_ apply.
+            void WriteCoefficients(j_compress_ptr cinfo_, const CropPlan& plan_, const CoefficientCopy& copy_, const JpegEncodeOptions& options_);
+
+            // Releases a failed TransformJPEG() and removes output_ once it has been created.
+            void AbortTransform(const Path& output_) noexcept;
+
+            // Decodes the whole image into rows_ in bands cut at restart markers, each on its own
+            // decompressor on the ParallelFor pool; false when the file has no usable markers.
+            bool ReadRowsParallel(uint8_t* rows_, ptrdiff_t stride_);
+
+            // One band: header_ (with the band's height) followed by data_, its entropy-coded
+            // segments. On failure message_ (JMSG_LENGTH_MAX) receives the libjpeg error.
+            static bool DecodeBand(const JOCTET* header_, size_t header_size_, const JOCTET* data_, size_t data_size_,
+                                   PixelFormat format_, uint8_t* rows_, ptrdiff_t stride_, char* message_);
+
+            void ReleaseDecode() noexcept;
+            void ReleaseEncode() noexcept;
+
+            FILE* decode_file = nullptr;
+            Path decode_path;                    // for the restart marker index, empty once decoding from memory
+            bool decode_parallel = false;        // every row was decoded by ReadRowsParallel()
+            bool decode_started = false;
+            jpeg_decompress_struct decode_cinfo;
+            ErrorManager decode_error;
+            PixelFormat decode_format = PixelFormat::RGB8;
+            bool decode_decompressing = false;
+            std::vector<JSAMPROW> decode_rows;   // row pointers of one jpeg_read_scanlines() call
+            std::vector<JSAMPLE> decode_buffer;  // RGB rows of one call, expanded to RGBA8 rows
+            std::vector<JOCTET> decode_region;   // SetReadRegion() blocks as a JPEG in memory, decoded instead of the file
+            jpeg_compress_struct region_cinfo;   // writes decode_region
+            bool region_started = false;
+
+            FILE* encode_file = nullptr;
+            bool encode_started = false;
+            jpeg_compress_struct encode_cinfo;
+            ErrorManager encode_error;
+            PixelFormat encode_format = PixelFormat::RGB8;
+            JpegEncodeOptions encode_options;
+            std::vector<JSAMPLE> encode_buffer;  // RGBA8 rows of one call, stripped to RGB
+            std::vector<JSAMPROW> encode_rows;   // row pointers of one jpeg_write_scanlines() call
         };
 
     } // end namespace jpeg_image
 
-} // end namespace img_lib
\ No newline at end of file
+} // end namespace img_lib
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+namespace img_lib
+{
+    // Memory layout of one pixel. Channels are interleaved in the order of the name and 16-bit
+    // samples are stored in native byte order.
+    enum class PixelFormat { GRAY8, GRAYA8, GRAY16, RGB8, RGBA8, RGB16, RGBA16 };
+
+    inline int GetChannelCount(PixelFormat format_) noexcept
+    {
+        switch (format_)
+        {
+        case PixelFormat::GRAY8:
+        case PixelFormat::GRAY16:
+            return 1;
+
+        case PixelFormat::GRAYA8:
+            return 2;
+
+        case PixelFormat::RGB8:
+        case PixelFormat::RGB16:
+            return 3;
+
+        default:
+            return 4;
+        }
+    }
+
+    inline int GetBitDepth(PixelFormat format_) noexcept
+    {
+        return format_ == PixelFormat::GRAY16 || format_ == PixelFormat::RGB16 || format_ == PixelFormat::RGBA16 ? 16 : 8;
+    }
+
+    inline int GetBytesPerPixel(PixelFormat format_) noexcept
+    {
+        return GetChannelCount(format_) * GetBitDepth(format_) / 8;
+    }
+
+    inline bool IsGray(PixelFormat format_) noexcept
+    {
+        return format_ == PixelFormat::GRAY8 || format_ == PixelFormat::GRAYA8 || format_ == PixelFormat::GRAY16;
+    }
+
+    inline bool HasAlpha(PixelFormat format_) noexcept
+    {
+        return format_ == PixelFormat::GRAYA8 || format_ == PixelFormat::RGBA8 || format_ == PixelFormat::RGBA16;
+    }
+
+} // end namespace img_lib
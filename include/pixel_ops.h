@@ -0,0 +1,31 @@
+#pragma once
+
+#include "pixel_format.h"
+
+#include <cstdint>
+
+namespace img_lib
+{
+    namespace pixel_ops
+    {
+        // Row conversion kernels, dispatched at run time to AVX2/SSSE3/SSE2 with a scalar fallback.
+        // Source and destination must not overlap.
+
+        void BgrToRgba(const uint8_t* src_, uint8_t* dst_, int count_);  // B,G,R -> R,G,B,255
+        void RgbToRgba(const uint8_t* src_, uint8_t* dst_, int count_);  // R,G,B -> R,G,B,255
+        void BgraToRgba(const uint8_t* src_, uint8_t* dst_, int count_); // B,G,R,A -> R,G,B,A (and back)
+        void BgrToRgb(const uint8_t* src_, uint8_t* dst_, int count_);   // B,G,R -> R,G,B (and back)
+        void RgbaToRgb(const uint8_t* src_, uint8_t* dst_, int count_);  // R,G,B,A -> R,G,B
+        void BgraToRgb(const uint8_t* src_, uint8_t* dst_, int count_);  // B,G,R,A -> R,G,B, or R,G,B,A -> B,G,R
+
+        // Palette indices -> R,G,B,A or R,G,B; palette_ holds 256 entries of R | G << 8 | B << 16 | A << 24.
+        void PaletteToRgba(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_);
+        void PaletteToRgb(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_);
+
+        // Any pixel format to any other. Gray is BT.601 luma, missing alpha is opaque, dropped
+        // alpha is discarded, 8-bit samples widen by 257 and 16-bit samples keep their high byte.
+        void ConvertPixels(const uint8_t* src_, PixelFormat src_format_, uint8_t* dst_, PixelFormat dst_format_, int count_);
+
+    } // end namespace pixel_ops
+
+} // end namespace img_lib
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "encode_options.h"
+#include "thread_pool.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+
+namespace img_lib
+{
+    namespace png_image
+    {
+        // Filters and deflates the rows of a non-interlaced PNG into its zlib stream, pigz style:
+        // rows are cut into blocks of about BLOCK_BYTES, and every block is filtered and deflated
+        // on the ParallelFor pool into a raw deflate segment ending on a sync flush (the last one
+        // finishes the stream). Each block is primed with the filtered window before it, so the
+        // segments compress nearly as well as a single stream, and the block Adler-32s are
+        // combined for the trailer. Blocks only depend on the image and the options, so the
+        // stream is the same for any thread count.
+        class IdatEncoder
+        {
+        public:
+
+            // Receives the zlib stream in order, one piece per block, on the writing thread.
+            using Sink = std::function<void(const uint8_t* data_, size_t size_)>;
+
+            static constexpr size_t BLOCK_BYTES = 256 * 1024;
+
+            // Rows hold width_ pixels of channels_ samples of bit_depth_ bits, packed MSB first below
+            // 8 bits and in native byte order at 16.
+            IdatEncoder(int width_, int height_, int channels_, int bit_depth_, const PngEncodeOptions& options_, Sink sink_);
+            ~IdatEncoder(); // waits for the blocks still being deflated
+
+            IdatEncoder(const IdatEncoder&) = delete;
+            IdatEncoder& operator=(const IdatEncoder&) = delete;
+
+            void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_);
+
+            // Deflates what is left and passes the end of the stream to the sink; every row must
+            // have been written.
+            void Finish();
+
+        private:
+
+            struct Settings
+            {
+                size_t row_bytes = 0;
+                int pixel_bytes = 0;
+                PngEncodeOptions options;
+            };
+
+            struct Block;
+            struct Progress;
+
+            static void Deflate(const Settings& settings_, Block& block_);
+
+            std::shared_ptr<Block> NewBlock() const;
+            void Submit();
+            void Complete(Block& block_);
+            void Emit(Block& block_);
+            void EmitReady();
+
+            Settings settings;
+            Sink sink;
+            int height = 0;
+            int rows_per_block = 0;
+            int context_rows = 0;   // rows carried into the next block: the dictionary window and the row above it
+            bool swap_bytes = false;
+
+            std::shared_ptr<ThreadPool> pool;
+            std::shared_ptr<Progress> progress;
+            size_t max_in_flight = 0;
+            std::deque<std::shared_ptr<Block>> in_flight;
+            std::shared_ptr<Block> current;
+
+            int written = 0;
+            unsigned long adler = 1;
+        };
+
+    } // end namespace png_image
+
+} // end namespace img_lib
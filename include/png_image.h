@@ -1,6 +1,14 @@
 #pragma once 
 
+#include "encode_options.h"
 #include "image.h"
+#include "png_deflate.h"
+#include "png_reduce.h"
+#include "scanline.h"
+
+#include <memory>
+#include <optional>
+#include <vector>
 
 extern "C"
 {
@@ -11,12 +19,68 @@ namespace img_lib
 {
 	namespace png_image
 	{
-		class PngImage
+		class PngImage : public ScanlineReader, public ScanlineWriter
 		{
 		public:
 
+			PngImage() = default;
+			PngImage(const PngImage&) = delete;
+			PngImage& operator=(const PngImage&) = delete;
+			~PngImage() override;
+
 			const Image LoadImagePNG(const Path& path_);
-			bool SaveImagePNG(const Path& path_, const Image& image_) const;
+
+			// Unless PngEncodeOptions::reduce is OFF, the image is stored in the smallest color type
+			// that keeps every pixel. Scanlines are only reduced with ALWAYS, and are then held
+			// until EndEncode().
+			bool SaveImagePNG(const Path& path_, const ImageView& image_);
+
+			ImageInfo BeginDecode(const Path& path_) override;
+			int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndDecode() override;
+			PixelFormat GetReadFormat() const noexcept override;
+			bool SetReadFormat(PixelFormat format_) override;
+
+			void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+			void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndEncode() override;
+			void AbortEncode() noexcept override;
+			PixelFormat GetWriteFormat() const noexcept override;
+
+			// Used by every following encode; throws std::invalid_argument for out of range values.
+			void SetEncodeOptions(const PngEncodeOptions& options_);
+
+		private:
+
+			static PixelFormat GetNativeFormat(png_structp png_, png_infop info_) noexcept;
+
+			void PrepareDecode();
+			void ReadInterlaced(uint8_t* rows_, ptrdiff_t stride_);
+			void StartImageData(const PngLayout& layout_);
+			void WritePacked(const uint8_t* rows_, ptrdiff_t stride_, int count_);
+			void ReleaseDecode() noexcept;
+			void ReleaseEncode() noexcept;
+
+			FILE* decode_file = nullptr;
+			png_structp decode_png = nullptr;
+			png_infop decode_png_info = nullptr;
+			ImageInfo decode_info;
+			int decode_row = 0;
+			bool decode_prepared = false;  // transforms are set up by the first ReadRows()
+			bool decode_interlace = false;
+			PixelBuffer decode_interlaced; // deinterlaced copy for partial reads of interlaced images
+			std::vector<png_bytep> decode_row_pointers; // for png_read_image(), kept out of the frame libpng longjmps across
+
+			FILE* encode_file = nullptr;
+			png_structp encode_png = nullptr;
+			png_infop encode_png_info = nullptr;
+			ImageInfo encode_info;
+			PngEncodeOptions encode_options;
+			std::optional<PngLayout> encode_layout;    // chosen by SaveImagePNG() for the next BeginEncode()
+			std::unique_ptr<RowPacker> encode_packer;
+			std::unique_ptr<IdatEncoder> encode_idat; // image data, deflated in blocks on the shared pool
+			Image encode_spill;                       // rows held until the layout can be chosen
+			int encode_spilled = 0;
 		};
 
 	} // end namespace png_image
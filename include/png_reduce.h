@@ -0,0 +1,101 @@
+#pragma once
+
+#include "image.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace img_lib
+{
+    namespace png_image
+    {
+        // How an image is stored in a PNG: pixels are converted to format, then replaced by their
+        // palette index when there is a palette, and packed several to a byte when bit_depth is
+        // below 8 (gray levels or indices).
+        struct PngLayout
+        {
+            PixelFormat format = PixelFormat::RGBA8;
+            int bit_depth = 8;
+            std::vector<uint32_t> palette; // R | G << 8 | B << 16 | A << 24, translucent entries first
+
+            int GetChannelCount() const noexcept
+            {
+                return palette.empty() ? img_lib::GetChannelCount(format) : 1;
+            }
+
+            int GetTranslucentCount() const noexcept;
+        };
+
+        // Rows of format_ written as they come.
+        PngLayout GetDirectLayout(PixelFormat format_) noexcept;
+
+        // Smallest layout that stores image_ without loss, from one pass that checks for opaque
+        // alpha, gray pixels (r == g == b), 16-bit samples that fit in 8 bits and at most 256
+        // distinct colors: Gray (1 to 16 bits), Gray+Alpha, RGB, RGBA, or a palette of 1 to 8 bits
+        // with its alpha in tRNS. The rows are scanned in bands on the shared pool.
+        PngLayout ChooseLayout(const ImageView& image_);
+
+        // Open-addressing set of up to MAX_COLORS packed R,G,B,A colors, numbered in insertion order.
+        class ColorTable
+        {
+        public:
+
+            static constexpr int MAX_COLORS = 256;
+
+            ColorTable() noexcept;
+
+            // Index of color_, inserted when new; -1 when it is new and the table is full.
+            int Insert(uint32_t color_) noexcept;
+            int Find(uint32_t color_) const noexcept;
+
+            int GetCount() const noexcept
+            {
+                return count;
+            }
+
+            uint32_t GetColor(int index_) const noexcept
+            {
+                return colors[index_];
+            }
+
+        private:
+
+            static constexpr int SLOTS = 4 * MAX_COLORS;
+
+            uint32_t keys[SLOTS];
+            int16_t slots[SLOTS];          // index of keys[i] in colors, -1 for a free slot
+            uint32_t colors[MAX_COLORS];
+            int count = 0;
+        };
+
+        // Converts rows of format_ pixels to layout_.
+        class RowPacker
+        {
+        public:
+
+            RowPacker(const PngLayout& layout_, PixelFormat format_, int width_);
+
+            // True when rows are written as they come and Pack() need not be called.
+            bool IsDirect() const noexcept
+            {
+                return direct;
+            }
+
+            // The packed row, valid until the next call.
+            const uint8_t* Pack(const uint8_t* row_);
+
+        private:
+
+            PngLayout layout;
+            PixelFormat format;
+            int width = 0;
+            bool direct = false;
+
+            ColorTable indices;
+            std::vector<uint8_t> converted;
+            std::vector<uint8_t> packed;
+        };
+
+    } // end namespace png_image
+
+} // end namespace img_lib
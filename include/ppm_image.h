@@ -1,6 +1,8 @@
 #pragma once
 
 #include "image.h"
+#include "input_source.h"
+#include "scanline.h"
 
 namespace img_lib
 {
@@ -10,22 +12,61 @@ namespace img_lib
 		static const std::string PPM_TYPE_P3 = "P3"s;
 		static const std::string PPM_TYPE_P6 = "P6"s;
 
-		class PpmImage
+		class PpmImage : public ScanlineReader, public ScanlineWriter
 		{
 		public:
 
 			const Image LoadImagePPM(const Path& file_);
-			bool SaveImagePPM(const Path& file_, const Image& image_) const;
+			bool SaveImagePPM(const Path& file_, const ImageView& image_);
+
+			ImageInfo BeginDecode(const Path& path_) override;
+			int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndDecode() override;
+
+			PixelFormat GetReadFormat() const noexcept override;
+			bool SetReadFormat(PixelFormat format_) override;
+
+			void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+			void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+			void EndEncode() override;
+			void AbortEncode() noexcept override;
+
+			PixelFormat GetWriteFormat() const noexcept override;
 
 		private:
 
-			const Image LoadP3(const Path& file_);
-			const Image LoadP6(const Path& file_);
+			struct TextWindow
+			{
+				const uint8_t* data = nullptr;
+				size_t pos = 0;
+				size_t size = 0;
+			};
+
+			bool LoadP3(uint8_t* line_, int width_);
+			bool LoadP6(uint8_t* line_, int width_);
+
+			void RefillP3();
+			bool SkipP3Separators();
+			bool ParseP3Sample(uint8_t& value_);
+			bool ParseP3SampleSlow(uint8_t& value_);
+
+			bool SaveP3(const uint8_t* line_, int width_);
+			bool SaveP6(const uint8_t* line_, int width_);
+			bool FlushP3();
+
+			InputSource decode_source;
+			bool decode_p3 = false;
+			ImageInfo decode_info;
+			int decode_row = 0;
+			uint64_t decode_offset = 0;    // next P6 row, or the start of decode_text
+			TextWindow decode_text;        // P3 tokens not yet parsed
 
-			bool SaveP3(const Path& file_, const Image& image_) const;
-			bool SaveP6(const Path& file_, const Image& image_) const;
+			std::ofstream encode_file;
+			bool encode_p3 = false;
+			ImageInfo encode_info;
+			std::vector<char> encode_buffer;
 		};
 
 	} // end namespace ppm_image
 
-} // end namespace img_lib
\ No newline at end of file
+} // end namespace img_lib
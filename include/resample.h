@@ -0,0 +1,36 @@
+#pragma once
+
+#include "image.h"
+
+namespace img_lib
+{
+    namespace resample
+    {
+        // Bilinear resize of src_ into dst_; both must have the same 8-bit pixel format.
+        // Source positions and weights are tabulated once per column and row, and weights are
+        // 8-bit fixed point, so every sample is within 1 of the float formula it replaces.
+        void ResizeBilinear(const ImageView& src_, const MutableImageView& dst_);
+
+        enum class Filter { BOX, TRIANGLE, CATMULL_ROM, MITCHELL, LANCZOS3 };
+
+        // Separable resize of src_ into dst_ (same 8-bit pixel format) with filter_ widened by
+        // the scale factor on downscales, so every source pixel contributes. Rows are filtered
+        // horizontally into a ring buffer as the vertical pass reaches them. Contribution tables
+        // are cached per (source size, destination size, filter), so repeated resizes between
+        // the same sizes skip the setup.
+        void Resize(const ImageView& src_, const MutableImageView& dst_, Filter filter_);
+
+        // factor_ x factor_ box average of src_ into dst_ (same 8-bit format), which must be
+        // src_ divided by factor_ (1 to 256) rounded down; trailing source rows and columns that
+        // do not fill a box are dropped.
+        void ReduceBox(const ImageView& src_, const MutableImageView& dst_, int factor_);
+
+        // Resizes src_ to every size of sizes_ (width, height). src_ is first reduced to a mipmap
+        // chain of 2x box levels down to the smallest requested size, and each size is then
+        // resampled with filter_ from the smallest level still covering it, so the source is
+        // read once however many sizes are asked for. The sizes are resized in parallel.
+        std::vector<Image> ResizeToSizes(const ImageView& src_, const std::vector<std::pair<int, int>>& sizes_, Filter filter_);
+
+    } // end namespace resample
+
+} // end namespace img_lib
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "image.h"
+
+namespace img_lib
+{
+    static const int DEFAULT_ROWS_IN_FLIGHT = 64;
+
+    enum class RowOrder { TOP_DOWN, BOTTOM_UP };
+
+    struct ImageInfo
+    {
+        int width = 0;
+        int height = 0;
+        PixelFormat format = PixelFormat::RGBA8;
+    };
+
+    // Row-pull decoder. Rows are delivered in GetReadOrder() order and GetReadFormat() pixels,
+    // by default the format the file stores; a different order or format may be requested with
+    // SetReadOrder()/SetReadFormat() after BeginDecode() and before the first ReadRows().
+    // Row i of a batch lives at rows_ + i * stride_; stride_ is in bytes and may be negative.
+    class ScanlineReader
+    {
+    public:
+
+        virtual ~ScanlineReader() = default;
+
+        virtual ImageInfo BeginDecode(const Path& path_) = 0;
+        virtual int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) = 0; // returns the number of rows read
+        virtual void EndDecode() = 0;
+
+        virtual PixelFormat GetReadFormat() const noexcept = 0;
+
+        virtual bool SetReadFormat(PixelFormat format_)
+        {
+            return format_ == GetReadFormat();
+        }
+
+        virtual RowOrder GetReadOrder() const noexcept
+        {
+            return RowOrder::TOP_DOWN;
+        }
+
+        virtual bool SetReadOrder(RowOrder order_)
+        {
+            return order_ == GetReadOrder();
+        }
+
+        // Asks for rows shrunk while decoding, to the smallest size the reader produces cheaply
+        // that still covers width_ x height_ (JPEG scales its inverse DCT). Same timing as
+        // SetReadFormat(). Returns false when rows keep the full size, otherwise width_ and
+        // height_ receive the size they will have.
+        virtual bool SetReadSize(int& width_, int& height_)
+        {
+            (void)width_;
+            (void)height_;
+            return false;
+        }
+
+        // Asks for the rows and columns of a region only, so the reader can skip decoding the
+        // rest (JPEG cuts the region's blocks out of the coefficients). Same timing as
+        // SetReadFormat(), not combined with SetReadSize(). Returns false when rows keep the full
+        // image, otherwise the arguments receive the region delivered, which contains the one
+        // asked for (JPEG widens it up and left to whole MCUs).
+        virtual bool SetReadRegion(int& x_, int& y_, int& width_, int& height_)
+        {
+            (void)x_;
+            (void)y_;
+            (void)width_;
+            (void)height_;
+            return false;
+        }
+    };
+
+    // Row-push encoder, same ordering contract as ScanlineReader. BeginEncode() receives the
+    // format of the source pixels in info_; rows are then written in GetWriteFormat(), which the
+    // writer picks from the formats the file type can store.
+    class ScanlineWriter
+    {
+    public:
+
+        virtual ~ScanlineWriter() = default;
+
+        virtual void BeginEncode(const Path& path_, const ImageInfo& info_) = 0;
+        virtual void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) = 0;
+        virtual void EndEncode() = 0;
+
+        // Closes the file after a failure between BeginEncode() and EndEncode(), leaving it
+        // for the caller to delete.
+        virtual void AbortEncode() noexcept = 0;
+
+        virtual PixelFormat GetWriteFormat() const noexcept = 0;
+
+        virtual RowOrder GetWriteOrder() const noexcept
+        {
+            return RowOrder::TOP_DOWN;
+        }
+
+        virtual bool SetWriteOrder(RowOrder order_)
+        {
+            return order_ == GetWriteOrder();
+        }
+    };
+
+    // The image is built in the reader's native format in buffer_, so a buffer recycled from an
+    // earlier image saves the allocation.
+    Image DecodeImage(ScanlineReader& reader_, const Path& path_, PixelBuffer buffer_ = {});
+
+    // Same, for a caller that will shrink the image to min_width_ x min_height_ or less: the
+    // reader may deliver it smaller (see SetReadSize()), never below that size.
+    Image DecodeImage(ScanlineReader& reader_, const Path& path_, int min_width_, int min_height_, PixelBuffer buffer_ = {});
+
+    // The width_ x height_ pixels at x_, y_ only; throws std::invalid_argument when they are not
+    // all inside the image. Readers without SetReadRegion() decode everything and the region
+    // is copied out of their rows.
+    Image DecodeRegion(ScanlineReader& reader_, const Path& path_, int x_, int y_, int width_, int height_, PixelBuffer buffer_ = {});
+
+    // Deletes path_ when writing fails.
+    void EncodeImage(ScanlineWriter& writer_, const Path& path_, const ImageView& image_);
+
+    // Streams rows from reader_ to writer_ holding at most rows_in_flight_ rows in memory.
+    // Rows are converted in flight when the reader cannot deliver the writer's pixel format.
+    // Falls back to a full-image spill buffer when neither side can adopt the other's row order.
+    // When decoding or encoding fails, output_ is deleted before the exception propagates.
+    // Throws std::invalid_argument when output_ is the input_ file itself.
+    void TranscodeImage(ScanlineReader& reader_, const Path& input_, ScanlineWriter& writer_, const Path& output_, int rows_in_flight_ = DEFAULT_ROWS_IN_FLIGHT);
+
+    // Same as above, keeping the rows in flight (or the spill image) in scratch_ so repeated
+    // conversions reuse its capacity.
+    void TranscodeImage(ScanlineReader& reader_, const Path& input_, ScanlineWriter& writer_, const Path& output_, PixelBuffer& scratch_, int rows_in_flight_ = DEFAULT_ROWS_IN_FLIGHT);
+
+} // end namespace img_lib
@@ -0,0 +1,27 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define IMG_LIB_X86 1
+#endif
+
+// GCC and Clang need per-function target attributes to emit instructions above the build
+// baseline; MSVC accepts the intrinsics anywhere.
+#if defined(IMG_LIB_X86) && (defined(__GNUC__) || defined(__clang__))
+#define IMG_LIB_TARGET(isa_) __attribute__((target(isa_)))
+#else
+#define IMG_LIB_TARGET(isa_)
+#endif
+
+namespace img_lib
+{
+    enum class SimdLevel { SCALAR, SSE2, SSSE3, AVX2 };
+
+    // Best instruction set supported by the CPU, detected once. Setting the environment
+    // variable IMG_LIB_SIMD to scalar, sse2, ssse3 or avx2 caps it (useful to test fallbacks).
+    SimdLevel GetSimdLevel() noexcept;
+
+    // Replaces the level GetSimdLevel() returns, capped at what the CPU supports, so one process
+    // can run the kernels of every level (benchmarks, comparisons against the scalar code).
+    void SetSimdLevel(SimdLevel level_) noexcept;
+
+} // end namespace img_lib
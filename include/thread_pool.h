@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace img_lib
+{
+    // Fixed-size pool with one task deque per worker. A worker pops its own deque from the
+    // back and steals from the front of the others when it runs dry, so uneven task costs
+    // (a 50 MP TIFF next to a favicon) still keep every core busy.
+    class ThreadPool
+    {
+    public:
+
+        using Task = std::function<void(int worker_)>; // worker_ is in [0, GetThreadCount())
+
+        explicit ThreadPool(int threads_ = 0); // 0 means one thread per hardware core
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        int GetThreadCount() const noexcept;
+
+        void Submit(Task task_);
+
+        // Blocks until every submitted task has finished and rethrows the first task exception.
+        // Must not be called from a task.
+        void Wait();
+
+    private:
+
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        void Run(int worker_);
+        bool TryPop(int worker_, Task& task_);
+        bool TrySteal(int worker_, Task& task_);
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable idle;
+
+        std::atomic<size_t> queued{ 0 };
+        size_t pending = 0;
+        size_t next_queue = 0;
+        bool stopping = false;
+        std::exception_ptr error;
+    };
+
+    // Worker count of the process-wide pool behind ParallelFor (0: one per hardware core,
+    // 1: everything runs on the calling thread). Takes effect on the next ParallelFor.
+    void SetParallelThreads(int threads_);
+    int GetParallelThreads();
+
+    // The pool behind ParallelFor, created on first use with one worker less than the thread
+    // count, or null when everything runs on the calling thread. For pipelines that hand their
+    // own tasks to the same workers.
+    std::shared_ptr<ThreadPool> GetParallelPool();
+
+    // Splits [0, count_) into at most one band per thread, none shorter than min_band_, and
+    // calls body_(begin_, end_) once per band. The calling thread takes bands as well, so calls
+    // from inside pool tasks cannot deadlock. Returns when every band is done and rethrows the
+    // first exception a band threw. The bands only depend on count_, min_band_ and the thread
+    // count, so bodies that write disjoint outputs give the same result for any thread count.
+    void ParallelFor(int count_, int min_band_, const std::function<void(int begin_, int end_)>& body_);
+
+} // end namespace img_lib
@@ -1,17 +1,31 @@
 #pragma once
 
 #include "image.h"
+#include "input_source.h"
+#include "scanline.h"
 
 namespace img_lib 
 {
     namespace tiff_image
     {
-        class TiffImage
+        class TiffImage : public ScanlineReader, public ScanlineWriter
         {
         public:
 
             const Image LoadImageTIFF(const Path& path_);
-            bool SaveImageTIFF(const Path& path_, const Image& image_) const;
+            bool SaveImageTIFF(const Path& path_, const ImageView& image_);
+
+            ImageInfo BeginDecode(const Path& path_) override;
+            int ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndDecode() override;
+            PixelFormat GetReadFormat() const noexcept override;
+            bool SetReadFormat(PixelFormat format_) override;
+
+            void BeginEncode(const Path& path_, const ImageInfo& info_) override;
+            void WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_) override;
+            void EndEncode() override;
+            void AbortEncode() noexcept override;
+            PixelFormat GetWriteFormat() const noexcept override;
 
         private:
 
@@ -29,6 +43,15 @@ namespace img_lib
                 uint32_t count;           // Number of values in the entry
                 uint32_t valueOffset;     // Offset to the value(s) if data does not fit within the entry
             };
+
+            InputSource decode_source;
+            ImageInfo decode_info;
+            int decode_row = 0;
+            uint64_t decode_offset = 0;
+
+            std::ofstream encode_file;
+            ImageInfo encode_info;
+            std::vector<uint8_t> encode_buffer;
         };
 
     } // end namespace tiff_image
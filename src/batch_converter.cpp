@@ -0,0 +1,177 @@
+#include "batch_converter.h"
+#include "converter.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <iomanip>
+#include <map>
+
+namespace img_lib
+{
+    std::vector<BatchJob> ReadManifest(const Path& manifest_)
+    {
+        std::ifstream file(manifest_);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open manifest file: "s + manifest_.string());
+        }
+
+        std::vector<BatchJob> jobs;
+        std::string line;
+        int line_number = 0;
+
+        while (std::getline(file, line))
+        {
+            ++line_number;
+
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+
+            const size_t begin = line.find_first_not_of(" \t");
+            if (begin == std::string::npos || line[begin] == '#')
+            {
+                continue;
+            }
+
+            const size_t end = line.find_last_not_of(" \t");
+            line = line.substr(begin, end - begin + 1);
+
+            size_t split = line.find('\t');
+            if (split == std::string::npos)
+            {
+                split = line.find(' ');
+            }
+
+            const size_t output_begin = split == std::string::npos ? std::string::npos : line.find_first_not_of(" \t", split);
+            if (output_begin == std::string::npos)
+            {
+                throw std::runtime_error("Manifest line "s + std::to_string(line_number) + " needs an input and an output file"s);
+            }
+
+            jobs.push_back({ line.substr(0, split), line.substr(output_begin) });
+        }
+
+        return jobs;
+    }
+
+    std::vector<BatchJob> ListDirectoryJobs(const Path& in_dir_, const Path& out_dir_, const std::string& to_)
+    {
+        const std::string extension = !to_.empty() && to_.front() == '.' ? to_ : "."s + to_;
+
+        if (!FindCodecByExtension(Path("image"s + extension)))
+        {
+            throw std::runtime_error("Unknown output file format: "s + extension);
+        }
+
+        std::filesystem::create_directories(out_dir_);
+
+        // how many inputs claim each output name; files that would be written onto themselves
+        // (out_dir_ == in_dir_, already in the format) are skipped but keep their names
+        std::vector<BatchJob> jobs;
+        std::map<Path, int> claims;
+        for (const auto& entry : std::filesystem::directory_iterator(in_dir_))
+        {
+            // only files whose leading bytes belong to a registered codec, whatever their names
+            if (!entry.is_regular_file() || !SniffCodec(entry.path()))
+            {
+                continue;
+            }
+
+            Path output = out_dir_ / entry.path().filename();
+            output.replace_extension(extension);
+            ++claims[output];
+
+            std::error_code error;
+            if (!std::filesystem::equivalent(entry.path(), output, error))
+            {
+                jobs.push_back({ entry.path(), output });
+            }
+        }
+
+        // inputs differing only in extension keep it in the output name: x.bmp.png, x.ppm.png
+        for (BatchJob& job : jobs)
+        {
+            if (claims[job.output] > 1)
+            {
+                job.output = out_dir_ / (job.input.filename().string() + extension);
+                if (claims.count(job.output))
+                {
+                    throw std::runtime_error("Several input files map to the output file: "s + job.output.string());
+                }
+            }
+        }
+
+        return jobs;
+    }
+
+    BatchStats RunBatch(const std::vector<BatchJob>& jobs_, int threads_, std::ostream& errors_, const EncodeOptions& options_)
+    {
+        ThreadPool pool(threads_);
+
+        // codec objects and row buffers live as long as the batch, one set per worker
+        std::vector<std::unique_ptr<Converter>> converters;
+        for (int i = 0; i < pool.GetThreadCount(); ++i)
+        {
+            converters.push_back(std::make_unique<Converter>());
+            converters.back()->SetEncodeOptions(options_);
+        }
+
+        std::mutex stats_mutex;
+        BatchStats stats;
+
+        const auto start = std::chrono::steady_clock::now();
+
+        for (const BatchJob& job : jobs_)
+        {
+            pool.Submit([&, job](int worker_)
+            {
+                std::error_code ec;
+                std::string failure;
+
+                try
+                {
+                    converters[worker_]->Convert(job.input, job.output);
+                }
+                catch (const std::exception& e)
+                {
+                    failure = e.what();
+                }
+
+                const uintmax_t input_bytes = std::filesystem::file_size(job.input, ec);
+                const uintmax_t output_bytes = failure.empty() ? std::filesystem::file_size(job.output, ec) : 0;
+
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                if (!failure.empty())
+                {
+                    ++stats.failed;
+                    errors_ << "Error converting "s << job.input.string() << ": "s << failure << std::endl;
+                    return;
+                }
+
+                ++stats.converted;
+                stats.input_bytes += input_bytes == static_cast<uintmax_t>(-1) ? 0 : input_bytes;
+                stats.output_bytes += output_bytes == static_cast<uintmax_t>(-1) ? 0 : output_bytes;
+            });
+        }
+
+        pool.Wait();
+
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+    void PrintBatchStats(const BatchStats& stats_, std::ostream& out_)
+    {
+        const double seconds = stats_.seconds > 0.0 ? stats_.seconds : 1e-9;
+        const double megabyte = 1024.0 * 1024.0;
+
+        out_ << "Converted "s << stats_.converted << " images ("s << stats_.failed << " failed) in "s
+             << std::fixed << std::setprecision(3) << stats_.seconds << " s: "s
+             << std::setprecision(1) << stats_.converted / seconds << " images/s, "s
+             << stats_.input_bytes / megabyte / seconds << " MB/s read, "s
+             << stats_.output_bytes / megabyte / seconds << " MB/s written"s << std::endl;
+    }
+
+} // end namespace img_lib
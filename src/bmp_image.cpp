@@ -1,130 +1,187 @@
 #include "bmp_image.h"
+#include "pixel_ops.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace img_lib
 {
 	namespace bmp_image
 	{
-        static int GetBMPStride(int w_)
+        // rows converted per View(), which bounds the read buffer when the file is not mapped
+        static const int BMP_READ_CHUNK_BYTES = 1 << 20;
+
+        static int GetBMPStride(int w_, int bytes_per_pixel_)
         {
-            const int bytesPerPixel = 3;
             const int alignment = 4;
 
-            return alignment * ((w_ * bytesPerPixel + (alignment - 1)) / alignment);
+            return alignment * ((w_ * bytes_per_pixel_ + (alignment - 1)) / alignment);
+        }
+
+        std::streamoff BmpImage::RowCursor::NextRowOffset() const noexcept
+        {
+            const int stored_row = order == native ? row : height - 1 - row;
+            return offset + static_cast<std::streamoff>(stored_row) * stride;
         }
 
         const Image BmpImage::LoadImageBMP(const Path& path_)
         {
-            std::ifstream file(path_, std::ios::binary);
-            if (!file)
+            return DecodeImage(*this, path_);
+        }
+
+        bool BmpImage::SaveImageBMP(const Path& path_, const ImageView& image_)
+        {
+            EncodeImage(*this, path_, image_);
+            return true;
+        }
+
+        ImageInfo BmpImage::BeginDecode(const Path& path_)
+        {
+            decode_source.Open(path_);
+
+            const uint8_t* headers = decode_source.View(0, sizeof(BitmapFileHeader) + sizeof(BitmapInfoHeader));
+            if (!headers)
             {
-                throw std::runtime_error("Failed to open BMP file: "s + path_.string());
-                return {};
+                throw std::runtime_error("Invalid BMP file: "s + path_.string());
             }
 
             BitmapFileHeader file_header;
-            file.read(reinterpret_cast<char*>(&file_header), sizeof(file_header));
-            if (!file)
-            {
-                return {};
-            }
-            if (file_header.file_type != 0x4D42 || !file)
+            std::memcpy(&file_header, headers, sizeof(file_header));
+            if (file_header.file_type != 0x4D42)
             {
-                return {};
+                throw std::runtime_error("Invalid BMP file: "s + path_.string());
             }
 
             BitmapInfoHeader info_header;
-            file.read(reinterpret_cast<char*>(&info_header), sizeof(info_header));
-            if (!file)
-            {
-                return {};
-            }
-            if (info_header.compression != 0 || !file)
+            std::memcpy(&info_header, headers + sizeof(file_header), sizeof(info_header));
+            if (info_header.compression != 0)
             {
-                return {};
+                throw std::runtime_error("Unsupported BMP compression"s);
             }
             if (info_header.bit_count != 24 && info_header.bit_count != 32)
             {
-                return {};
+                throw std::runtime_error("Unsupported color depth"s);
             }
 
-            int width = info_header.width;
-            int height = info_header.height;
-            int stride = GetBMPStride(width);
+            decode_info.width = info_header.width;
+            decode_info.height = info_header.height < 0 ? -info_header.height : info_header.height;
+            decode_bytes_per_pixel = info_header.bit_count / 8;
+            decode_info.format = decode_bytes_per_pixel == 4 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+
+            // a negative height marks a top-down bitmap
+            decode_cursor.native = info_header.height < 0 ? RowOrder::TOP_DOWN : RowOrder::BOTTOM_UP;
+            decode_cursor.order = decode_cursor.native;
+            decode_cursor.offset = file_header.offset_data;
+            decode_cursor.stride = GetBMPStride(decode_info.width, decode_bytes_per_pixel);
+            decode_cursor.height = decode_info.height;
+            decode_cursor.row = 0;
 
-            Image image(width, height, Color::Black());
+            return decode_info;
+        }
+
+        int BmpImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            RowCursor& cursor = decode_cursor;
+            const bool forward = cursor.order == cursor.native;
+            const int chunk_rows = std::max(1, BMP_READ_CHUNK_BYTES / cursor.stride);
 
-            if (info_header.bit_count == 32)
+            int done = 0;
+            const int rows = std::min(count_, cursor.height - cursor.row);
+
+            while (done < rows)
             {
-                for (int y = height - 1; y >= 0; --y)
+                // a run of consecutive rows in either order is one contiguous block of the file
+                const int chunk = std::min(chunk_rows, rows - done);
+                const int first_stored = forward ? cursor.row : cursor.height - cursor.row - chunk;
+
+                const uint8_t* block = decode_source.View(cursor.offset + static_cast<uint64_t>(first_stored) * cursor.stride, static_cast<size_t>(chunk) * cursor.stride);
+                if (!block)
                 {
-                    for (int x = 0; x < width; ++x)
-                    {
-                        uint8_t b = 0;
-                        uint8_t g = 0;
-                        uint8_t r = 0;
-                        uint8_t a = 0;
+                    return done;
+                }
 
-                        file.read(reinterpret_cast<char*>(&b), sizeof(uint8_t));
-                        file.read(reinterpret_cast<char*>(&g), sizeof(uint8_t));
-                        file.read(reinterpret_cast<char*>(&r), sizeof(uint8_t));
-                        file.read(reinterpret_cast<char*>(&a), sizeof(uint8_t));
+                for (int i = 0; i < chunk; ++i)
+                {
+                    const uint8_t* src = block + static_cast<size_t>(forward ? i : chunk - 1 - i) * cursor.stride;
+                    uint8_t* line = rows_ + (done + i) * stride_;
 
-                        if (!file)
+                    if (decode_bytes_per_pixel == 4)
+                    {
+                        if (decode_info.format == PixelFormat::RGBA8)
                         {
-                            return {};
+                            pixel_ops::BgraToRgba(src, line, decode_info.width);
+                        }
+                        else
+                        {
+                            pixel_ops::BgraToRgb(src, line, decode_info.width);
                         }
-                        Color pixel(r, g, b, a);
-                        image.SetPixel(x, y, pixel);
                     }
-                }
-            }
-            else if (info_header.bit_count == 24)
-            {
-                for (int y = height - 1; y >= 0; --y)
-                {
-                    for (int x = 0; x < width; ++x)
+                    else
                     {
-                        uint8_t b = 0;
-                        uint8_t g = 0;
-                        uint8_t r = 0;
-
-                        file.read(reinterpret_cast<char*>(&b), sizeof(uint8_t));
-                        file.read(reinterpret_cast<char*>(&g), sizeof(uint8_t));
-                        file.read(reinterpret_cast<char*>(&r), sizeof(uint8_t));
-
-                        if (!file)
+                        if (decode_info.format == PixelFormat::RGBA8)
                         {
-                            return {};
+                            pixel_ops::BgrToRgba(src, line, decode_info.width);
+                        }
+                        else
+                        {
+                            pixel_ops::BgrToRgb(src, line, decode_info.width);
                         }
-
-                        Color pixel(r, g, b, 255);
-                        image.SetPixel(x, y, pixel);
                     }
                 }
+
+                done += chunk;
+                cursor.row += chunk;
             }
-            else
+            return done;
+        }
+
+        void BmpImage::EndDecode()
+        {
+            decode_source.Close();
+        }
+
+        PixelFormat BmpImage::GetReadFormat() const noexcept
+        {
+            return decode_info.format;
+        }
+
+        bool BmpImage::SetReadFormat(PixelFormat format_)
+        {
+            if (format_ != PixelFormat::RGB8 && format_ != PixelFormat::RGBA8)
             {
-                throw std::runtime_error("Unsupported color depth"s);
-                return {};
+                return false;
             }
+            decode_info.format = format_;
+            return true;
+        }
 
-            file.close();
-            return image;
+        RowOrder BmpImage::GetReadOrder() const noexcept
+        {
+            return decode_cursor.order;
         }
 
-        bool BmpImage::SaveImageBMP(const Path& path_, const Image& image_) const
+        bool BmpImage::SetReadOrder(RowOrder order_)
         {
-            std::ofstream file(path_, std::ios::binary);
-            if (!file)
+            decode_cursor.order = order_;
+            return true;
+        }
+
+        void BmpImage::BeginEncode(const Path& path_, const ImageInfo& info_)
+        {
+            encode_file.close();
+            encode_file.clear();
+            encode_file.open(path_, std::ios::binary);
+            if (!encode_file)
             {
                 throw std::runtime_error("Failed to create BMP file: "s + path_.string());
-                return false;
             }
 
-            int width = image_.GetWidth();
-            int height = image_.GetHeight();
-            int row_stride = width * 3;
-            int stride = GetBMPStride(width);
+            // always 24-bit; RGBA8 rows are swizzled straight to BGR without an RGB8 copy
+            encode_info = info_;
+            encode_info.format = info_.format == PixelFormat::RGBA8 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+            int width = encode_info.width;
+            int height = encode_info.height;
+            int stride = GetBMPStride(width, 3);
 
             BitmapFileHeader file_header;
             file_header.file_type = 0x4D42;
@@ -146,44 +203,80 @@ namespace img_lib
             info_header.colors_used = 0;
             info_header.colors_important = 0x1000000;
 
-            file.write(reinterpret_cast<const char*>(&file_header), sizeof(file_header));
-            if (!file)
+            encode_file.write(reinterpret_cast<const char*>(&file_header), sizeof(file_header));
+            encode_file.write(reinterpret_cast<const char*>(&info_header), sizeof(info_header));
+            if (!encode_file)
             {
-                return false;
+                throw std::runtime_error("Failed to write BMP file: "s + path_.string());
             }
 
-            file.write(reinterpret_cast<const char*>(&info_header), sizeof(info_header));
-            if (!file)
-            {
-                return false;
-            }
+            encode_cursor.native = RowOrder::BOTTOM_UP;
+            encode_cursor.order = RowOrder::BOTTOM_UP;
+            encode_cursor.offset = file_header.offset_data;
+            encode_cursor.stride = stride;
+            encode_cursor.height = height;
+            encode_cursor.row = 0;
 
-            std::vector<uint8_t> row(stride);
+            // padding bytes past width * 3 stay zero
+            encode_buffer.assign(stride, 0);
+        }
 
-            for (int y = height - 1; y >= 0; --y)
+        void BmpImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            for (int i = 0; i < count_; ++i, ++encode_cursor.row)
             {
-                const Color* row_data = image_.GetLine(y);
-                for (int x = 0; x < width; ++x)
+                const uint8_t* row_data = rows_ + i * stride_;
+                if (encode_info.format == PixelFormat::RGBA8)
+                {
+                    pixel_ops::BgraToRgb(row_data, encode_buffer.data(), encode_info.width);
+                }
+                else
                 {
-                    row[x * 3 + 0] = static_cast<uint8_t>(row_data[x].b);
-                    row[x * 3 + 1] = static_cast<uint8_t>(row_data[x].g);
-                    row[x * 3 + 2] = static_cast<uint8_t>(row_data[x].r);
+                    pixel_ops::BgrToRgb(row_data, encode_buffer.data(), encode_info.width);
                 }
-                for (int x = row_stride; x < stride; ++x)
+
+                if (encode_cursor.order != encode_cursor.native)
                 {
-                    row[x] = 0;
+                    encode_file.seekp(encode_cursor.NextRowOffset(), std::ios::beg);
                 }
 
-                file.write(reinterpret_cast<const char*>(row.data()), stride);
-                if (!file)
+                encode_file.write(reinterpret_cast<const char*>(encode_buffer.data()), encode_cursor.stride);
+                if (!encode_file)
                 {
-                    return false;
+                    throw std::runtime_error("Failed to write BMP file"s);
                 }
             }
+        }
 
-            file.close();
+        void BmpImage::EndEncode()
+        {
+            encode_file.close();
+            if (!encode_file)
+            {
+                throw std::runtime_error("Failed to write BMP file"s);
+            }
+        }
+
+        void BmpImage::AbortEncode() noexcept
+        {
+            encode_file.close();
+        }
+
+        PixelFormat BmpImage::GetWriteFormat() const noexcept
+        {
+            return encode_info.format;
+        }
+
+        RowOrder BmpImage::GetWriteOrder() const noexcept
+        {
+            return encode_cursor.order;
+        }
+
+        bool BmpImage::SetWriteOrder(RowOrder order_)
+        {
+            encode_cursor.order = order_;
             return true;
-        }    
+        }
 
     } // end namespace bmp_image
 
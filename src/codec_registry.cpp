@@ -0,0 +1,206 @@
+#include "codec_registry.h"
+
+#include "ppm_image.h"
+#include "bmp_image.h"
+#include "ico_image.h"
+#include "tiff_image.h"
+#include "png_image.h"
+#include "jpeg_image.h"
+#include "gif_image.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+namespace img_lib
+{
+    // codecs with encoder settings take their member of EncodeOptions, the others ignore them
+    static void ApplyEncodeOptions(png_image::PngImage& codec_, const EncodeOptions& options_)
+    {
+        codec_.SetEncodeOptions(options_.png);
+    }
+
+    static void ApplyEncodeOptions(jpeg_image::JpegImage& codec_, const EncodeOptions& options_)
+    {
+        codec_.SetEncodeOptions(options_.jpeg);
+    }
+
+    template <typename Codec>
+    static void ApplyEncodeOptions(Codec&, const EncodeOptions&) noexcept {}
+
+    template <typename Codec, typename LoadFn, typename SaveFn, LoadFn LOAD, SaveFn SAVE>
+    class RegisteredCodec : public ImageCodec
+    {
+    public:
+
+        Image Load(const Path& path_) override
+        {
+            return std::invoke(LOAD, codec, path_);
+        }
+
+        void Save(const Path& path_, const ImageView& image_) override
+        {
+            if (!std::invoke(SAVE, codec, path_, image_))
+            {
+                throw std::runtime_error("Failed to save image: "s + path_.string());
+            }
+        }
+
+        ScanlineReader* GetReader() noexcept override
+        {
+            if constexpr (std::is_base_of_v<ScanlineReader, Codec>)
+            {
+                return &codec;
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+
+        ScanlineWriter* GetWriter() noexcept override
+        {
+            if constexpr (std::is_base_of_v<ScanlineWriter, Codec>)
+            {
+                return &codec;
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+
+        void SetEncodeOptions(const EncodeOptions& options_) override
+        {
+            ApplyEncodeOptions(codec, options_);
+        }
+
+    private:
+
+        Codec codec;
+    };
+
+    #define IMG_LIB_CODEC_FACTORY(Codec, Load, Save) \
+        [] () -> std::unique_ptr<ImageCodec> \
+        { \
+            return std::make_unique<RegisteredCodec<Codec, decltype(&Codec::Load), decltype(&Codec::Save), &Codec::Load, &Codec::Save>>(); \
+        }
+
+    static bool StartsWith(const uint8_t* data_, size_t size_, const char* magic_, size_t magic_size_) noexcept
+    {
+        return size_ >= magic_size_ && std::memcmp(data_, magic_, magic_size_) == 0;
+    }
+
+    static bool SniffPpm(const uint8_t* data_, size_t size_) noexcept
+    {
+        return size_ >= 3 && data_[0] == 'P' && (data_[1] == '3' || data_[1] == '6') && std::isspace(data_[2]);
+    }
+
+    static bool SniffBmp(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "BM", 2);
+    }
+
+    static bool SniffTiff(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "II*\0", 4) || StartsWith(data_, size_, "MM\0*", 4);
+    }
+
+    static bool SniffPng(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "\x89PNG\r\n\x1a\n", 8);
+    }
+
+    static bool SniffJpeg(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "\xFF\xD8\xFF", 3);
+    }
+
+    static bool SniffIco(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "\0\0\1\0", 4);
+    }
+
+    static bool SniffGif(const uint8_t* data_, size_t size_) noexcept
+    {
+        return StartsWith(data_, size_, "GIF87a", 6) || StartsWith(data_, size_, "GIF89a", 6);
+    }
+
+    const std::vector<CodecEntry>& GetRegisteredCodecs()
+    {
+        static const std::vector<CodecEntry> codecs =
+        {
+            { Format::PPM, "PPM"s, { ".ppm"s, ".p3"s }, SniffPpm, IMG_LIB_CODEC_FACTORY(ppm_image::PpmImage, LoadImagePPM, SaveImagePPM) },
+            { Format::BMP, "BMP"s, { ".bmp"s }, SniffBmp, IMG_LIB_CODEC_FACTORY(bmp_image::BmpImage, LoadImageBMP, SaveImageBMP) },
+            { Format::TIFF, "TIFF"s, { ".tiff"s, ".tif"s }, SniffTiff, IMG_LIB_CODEC_FACTORY(tiff_image::TiffImage, LoadImageTIFF, SaveImageTIFF) },
+            { Format::PNG, "PNG"s, { ".png"s }, SniffPng, IMG_LIB_CODEC_FACTORY(png_image::PngImage, LoadImagePNG, SaveImagePNG) },
+            { Format::JPEG, "JPEG"s, { ".jpeg"s, ".jpg"s }, SniffJpeg, IMG_LIB_CODEC_FACTORY(jpeg_image::JpegImage, LoadImageJPEG, SaveImageJPEG) },
+            { Format::ICO, "ICO"s, { ".ico"s }, SniffIco, IMG_LIB_CODEC_FACTORY(ico_image::IcoImage, LoadImageICO, SaveImageICO), 256 },
+            { Format::GIF, "GIF"s, { ".gif"s }, SniffGif, IMG_LIB_CODEC_FACTORY(gif_image::GifImage, LoadImageGIF, SaveImageGIF) },
+        };
+        return codecs;
+    }
+
+    #undef IMG_LIB_CODEC_FACTORY
+
+    const CodecEntry* FindCodec(Format format_) noexcept
+    {
+        for (const CodecEntry& entry : GetRegisteredCodecs())
+        {
+            if (entry.format == format_)
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    const CodecEntry* FindCodecByExtension(const Path& file_)
+    {
+        const std::string ext = file_.extension().string();
+
+        for (const CodecEntry& entry : GetRegisteredCodecs())
+        {
+            if (std::find(entry.extensions.begin(), entry.extensions.end(), ext) != entry.extensions.end())
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    const CodecEntry* SniffCodec(const uint8_t* data_, size_t size_) noexcept
+    {
+        for (const CodecEntry& entry : GetRegisteredCodecs())
+        {
+            if (entry.sniff(data_, size_))
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    const CodecEntry* SniffCodec(const Path& file_)
+    {
+        std::ifstream file(file_, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file: "s + file_.string());
+        }
+
+        uint8_t prefix[SNIFF_PREFIX_SIZE] = {};
+        file.read(reinterpret_cast<char*>(prefix), sizeof(prefix));
+
+        return SniffCodec(prefix, static_cast<size_t>(file.gcount()));
+    }
+
+    Format GetFormatByExtension(const Path& file_)
+    {
+        const CodecEntry* entry = FindCodecByExtension(file_);
+        return entry ? entry->format : Format::UNKNOWN;
+    }
+
+} // end namespace img_lib
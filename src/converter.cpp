@@ -0,0 +1,188 @@
+#include "converter.h"
+
+namespace img_lib
+{
+    Image Converter::LoadImage(const Path& input_file_)
+    {
+        return LoadWith(GetCodec(DetectInput(input_file_)), input_file_);
+    }
+
+    void Converter::SaveImage(const Path& output_file_, const ImageView& image_)
+    {
+        GetCodec(DetectOutput(output_file_)).Save(output_file_, image_);
+    }
+
+    void Converter::Recycle(Image&& image_)
+    {
+        PixelBuffer pixels = image_.ReleasePixels();
+        if (pixels.capacity() > buffer.capacity())
+        {
+            buffer = std::move(pixels);
+        }
+    }
+
+    void Converter::Convert(const Path& input_file_, const Path& output_file_)
+    {
+        std::error_code error;
+        if (!std::filesystem::equivalent(input_file_, output_file_, error))
+        {
+            ConvertInto(input_file_, output_file_, output_file_);
+            return;
+        }
+
+        // writing over the input: the image goes to a sibling file that replaces the input once
+        // complete, so the input is intact while it is read and after a failure; the sibling
+        // keeps the extension, which some writers read (.p3 for ASCII PPM)
+        Path temporary = output_file_;
+        temporary.replace_filename(output_file_.stem().string() + ".tmp"s + output_file_.extension().string());
+
+        try
+        {
+            ConvertInto(input_file_, output_file_, temporary);
+            std::filesystem::rename(temporary, output_file_);
+        }
+        catch (...)
+        {
+            std::filesystem::remove(temporary, error);
+            throw;
+        }
+    }
+
+    void Converter::ConvertInto(const Path& input_file_, const Path& output_file_, const Path& target_file_)
+    {
+        const CodecEntry& input = DetectInput(input_file_);
+        const CodecEntry& output = DetectOutput(output_file_);
+
+        ImageCodec& input_codec = GetCodec(input);
+        ImageCodec& output_codec = GetCodec(output);
+
+        ScanlineReader* reader = input_codec.GetReader();
+        ScanlineWriter* writer = output_codec.GetWriter();
+
+        if (reader && writer && resize_width == 0 && region_width == 0)
+        {
+            TranscodeImage(*reader, input_file_, *writer, target_file_, buffer);
+            return;
+        }
+
+        // the output size is known, so the decoder may shrink cheaply towards it
+        int min_width = resize_width;
+        int min_height = resize_height;
+        if (min_width == 0 && output.largest_saved > 0)
+        {
+            min_width = min_height = output.largest_saved;
+        }
+
+        Image image = region_width > 0 ? LoadRegion(input_codec, input_file_) : LoadWith(input_codec, input_file_, min_width, min_height);
+        if (!image)
+        {
+            throw std::runtime_error("Failed to load image: "s + input_file_.string());
+        }
+
+        if (resize_width > 0)
+        {
+            Image resized = image.ResizeImage(resize_width, resize_height, resize_filter);
+            Recycle(std::move(image));
+            image = std::move(resized);
+        }
+
+        output_codec.Save(target_file_, image);
+        Recycle(std::move(image));
+    }
+
+    void Converter::SetResize(int width_, int height_, resample::Filter filter_)
+    {
+        if (width_ <= 0 || height_ <= 0)
+        {
+            throw std::invalid_argument("Resize size must be positive"s);
+        }
+
+        resize_width = width_;
+        resize_height = height_;
+        resize_filter = filter_;
+    }
+
+    void Converter::SetRegion(int x_, int y_, int width_, int height_)
+    {
+        if (x_ < 0 || y_ < 0 || width_ <= 0 || height_ <= 0)
+        {
+            throw std::invalid_argument("Region must have a positive size and a corner inside the image"s);
+        }
+
+        region_x = x_;
+        region_y = y_;
+        region_width = width_;
+        region_height = height_;
+    }
+
+    Image Converter::LoadWith(ImageCodec& codec_, const Path& input_file_, int min_width_, int min_height_)
+    {
+        if (ScanlineReader* reader = codec_.GetReader())
+        {
+            return DecodeImage(*reader, input_file_, min_width_, min_height_, std::move(buffer));
+        }
+        return codec_.Load(input_file_);
+    }
+
+    Image Converter::LoadRegion(ImageCodec& codec_, const Path& input_file_)
+    {
+        if (ScanlineReader* reader = codec_.GetReader())
+        {
+            return DecodeRegion(*reader, input_file_, region_x, region_y, region_width, region_height, std::move(buffer));
+        }
+
+        Image image = codec_.Load(input_file_);
+        if (!image)
+        {
+            return image;
+        }
+
+        Image region = ImageView(image).Crop(region_x, region_y, region_width, region_height).ConvertTo(image.GetFormat());
+        Recycle(std::move(image));
+        return region;
+    }
+
+    const CodecEntry& Converter::DetectInput(const Path& input_file_) const
+    {
+        const CodecEntry* entry = SniffCodec(input_file_);
+        if (!entry)
+        {
+            throw std::runtime_error("Unknown input file format: "s + input_file_.string());
+        }
+        return *entry;
+    }
+
+    const CodecEntry& Converter::DetectOutput(const Path& output_file_) const
+    {
+        const CodecEntry* entry = FindCodecByExtension(output_file_);
+        if (!entry)
+        {
+            throw std::runtime_error("Unknown output file format: "s + output_file_.extension().string());
+        }
+        return *entry;
+    }
+
+    void Converter::SetEncodeOptions(const EncodeOptions& options_)
+    {
+        for (std::unique_ptr<ImageCodec>& codec : codecs)
+        {
+            if (codec)
+            {
+                codec->SetEncodeOptions(options_);
+            }
+        }
+        encode_options = options_;
+    }
+
+    ImageCodec& Converter::GetCodec(const CodecEntry& entry_)
+    {
+        std::unique_ptr<ImageCodec>& codec = codecs.at(static_cast<size_t>(entry_.format));
+        if (!codec)
+        {
+            codec = entry_.create();
+            codec->SetEncodeOptions(encode_options);
+        }
+        return *codec;
+    }
+
+} // end namespace img_lib
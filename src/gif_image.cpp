@@ -1,121 +1,375 @@
 #include "gif_image.h"
+#include "pixel_ops.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace img_lib
 {
 	namespace gif_image
 	{
+        GifImage::~GifImage()
+        {
+            ReleaseDecode();
+            ReleaseEncode();
+        }
+
 		const Image GifImage::LoadImageGIF(const Path& path_)
 		{
-            GifFileType* gif_file = DGifOpenFileName(path_.string().c_str(), nullptr);
-            if (!gif_file)
+            return DecodeImage(*this, path_);
+		}
+
+        bool GifImage::SaveImageGIF(const Path& path_, const ImageView& image_) // image is saved in grayscale
+        {
+            EncodeImage(*this, path_, image_);
+            return true;
+        }
+
+        ImageInfo GifImage::BeginDecode(const Path& path_)
+        {
+            ReleaseDecode();
+
+            decode_gif = DGifOpenFileName(path_.string().c_str(), nullptr);
+            if (!decode_gif)
             {
                 throw std::runtime_error("Failed to open GIF file: "s + path_.string());
             }
 
-            int error_code = DGifSlurp(gif_file);
-            if (error_code != GIF_OK)
+            try
+            {
+                ReadFrameHeader(path_);
+            }
+            catch (...)
+            {
+                ReleaseDecode();
+                throw;
+            }
+
+            decode_row = 0;
+            return decode_info;
+        }
+
+        // Reads the records up to the first image descriptor, so that only the graphic control
+        // block before it is kept; later frames of animations are never read.
+        void GifImage::ReadFrameHeader(const Path& path_)
+        {
+            int transparent = NO_TRANSPARENT_COLOR;
+
+            for (GifRecordType type = UNDEFINED_RECORD_TYPE; type != IMAGE_DESC_RECORD_TYPE;)
+            {
+                if (DGifGetRecordType(decode_gif, &type) == GIF_ERROR)
+                {
+                    throw std::runtime_error("Failed to read GIF file: "s + path_.string());
+                }
+
+                if (type == TERMINATE_RECORD_TYPE)
+                {
+                    throw std::runtime_error("GIF file has no image: "s + path_.string());
+                }
+
+                if (type != EXTENSION_RECORD_TYPE)
+                {
+                    continue;
+                }
+
+                int code = 0;
+                GifByteType* block = nullptr;
+                if (DGifGetExtension(decode_gif, &code, &block) == GIF_ERROR)
+                {
+                    throw std::runtime_error("Failed to read GIF file: "s + path_.string());
+                }
+
+                GraphicsControlBlock control;
+                if (code == GRAPHICS_EXT_FUNC_CODE && block && DGifExtensionToGCB(block[0], block + 1, &control) == GIF_OK)
+                {
+                    transparent = control.TransparentColor;
+                }
+
+                while (block)
+                {
+                    if (DGifGetExtensionNext(decode_gif, &block) == GIF_ERROR)
+                    {
+                        throw std::runtime_error("Failed to read GIF file: "s + path_.string());
+                    }
+                }
+            }
+
+            if (DGifGetImageDesc(decode_gif) == GIF_ERROR)
             {
-                DGifCloseFile(gif_file, nullptr);
                 throw std::runtime_error("Failed to read GIF file: "s + path_.string());
             }
 
-            if (gif_file->ImageCount != 1)
+            const GifImageDesc& frame = decode_gif->Image;
+            const ColorMapObject* color_map = frame.ColorMap ? frame.ColorMap : decode_gif->SColorMap;
+            if (!color_map)
             {
-                DGifCloseFile(gif_file, nullptr);
-                throw std::runtime_error("GIF file is not static: "s + path_.string());
+                throw std::runtime_error("GIF file has no color map: "s + path_.string());
             }
 
-            SavedImage* frame = &gif_file->SavedImages[0];
-            GifImageDesc& frame_desc = frame->ImageDesc;
+            frame_left = frame.Left;
+            frame_top = frame.Top;
+            frame_width = frame.Width;
+            frame_height = frame.Height;
+            frame_interlaced = frame.Interlace;
+            SetPalette(color_map, transparent);
+
+            // a frame reaching past the logical screen grows the canvas rather than being cut
+            decode_info = {
+                std::max(decode_gif->SWidth, frame_left + frame_width),
+                std::max(decode_gif->SHeight, frame_top + frame_height),
+                transparent == NO_TRANSPARENT_COLOR ? PixelFormat::RGB8 : PixelFormat::RGBA8 };
+
+            if (!frame_interlaced)
+            {
+                decode_indices.resize(frame_width);
+                return;
+            }
 
-            Image image(frame_desc.Width, frame_desc.Height);
+            // interlaced lines come in four passes, so the frame is read whole
+            static const int PASS_OFFSETS[] = { 0, 4, 2, 1 };
+            static const int PASS_STEPS[] = { 8, 8, 4, 2 };
 
-            for (int y = 0; y < frame_desc.Height; ++y)
+            decode_indices.resize(static_cast<size_t>(frame_width) * frame_height);
+            for (int pass = 0; pass < 4; ++pass)
             {
-                for (int x = 0; x < frame_desc.Width; ++x)
+                for (int y = PASS_OFFSETS[pass]; y < frame_height; y += PASS_STEPS[pass])
                 {
-                    int pixel_index = y * frame_desc.Width + x;
-                    GifByteType* pixel = &frame->RasterBits[pixel_index];
-                    Color color =
+                    if (DGifGetLine(decode_gif, &decode_indices[static_cast<size_t>(y) * frame_width], frame_width) == GIF_ERROR)
                     {
-                        gif_file->SColorMap->Colors[*pixel].Red,
-                        gif_file->SColorMap->Colors[*pixel].Green,
-                        gif_file->SColorMap->Colors[*pixel].Blue,
-                        255
-                    };
-                    image.SetPixel(x, y, color);
+                        throw std::runtime_error("Failed to read GIF file: "s + path_.string());
+                    }
                 }
             }
+        }
+
+        void GifImage::SetPalette(const ColorMapObject* color_map_, int transparent_)
+        {
+            // indices past the end of the map are opaque black
+            decode_palette.fill(0xFF000000u);
+
+            const int count = std::min(color_map_->ColorCount, static_cast<int>(decode_palette.size()));
+            for (int i = 0; i < count; ++i)
+            {
+                const GifColorType& color = color_map_->Colors[i];
+                decode_palette[i] = color.Red | color.Green << 8 | color.Blue << 16 | 0xFF000000u;
+            }
 
-            DGifCloseFile(gif_file, nullptr);
+            if (transparent_ >= 0 && transparent_ < static_cast<int>(decode_palette.size()))
+            {
+                decode_palette[transparent_] &= 0x00FFFFFFu;
+                decode_background = 0;
+                return;
+            }
 
-            return image;
-		}
+            // the background index is into the global map, whatever map the frame uses
+            const ColorMapObject* screen_map = decode_gif->SColorMap;
+            decode_background = 0xFF000000u;
+            if (screen_map && decode_gif->SBackGroundColor < screen_map->ColorCount)
+            {
+                const GifColorType& color = screen_map->Colors[decode_gif->SBackGroundColor];
+                decode_background = color.Red | color.Green << 8 | color.Blue << 16 | 0xFF000000u;
+            }
+        }
+
+        PixelFormat GifImage::GetReadFormat() const noexcept
+        {
+            return decode_info.format;
+        }
 
-        bool GifImage::SaveImageGIF(const Path& path_, const Image& image_) const // image is saved in grayscale
+        bool GifImage::SetReadFormat(PixelFormat format_)
         {
-            GifFileType* gif_file = EGifOpenFileName(path_.string().c_str(), false, nullptr);
-            if (!gif_file)
+            if (format_ != PixelFormat::RGB8 && format_ != PixelFormat::RGBA8)
+            {
+                return false;
+            }
+            decode_info.format = format_;
+            return true;
+        }
+
+        static void FillColor(uint8_t* dst_, uint32_t color_, int channels_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, dst_ += channels_)
+            {
+                std::memcpy(dst_, &color_, channels_);
+            }
+        }
+
+        int GifImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            const int rows = std::min(count_, decode_info.height - decode_row);
+            const int channels = GetChannelCount(decode_info.format);
+            const int right = frame_left + frame_width;
+
+            for (int i = 0; i < rows; ++i, ++decode_row)
+            {
+                uint8_t* line = rows_ + i * stride_;
+
+                const int y = decode_row - frame_top;
+                if (y < 0 || y >= frame_height)
+                {
+                    FillColor(line, decode_background, channels, decode_info.width);
+                    continue;
+                }
+
+                const GifPixelType* indices = decode_indices.data();
+                if (frame_interlaced)
+                {
+                    indices += static_cast<size_t>(y) * frame_width;
+                }
+                else if (DGifGetLine(decode_gif, decode_indices.data(), frame_width) == GIF_ERROR)
+                {
+                    ReleaseDecode();
+                    throw std::runtime_error("Failed to read line from GIF file"s);
+                }
+
+                FillColor(line, decode_background, channels, frame_left);
+                if (channels == 4)
+                {
+                    pixel_ops::PaletteToRgba(indices, decode_palette.data(), line + frame_left * 4, frame_width);
+                }
+                else
+                {
+                    pixel_ops::PaletteToRgb(indices, decode_palette.data(), line + frame_left * 3, frame_width);
+                }
+                FillColor(line + right * channels, decode_background, channels, decode_info.width - right);
+            }
+            return rows;
+        }
+
+        void GifImage::EndDecode()
+        {
+            ReleaseDecode();
+        }
+
+        void GifImage::BeginEncode(const Path& path_, const ImageInfo& info_)
+        {
+            ReleaseEncode();
+
+            encode_gif = EGifOpenFileName(path_.string().c_str(), false, nullptr);
+            if (!encode_gif)
             {
                 throw std::runtime_error("Failed to create GIF file: "s + path_.string());
             }
 
-            EGifSetGifVersion(gif_file, true);
+            EGifSetGifVersion(encode_gif, true);
 
-            ColorMapObject* color_map = GifMakeMapObject(256, nullptr);
-            if (!color_map)
+            encode_color_map = GifMakeMapObject(256, nullptr);
+            if (!encode_color_map)
             {
-                EGifCloseFile(gif_file, nullptr);
+                ReleaseEncode();
                 throw std::runtime_error("Failed to create color map for GIF file: "s + path_.string());
             }
 
             for (int i = 0; i < 256; ++i)
             {
-                color_map->Colors[i].Red = i;
-                color_map->Colors[i].Green = i;
-                color_map->Colors[i].Blue = i;
+                encode_color_map->Colors[i].Red = i;
+                encode_color_map->Colors[i].Green = i;
+                encode_color_map->Colors[i].Blue = i;
             }
 
-            gif_file->SColorMap = color_map;
-            int width = image_.GetWidth();
-            int height = image_.GetHeight();
+            // the palette is a gray ramp, so gray sources are written as they are and color ones
+            // are averaged here
+            encode_info = info_;
+            if (IsGray(info_.format))
+            {
+                encode_info.format = PixelFormat::GRAY8;
+            }
+            else
+            {
+                encode_info.format = info_.format == PixelFormat::RGBA8 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+            }
 
-            if (EGifPutScreenDesc(gif_file, width, height, 8, 0, color_map) == GIF_ERROR)
+            if (EGifPutScreenDesc(encode_gif, encode_info.width, encode_info.height, 8, 0, encode_color_map) == GIF_ERROR)
             {
-                GifFreeMapObject(color_map);
-                EGifCloseFile(gif_file, nullptr);
+                ReleaseEncode();
                 throw std::runtime_error("Failed to set screen description for GIF file: "s + path_.string());
             }
 
-            if (EGifPutImageDesc(gif_file, 0, 0, width, height, false, nullptr) == GIF_ERROR)
+            if (EGifPutImageDesc(encode_gif, 0, 0, encode_info.width, encode_info.height, false, nullptr) == GIF_ERROR)
             {
-                GifFreeMapObject(color_map);
-                EGifCloseFile(gif_file, nullptr);
+                ReleaseEncode();
                 throw std::runtime_error("Failed to set image description for GIF file: "s + path_.string());
             }
 
-            for (int y = 0; y < height; ++y)
+            encode_buffer.resize(encode_info.width);
+        }
+
+        PixelFormat GifImage::GetWriteFormat() const noexcept
+        {
+            return encode_info.format;
+        }
+
+        void GifImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            const int channels = GetChannelCount(encode_info.format);
+
+            for (int y = 0; y < count_; ++y)
             {
-                for (int x = 0; x < width; ++x)
+                const uint8_t* line = rows_ + y * stride_;
+
+                // EGifPutLine() masks the line in place, so even gray rows go through the buffer
+                if (channels == 1)
                 {
-                    const Color& color = image_.GetPixel(x, y);
-                    GifByteType pixel = (GifByteType)((color.r + color.g + color.b) / 3);
-                    if (EGifPutPixel(gif_file, pixel) == GIF_ERROR)
+                    std::copy(line, line + encode_info.width, encode_buffer.begin());
+                }
+                else
+                {
+                    for (int x = 0; x < encode_info.width; ++x, line += channels)
                     {
-                        GifFreeMapObject(color_map);
-                        EGifCloseFile(gif_file, nullptr);
-                        throw std::runtime_error("Failed to write pixel to GIF file: "s + path_.string());
+                        encode_buffer[x] = (GifPixelType)((line[0] + line[1] + line[2]) / 3);
                     }
                 }
+
+                if (EGifPutLine(encode_gif, encode_buffer.data(), encode_info.width) == GIF_ERROR)
+                {
+                    ReleaseEncode();
+                    throw std::runtime_error("Failed to write line to GIF file"s);
+                }
             }
+        }
+
+        void GifImage::EndEncode()
+        {
+            GifFreeMapObject(encode_color_map);
+            encode_color_map = nullptr;
 
-            GifFreeMapObject(color_map);
-            if (EGifCloseFile(gif_file, nullptr) == GIF_ERROR)
+            const int error_code = EGifCloseFile(encode_gif, nullptr);
+            encode_gif = nullptr;
+
+            if (error_code == GIF_ERROR)
             {
-                throw std::runtime_error("Failed to close GIF file: "s + path_.string());
+                throw std::runtime_error("Failed to close GIF file"s);
             }
+        }
 
-            return true;
+        void GifImage::AbortEncode() noexcept
+        {
+            ReleaseEncode();
+        }
+
+        void GifImage::ReleaseDecode() noexcept
+        {
+            if (decode_gif)
+            {
+                DGifCloseFile(decode_gif, nullptr);
+                decode_gif = nullptr;
+            }
+            decode_indices.clear();
+            decode_indices.shrink_to_fit();
+        }
+
+        void GifImage::ReleaseEncode() noexcept
+        {
+            if (encode_color_map)
+            {
+                GifFreeMapObject(encode_color_map);
+                encode_color_map = nullptr;
+            }
+            if (encode_gif)
+            {
+                EGifCloseFile(encode_gif, nullptr);
+                encode_gif = nullptr;
+            }
         }
 	}
-}
\ No newline at end of file
+}
@@ -1,4 +1,6 @@
 #include "ico_image.h"
+#include "pixel_ops.h"
+#include "resample.h"
 
 #include <algorithm>
 
@@ -74,7 +76,7 @@ namespace img_lib
                 return {};
             }
 
-            Image image(width, height, Color::Black());
+            Image image(width, height, PixelBuffer());
 
             if (bit_count == 32)
             {
@@ -136,7 +138,7 @@ namespace img_lib
             return image;
         }
 
-        bool IcoImage::SaveImageICO(const Path& path_, const Image& image_) const
+        bool IcoImage::SaveImageICO(const Path& path_, const ImageView& image_) const
         {
             std::ofstream file(path_, std::ios::binary);
             if (!file)
@@ -157,6 +159,18 @@ namespace img_lib
 
             uint32_t offset = static_cast<uint32_t>(sizeof(IcoHeader) + (num_images * sizeof(IconDirEntry)));
 
+            // every size comes from one mipmap chain of the source, resized in its own format;
+            // 16-bit sources go through RGBA8, which the icons are stored in anyway
+            std::vector<Image> icons;
+            if (GetBitDepth(image_.GetFormat()) == 16)
+            {
+                icons = resample::ResizeToSizes(image_.ConvertTo(PixelFormat::RGBA8), sizes, resample::Filter::TRIANGLE);
+            }
+            else
+            {
+                icons = resample::ResizeToSizes(image_, sizes, resample::Filter::TRIANGLE);
+            }
+
             for (const auto& size : sizes)
             {
                 int width = size.first;
@@ -181,12 +195,19 @@ namespace img_lib
                 offset += entry.size;
             }
 
-            for (const auto& size : sizes)
+            std::vector<uint8_t> row;
+
+            for (size_t i = 0; i < sizes.size(); ++i)
             {
-                int width = size.first;
-                int height = size.second;
+                int width = sizes[i].first;
+                int height = sizes[i].second;
 
-                Image resized_image = image_.ResizeImage(width, height);
+                // icons are stored as 32-bit BGRA; other formats are resized first, which is cheaper
+                Image& resized_image = icons[i];
+                if (resized_image.GetFormat() != PixelFormat::RGBA8)
+                {
+                    resized_image = resized_image.ConvertTo(PixelFormat::RGBA8);
+                }
 
                 BmpHeader bmpHeader{};
                 bmpHeader.biSize = sizeof(BmpHeader);
@@ -207,26 +228,15 @@ namespace img_lib
                     return false;
                 }
 
+                row.resize(static_cast<size_t>(width) * 4);
                 for (int y = height - 1; y >= 0; --y)
                 {
-                    for (int x = 0; x < width; ++x)
-                    {
-                        Color pixel = resized_image.GetPixel(x, y);
-
-                        uint8_t r = pixel.r;
-                        uint8_t g = pixel.g;
-                        uint8_t b = pixel.b;
-                        uint8_t a = pixel.a;
+                    pixel_ops::BgraToRgba(resized_image.GetRow(y), row.data(), width);
 
-                        file.write(reinterpret_cast<const char*>(&b), sizeof(uint8_t));
-                        file.write(reinterpret_cast<const char*>(&g), sizeof(uint8_t));
-                        file.write(reinterpret_cast<const char*>(&r), sizeof(uint8_t));
-                        file.write(reinterpret_cast<const char*>(&a), sizeof(uint8_t));
-
-                        if (!file)
-                        {
-                            return false;
-                        }
+                    file.write(reinterpret_cast<const char*>(row.data()), row.size());
+                    if (!file)
+                    {
+                        return false;
                     }
                 }
             }
@@ -1,18 +1,83 @@
 #include "image.h"
+#include "pixel_ops.h"
+#include "resample.h"
+#include "thread_pool.h"
+
+#include <algorithm>
 
 namespace img_lib
 {
-    Image::Image(int w_, int h_) : width(w_), height(h_), step(w_), pixels(w_ * h_) {}
+    static const int CONVERT_BAND_ROWS = 64;
+
+    static void CheckViewBounds(int x_, int y_, int width_, int height_)
+    {
+        if (x_ < 0 || x_ >= width_ || y_ < 0 || y_ >= height_)
+        {
+            throw std::out_of_range("Pixel coordinates out of range"s);
+        }
+    }
+
+    static void CheckCrop(int x_, int y_, int w_, int h_, int width_, int height_)
+    {
+        if (x_ < 0 || y_ < 0 || w_ < 0 || h_ < 0 || x_ > width_ - w_ || y_ > height_ - h_)
+        {
+            throw std::out_of_range("Crop rectangle out of range"s);
+        }
+    }
+
+    static void CheckColorFormat(PixelFormat format_)
+    {
+        if (format_ != PixelFormat::RGBA8)
+        {
+            throw std::logic_error("Color access requires an RGBA8 image"s);
+        }
+    }
+
+    static Image ConvertRows(const uint8_t* data_, int width_, int height_, size_t stride_, PixelFormat src_format_, PixelFormat dst_format_)
+    {
+        Image converted(width_, height_, dst_format_);
+
+        ParallelFor(height_, CONVERT_BAND_ROWS, [&](int begin_, int end_)
+        {
+            for (int y = begin_; y < end_; ++y)
+            {
+                pixel_ops::ConvertPixels(data_ + static_cast<ptrdiff_t>(y) * stride_, src_format_, converted.GetRow(y), dst_format_, width_);
+            }
+        });
+        return converted;
+    }
 
-    Image::Image(int w_, int h_, Color fill_) : width(w_), height(h_), step(w_), pixels(w_* h_, fill_) {}
+    Image::Image(int w_, int h_) : Image(w_, h_, Color(0, 0, 0, 0)) {}
+
+    Image::Image(int w_, int h_, Color fill_) : Image(w_, h_, PixelFormat::RGBA8)
+    {
+        Color* data = reinterpret_cast<Color*>(pixels.data());
+        std::fill(data, data + pixels.size() / sizeof(Color), fill_);
+    }
 
-    Image::Image(const Image& other_) : width(other_.width), height(other_.height), step(other_.step), pixels(other_.pixels) {}
+    Image::Image(int w_, int h_, PixelBuffer&& buffer_) : Image(w_, h_, PixelFormat::RGBA8, std::move(buffer_)) {}
 
-    Image::Image(Image&& other_) noexcept : width(other_.width), height(other_.height), step(other_.step), pixels(std::move(other_.pixels))
+    Image::Image(int w_, int h_, PixelFormat format_, PixelBuffer&& buffer_) : width(w_), height(h_), stride(GetAlignedStride(w_, format_)), format(format_), pixels(std::move(buffer_))
+    {
+        pixels.resize(stride * h_);
+    }
+
+    Image::Image(int w_, int h_, int step_, PixelBuffer&& buffer_) : width(w_), height(h_), stride(static_cast<size_t>(step_) * sizeof(Color)), pixels(std::move(buffer_))
+    {
+        if (step_ < w_)
+        {
+            throw std::invalid_argument("Image step is smaller than its width"s);
+        }
+        pixels.resize(stride * h_);
+    }
+
+    Image::Image(const Image& other_) : width(other_.width), height(other_.height), stride(other_.stride), format(other_.format), pixels(other_.pixels) {}
+
+    Image::Image(Image&& other_) noexcept : width(other_.width), height(other_.height), stride(other_.stride), format(other_.format), pixels(std::move(other_.pixels))
     {
         other_.width = 0;
         other_.height = 0;
-        other_.step = 0;
+        other_.stride = 0;
     }
 
     Image& Image::operator=(const Image& other_)
@@ -21,7 +86,8 @@ namespace img_lib
         {
             width = other_.width;
             height = other_.height;
-            step = other_.step;
+            stride = other_.stride;
+            format = other_.format;
             pixels = other_.pixels;
         }
         return *this;
@@ -33,53 +99,102 @@ namespace img_lib
         {
             width = other_.width;
             height = other_.height;
-            step = other_.step;
+            stride = other_.stride;
+            format = other_.format;
             pixels = std::move(other_.pixels);
 
             other_.width = 0;
             other_.height = 0;
-            other_.step = 0;
+            other_.stride = 0;
         }
         return *this;
     }
 
+    Image::operator ImageView() const noexcept
+    {
+        return GetView();
+    }
+
+    Image::operator MutableImageView() noexcept
+    {
+        return GetView();
+    }
+
+    ImageView Image::GetView() const noexcept
+    {
+        return ImageView(pixels.data(), width, height, stride, format);
+    }
+
+    MutableImageView Image::GetView() noexcept
+    {
+        return MutableImageView(pixels.data(), width, height, stride, format);
+    }
+
+    ImageView Image::Crop(int x_, int y_, int w_, int h_) const
+    {
+        return GetView().Crop(x_, y_, w_, h_);
+    }
+
+    MutableImageView Image::Crop(int x_, int y_, int w_, int h_)
+    {
+        return GetView().Crop(x_, y_, w_, h_);
+    }
+
     const Color& Image::GetPixel(int x_, int y_) const
     {
         CheckBounds(x_, y_);
-        return pixels[y_ * step + x_];
+        return GetLine(y_)[x_];
     }
 
     Color& Image::GetPixel(int x_, int y_)
     {
         CheckBounds(x_, y_);
-        return pixels[y_ * step + x_];
+        return GetLine(y_)[x_];
     }
 
-    void Image::SetPixel(int x_, int y_, const Color& pixel_) 
+    void Image::SetPixel(int x_, int y_, const Color& pixel_)
     {
-        pixels[y_ * width + x_] = pixel_;
+        GetLine(y_)[x_] = pixel_;
     }
 
-    std::vector<Color>& Image::GetPixels() noexcept
+    PixelBuffer& Image::GetPixels() noexcept
     {
         return pixels;
     }
-     
-    const std::vector<Color>& Image::GetPixels() const noexcept
+
+    const PixelBuffer& Image::GetPixels() const noexcept
     {
         return pixels;
     }
 
-    Color* Image::GetLine(int y_) noexcept
+    PixelBuffer Image::ReleasePixels() noexcept
+    {
+        width = 0;
+        height = 0;
+        stride = 0;
+        return std::move(pixels);
+    }
+
+    Color* Image::GetLine(int y_)
     {
-        CheckBounds(0, y_);
-        return &pixels[y_ * step];
+        CheckColorFormat(format);
+        return reinterpret_cast<Color*>(GetRow(y_));
     }
 
-    const Color* Image::GetLine(int y_) const noexcept
+    const Color* Image::GetLine(int y_) const
     {
-        CheckBounds(0, y_);
-        return &pixels[y_ * step];
+        CheckColorFormat(format);
+        return reinterpret_cast<const Color*>(GetRow(y_));
+    }
+
+    uint8_t* Image::GetRow(int y_) noexcept
+    {
+        return pixels.data() + y_ * stride;
+    }
+
+    const uint8_t* Image::GetRow(int y_) const noexcept
+    {
+        return pixels.data() + y_ * stride;
     }
 
     int Image::GetWidth() const noexcept
@@ -92,9 +207,33 @@ namespace img_lib
         return height;
     }
 
+    PixelFormat Image::GetFormat() const noexcept
+    {
+        return format;
+    }
+
     int Image::GetStep() const noexcept
     {
-        return step;
+        return static_cast<int>(stride / GetBytesPerPixel(format));
+    }
+
+    size_t Image::GetStrideBytes() const noexcept
+    {
+        return stride;
+    }
+
+    int Image::GetAlignedStep(int width_) noexcept
+    {
+        return static_cast<int>(GetAlignedStride(width_, PixelFormat::RGBA8) / sizeof(Color));
+    }
+
+    size_t Image::GetAlignedStride(int width_, PixelFormat format_) noexcept
+    {
+        // 3- and 6-byte pixels need three cache lines to end a row on a pixel boundary
+        const size_t bytes_per_pixel = GetBytesPerPixel(format_);
+        const size_t granule = bytes_per_pixel % 3 == 0 ? IMAGE_ROW_ALIGNMENT * 3 : IMAGE_ROW_ALIGNMENT;
+
+        return (static_cast<size_t>(width_) * bytes_per_pixel + granule - 1) / granule * granule;
     }
 
     const uint8_t* Image::GetData() const noexcept
@@ -103,54 +242,175 @@ namespace img_lib
         {
             return nullptr;
         }
-        return reinterpret_cast<const uint8_t*>(pixels.data());
+        return pixels.data();
+    }
+
+    Image Image::ConvertTo(PixelFormat format_) const
+    {
+        return GetView().ConvertTo(format_);
     }
 
     Image Image::ResizeImage(int new_width_, int new_height_) const
     {
-        Image resizedImage(new_width_, new_height_);
+        return GetView().ResizeImage(new_width_, new_height_);
+    }
 
-        int oldWidth = GetWidth();
-        int oldHeight = GetHeight();
+    Image Image::ResizeImage(int new_width_, int new_height_, resample::Filter filter_) const
+    {
+        return GetView().ResizeImage(new_width_, new_height_, filter_);
+    }
 
-        for (int y = 0; y < new_height_; ++y)
+    void Image::CheckBounds(int x_, int y_) const
+    {
+        if (x_ < 0 || x_ >= width || y_ < 0 || y_ >= height)
         {
-            for (int x = 0; x < new_width_; ++x)
-            {
-                float srcX = x * static_cast<float>(oldWidth) / static_cast<float>(new_width_);
-                float srcY = y * static_cast<float>(oldHeight) / static_cast<float>(new_height_);
+            throw std::out_of_range("Pixel coordinates out of range"s);
+        }
+    }
 
-                int x1 = static_cast<int>(srcX);
-                int y1 = static_cast<int>(srcY);
-                int x2 = std::min(x1 + 1, oldWidth - 1);
-                int y2 = std::min(y1 + 1, oldHeight - 1);
+    ImageView::ImageView(const Color* data_, int w_, int h_, int step_) noexcept
+        : ImageView(reinterpret_cast<const uint8_t*>(data_), w_, h_, static_cast<size_t>(step_) * sizeof(Color), PixelFormat::RGBA8) {}
 
-                float dx = srcX - x1;
-                float dy = srcY - y1;
+    ImageView::ImageView(const uint8_t* data_, int w_, int h_, size_t stride_, PixelFormat format_) noexcept : data(data_), width(w_), height(h_), stride(stride_), format(format_) {}
 
-                Color p1 = GetPixel(x1, y1);
-                Color p2 = GetPixel(x2, y1);
-                Color p3 = GetPixel(x1, y2);
-                Color p4 = GetPixel(x2, y2);
+    const Color& ImageView::GetPixel(int x_, int y_) const
+    {
+        CheckViewBounds(x_, y_, width, height);
+        return GetLine(y_)[x_];
+    }
 
-                Color newColor;
-                newColor.r = static_cast<uint8_t>((1 - dx) * (1 - dy) * p1.r + dx * (1 - dy) * p2.r + (1 - dx) * dy * p3.r + dx * dy * p4.r);
-                newColor.g = static_cast<uint8_t>((1 - dx) * (1 - dy) * p1.g + dx * (1 - dy) * p2.g + (1 - dx) * dy * p3.g + dx * dy * p4.g);
-                newColor.b = static_cast<uint8_t>((1 - dx) * (1 - dy) * p1.b + dx * (1 - dy) * p2.b + (1 - dx) * dy * p3.b + dx * dy * p4.b);
-                newColor.a = static_cast<uint8_t>((1 - dx) * (1 - dy) * p1.a + dx * (1 - dy) * p2.a + (1 - dx) * dy * p3.a + dx * dy * p4.a);
+    const Color* ImageView::GetLine(int y_) const
+    {
+        CheckColorFormat(format);
+        return reinterpret_cast<const Color*>(GetRow(y_));
+    }
 
-                resizedImage.SetPixel(x, y, newColor);
-            }
+    const uint8_t* ImageView::GetRow(int y_) const noexcept
+    {
+        return data + static_cast<ptrdiff_t>(y_) * stride;
+    }
+
+    int ImageView::GetWidth() const noexcept
+    {
+        return width;
+    }
+
+    int ImageView::GetHeight() const noexcept
+    {
+        return height;
+    }
+
+    PixelFormat ImageView::GetFormat() const noexcept
+    {
+        return format;
+    }
+
+    int ImageView::GetStep() const noexcept
+    {
+        return static_cast<int>(stride / GetBytesPerPixel(format));
+    }
+
+    size_t ImageView::GetStrideBytes() const noexcept
+    {
+        return stride;
+    }
+
+    ImageView ImageView::Crop(int x_, int y_, int w_, int h_) const
+    {
+        CheckCrop(x_, y_, w_, h_, width, height);
+        return ImageView(GetRow(y_) + static_cast<size_t>(x_) * GetBytesPerPixel(format), w_, h_, stride, format);
+    }
+
+    Image ImageView::ConvertTo(PixelFormat format_) const
+    {
+        return ConvertRows(data, width, height, stride, format, format_);
+    }
+
+    Image ImageView::ResizeImage(int new_width_, int new_height_) const
+    {
+        if (GetBitDepth(format) == 16)
+        {
+            return ConvertTo(PixelFormat::RGBA8).ResizeImage(new_width_, new_height_).ConvertTo(format);
         }
+
+        Image resizedImage(new_width_, new_height_, format);
+        resample::ResizeBilinear(*this, resizedImage);
         return resizedImage;
     }
 
-    void Image::CheckBounds(int x_, int y_) const
+    Image ImageView::ResizeImage(int new_width_, int new_height_, resample::Filter filter_) const
     {
-        if (x_ < 0 || x_ >= width || y_ < 0 || y_ >= height)
+        if (GetBitDepth(format) == 16)
         {
-            throw std::out_of_range("Pixel coordinates out of range"s);
+            return ConvertTo(PixelFormat::RGBA8).ResizeImage(new_width_, new_height_, filter_).ConvertTo(format);
         }
+
+        Image resizedImage(new_width_, new_height_, format);
+        resample::Resize(*this, resizedImage, filter_);
+        return resizedImage;
+    }
+
+    MutableImageView::MutableImageView(Color* data_, int w_, int h_, int step_) noexcept
+        : MutableImageView(reinterpret_cast<uint8_t*>(data_), w_, h_, static_cast<size_t>(step_) * sizeof(Color), PixelFormat::RGBA8) {}
+
+    MutableImageView::MutableImageView(uint8_t* data_, int w_, int h_, size_t stride_, PixelFormat format_) noexcept : data(data_), width(w_), height(h_), stride(stride_), format(format_) {}
+
+    MutableImageView::operator ImageView() const noexcept
+    {
+        return ImageView(data, width, height, stride, format);
+    }
+
+    Color& MutableImageView::GetPixel(int x_, int y_) const
+    {
+        CheckViewBounds(x_, y_, width, height);
+        return GetLine(y_)[x_];
+    }
+
+    Color* MutableImageView::GetLine(int y_) const
+    {
+        CheckColorFormat(format);
+        return reinterpret_cast<Color*>(GetRow(y_));
+    }
+
+    uint8_t* MutableImageView::GetRow(int y_) const noexcept
+    {
+        return data + static_cast<ptrdiff_t>(y_) * stride;
+    }
+
+    int MutableImageView::GetWidth() const noexcept
+    {
+        return width;
+    }
+
+    int MutableImageView::GetHeight() const noexcept
+    {
+        return height;
+    }
+
+    PixelFormat MutableImageView::GetFormat() const noexcept
+    {
+        return format;
+    }
+
+    int MutableImageView::GetStep() const noexcept
+    {
+        return static_cast<int>(stride / GetBytesPerPixel(format));
+    }
+
+    size_t MutableImageView::GetStrideBytes() const noexcept
+    {
+        return stride;
+    }
+
+    void MutableImageView::SetPixel(int x_, int y_, const Color& pixel_) const
+    {
+        GetLine(y_)[x_] = pixel_;
+    }
+
+    MutableImageView MutableImageView::Crop(int x_, int y_, int w_, int h_) const
+    {
+        CheckCrop(x_, y_, w_, h_, width, height);
+        return MutableImageView(GetRow(y_) + static_cast<size_t>(x_) * GetBytesPerPixel(format), w_, h_, stride, format);
     }
 
-}//end namespace img_lib
\ No newline at end of file
+}//end namespace img_lib
@@ -0,0 +1,227 @@
+#include "input_source.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace img_lib
+{
+    // resident slack kept around the current view; a multiple of any page size we run on
+    static const uint64_t MAPPING_RELEASE_WINDOW = 8 << 20;
+
+    static bool MappingEnabled() noexcept
+    {
+        const char* value = std::getenv("IMG_LIB_MMAP");
+        return !value || std::strcmp(value, "0") != 0;
+    }
+
+#ifndef _WIN32
+    static void ReleasePages(const uint8_t* mapping_, uint64_t begin_, uint64_t end_) noexcept
+    {
+        madvise(const_cast<uint8_t*>(mapping_) + begin_, static_cast<size_t>(end_ - begin_), MADV_DONTNEED);
+    }
+#endif
+
+    InputSource::~InputSource()
+    {
+        Close();
+    }
+
+    void InputSource::Open(const Path& path_)
+    {
+        Close();
+
+        if (MappingEnabled() && Map(path_))
+        {
+            return;
+        }
+
+        file.clear();
+        file.open(path_, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file: "s + path_.string());
+        }
+
+        file.seekg(0, std::ios::end);
+        size = static_cast<uint64_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+    }
+
+    void InputSource::Close() noexcept
+    {
+    #ifdef _WIN32
+        if (mapping)
+        {
+            UnmapViewOfFile(mapping);
+        }
+        if (mapping_handle)
+        {
+            CloseHandle(mapping_handle);
+        }
+        if (file_handle)
+        {
+            CloseHandle(file_handle);
+        }
+        mapping_handle = nullptr;
+        file_handle = nullptr;
+    #else
+        if (mapping)
+        {
+            munmap(const_cast<uint8_t*>(mapping), static_cast<size_t>(size));
+        }
+    #endif
+
+        mapping = nullptr;
+        size = 0;
+        resident_begin = 0;
+        resident_end = 0;
+
+        if (file.is_open())
+        {
+            file.close();
+        }
+    }
+
+    bool InputSource::IsOpen() const noexcept
+    {
+        return mapping || file.is_open();
+    }
+
+    bool InputSource::IsMapped() const noexcept
+    {
+        return mapping != nullptr;
+    }
+
+    uint64_t InputSource::GetSize() const noexcept
+    {
+        return size;
+    }
+
+    const uint8_t* InputSource::View(uint64_t offset_, size_t size_)
+    {
+        if (offset_ > size || size_ > size - offset_)
+        {
+            return nullptr;
+        }
+
+        if (mapping)
+        {
+        #ifndef _WIN32
+            // a scan in either direction leaves the pages it has finished with in the page cache
+            // but drops them from this process; they fault back in if a codec seeks back
+            const uint64_t view_begin = offset_ & ~(MAPPING_RELEASE_WINDOW - 1);
+            const uint64_t view_end = offset_ + size_;
+
+            if (resident_begin == resident_end)
+            {
+                resident_begin = view_begin;
+                resident_end = view_end;
+            }
+
+            if (view_begin > resident_begin + MAPPING_RELEASE_WINDOW * 2)
+            {
+                ReleasePages(mapping, resident_begin, view_begin - MAPPING_RELEASE_WINDOW);
+                resident_begin = view_begin - MAPPING_RELEASE_WINDOW;
+            }
+            if (view_end + MAPPING_RELEASE_WINDOW * 2 < resident_end)
+            {
+                const uint64_t keep_end = (view_end + MAPPING_RELEASE_WINDOW) & ~(MAPPING_RELEASE_WINDOW - 1);
+                ReleasePages(mapping, keep_end, resident_end);
+                resident_end = keep_end;
+            }
+
+            resident_begin = std::min(resident_begin, view_begin);
+            resident_end = std::max(resident_end, view_end);
+        #endif
+            return mapping + offset_;
+        }
+
+        buffer.resize(std::max(buffer.size(), size_));
+
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset_), std::ios::beg);
+        file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(size_));
+
+        return file ? buffer.data() : nullptr;
+    }
+
+    bool InputSource::Map(const Path& path_)
+    {
+    #ifdef _WIN32
+        HANDLE handle = CreateFileW(path_.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0)
+        {
+            CloseHandle(handle);
+            return false;
+        }
+
+        HANDLE view_handle = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!view_handle)
+        {
+            CloseHandle(handle);
+            return false;
+        }
+
+        const void* view = MapViewOfFile(view_handle, FILE_MAP_READ, 0, 0, 0);
+        if (!view)
+        {
+            CloseHandle(view_handle);
+            CloseHandle(handle);
+            return false;
+        }
+
+        file_handle = handle;
+        mapping_handle = view_handle;
+        mapping = static_cast<const uint8_t*>(view);
+        size = static_cast<uint64_t>(file_size.QuadPart);
+        return true;
+    #else
+        const int fd = open(path_.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (view == MAP_FAILED)
+        {
+            return false;
+        }
+
+        madvise(view, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+
+        mapping = static_cast<const uint8_t*>(view);
+        size = static_cast<uint64_t>(info.st_size);
+        return true;
+    #endif
+    }
+
+} // end namespace img_lib
@@ -1,148 +1,1159 @@
 #include "jpeg_image.h"
+#include "input_source.h"
+#include "pixel_ops.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
 #include <setjmp.h>
+#include <string>
+
+extern "C"
+{
+    #include <jerror.h>
+}
 
 namespace img_lib
 {
     namespace jpeg_image
     {
-        struct my_error_mgr 
+        static FILE* OpenFile(const Path& path_, bool write_)
+        {
+            #ifdef _MSC_VER
+            return _wfopen(path_.wstring().c_str(), write_ ? L"wb" : L"rb");
+            #else
+            return fopen(path_.string().c_str(), write_ ? "wb" : "rb");
+            #endif
+        }
+
+        // Output axes that run backwards through the source, and whether rows and columns swap.
+        struct Orientation
         {
-            struct jpeg_error_mgr pub;
-            jmp_buf setjmp_buffer;
+            bool transpose = false;
+            bool mirror_x = false;
+            bool mirror_y = false;
         };
 
-        typedef struct my_error_mgr* my_error_ptr;
+        static Orientation GetOrientation(JpegTransform transform_) noexcept
+        {
+            switch (transform_)
+            {
+            case JpegTransform::FLIP_H:
+                return { false, true, false };
+            case JpegTransform::FLIP_V:
+                return { false, false, true };
+            case JpegTransform::TRANSPOSE:
+                return { true, false, false };
+            case JpegTransform::TRANSVERSE:
+                return { true, true, true };
+            case JpegTransform::ROTATE_90:
+                return { true, true, false };
+            case JpegTransform::ROTATE_180:
+                return { false, true, true };
+            case JpegTransform::ROTATE_270:
+                return { true, false, true };
+            default:
+                return {};
+            }
+        }
 
-        METHODDEF(void)
-        my_error_exit (j_common_ptr cinfo_) 
+        // Mirroring a block flips the sign of its odd frequencies along that axis.
+        static void TransformBlock(const JCOEF* src_, JCOEF* dst_, const Orientation& orientation_) noexcept
         {
-            my_error_ptr myerr = (my_error_ptr) cinfo_->err;
-            (*cinfo_->err->output_message) (cinfo_);
-            longjmp(myerr->setjmp_buffer, 1);
+            for (int v = 0; v < DCTSIZE; ++v)
+            {
+                for (int u = 0; u < DCTSIZE; ++u)
+                {
+                    const JCOEF coef = orientation_.transpose ? src_[u * DCTSIZE + v] : src_[v * DCTSIZE + u];
+                    const bool negate = (orientation_.mirror_x && (u & 1)) != (orientation_.mirror_y && (v & 1));
+                    dst_[v * DCTSIZE + u] = negate ? static_cast<JCOEF>(-coef) : coef;
+                }
+            }
+        }
+
+        // Blocks of the output, in output coordinates: the crop corner and the size before the crop.
+        struct BlockMapping
+        {
+            Orientation orientation;
+            int offset_x = 0;
+            int offset_y = 0;
+            int full_width = 0;
+            int full_height = 0;
+        };
+
+        // Output geometry of a transform and crop, in output pixels.
+        struct JpegImage::CropPlan
+        {
+            Orientation orientation;
+            int mcu_width = 0;
+            int mcu_height = 0;
+            int full_width = 0;     // before the crop, without the edge blocks that cannot move
+            int full_height = 0;
+            int left = 0;           // the part kept, its corner on a whole MCU
+            int top = 0;
+            int right = 0;
+            int bottom = 0;
+        };
+
+        // Coefficients read from the source and the arrays of the output they are copied into.
+        struct JpegImage::CoefficientCopy
+        {
+            jvirt_barray_ptr* src_coefs = nullptr;
+            jvirt_barray_ptr dst_coefs[MAX_COMPONENTS] = {};
+            BlockMapping mappings[MAX_COMPONENTS];
+        };
+
+        // jpeg_destination_mgr growing a vector, for JPEGs built in memory.
+        struct VectorDestination
+        {
+            jpeg_destination_mgr pub;
+            std::vector<JOCTET>* buffer;
+        };
+
+        static void InitVectorDestination(j_compress_ptr cinfo_)
+        {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo_->dest);
+            dest->buffer->resize(std::max<size_t>(dest->buffer->capacity(), 64 * 1024));
+            dest->pub.next_output_byte = dest->buffer->data();
+            dest->pub.free_in_buffer = dest->buffer->size();
+        }
+
+        static boolean EmptyVectorDestination(j_compress_ptr cinfo_)
+        {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo_->dest);
+            const size_t used = dest->buffer->size(); // always full here, free_in_buffer may be stale
+
+            // bad_alloc cannot unwind through libjpeg, it leaves as a libjpeg error instead
+            bool grown = true;
+            try
+            {
+                dest->buffer->resize(std::max<size_t>(2 * used, 64 * 1024));
+            }
+            catch (const std::bad_alloc&)
+            {
+                grown = false;
+            }
+            if (!grown)
+            {
+                ERREXIT1(cinfo_, JERR_OUT_OF_MEMORY, 0);
+            }
+
+            dest->pub.next_output_byte = dest->buffer->data() + used;
+            dest->pub.free_in_buffer = dest->buffer->size() - used;
+            return TRUE;
+        }
+
+        static void TermVectorDestination(j_compress_ptr cinfo_)
+        {
+            VectorDestination* dest = reinterpret_cast<VectorDestination*>(cinfo_->dest);
+            dest->buffer->resize(dest->buffer->size() - dest->pub.free_in_buffer);
+        }
+
+        static void SetVectorDestination(j_compress_ptr cinfo_, std::vector<JOCTET>& buffer_)
+        {
+            VectorDestination* dest = static_cast<VectorDestination*>((*cinfo_->mem->alloc_small)(reinterpret_cast<j_common_ptr>(cinfo_), JPOOL_PERMANENT, sizeof(VectorDestination)));
+            dest->pub.init_destination = InitVectorDestination;
+            dest->pub.empty_output_buffer = EmptyVectorDestination;
+            dest->pub.term_destination = TermVectorDestination;
+            dest->buffer = &buffer_;
+            cinfo_->dest = &dest->pub;
+        }
+
+        // Fills every block of dst_ (width_ x height_ blocks, rows_ per access) from src_; the
+        // blocks that fall outside the source are padding and get zeros. Both arrays belong to
+        // cinfo_. Only trivial locals, as libjpeg errors longjmp out of here.
+        static void CopyBlocks(j_decompress_ptr cinfo_, jvirt_barray_ptr src_, int src_width_, int src_height_,
+                               jvirt_barray_ptr dst_, int width_, int height_, int rows_, const BlockMapping& mapping_)
+        {
+            j_common_ptr common = reinterpret_cast<j_common_ptr>(cinfo_);
+            const Orientation& orientation = mapping_.orientation;
+
+            JBLOCKROW src_row = nullptr;
+            int src_row_y = -1;
+
+            for (int y = 0; y < height_; y += rows_)
+            {
+                JBLOCKARRAY dst_rows = (*cinfo_->mem->access_virt_barray)(common, dst_, y, rows_, TRUE);
+                for (int row = 0; row < rows_; ++row)
+                {
+                    for (int x = 0; x < width_; ++x)
+                    {
+                        int from_x = x + mapping_.offset_x;
+                        int from_y = y + row + mapping_.offset_y;
+                        if (orientation.mirror_x)
+                        {
+                            from_x = mapping_.full_width - 1 - from_x;
+                        }
+                        if (orientation.mirror_y)
+                        {
+                            from_y = mapping_.full_height - 1 - from_y;
+                        }
+                        if (orientation.transpose)
+                        {
+                            std::swap(from_x, from_y);
+                        }
+
+                        JCOEF* block = dst_rows[row][x];
+                        if (from_x < 0 || from_y < 0 || from_x >= src_width_ || from_y >= src_height_)
+                        {
+                            std::fill(block, block + DCTSIZE2, JCOEF(0));
+                            continue;
+                        }
+
+                        if (from_y != src_row_y)
+                        {
+                            src_row = (*cinfo_->mem->access_virt_barray)(common, src_, from_y, 1, FALSE)[0];
+                            src_row_y = from_y;
+                        }
+                        TransformBlock(src_row[from_x], block, orientation);
+                    }
+                }
+            }
+        }
+
+        // Where a baseline JPEG can be cut into bands at its restart markers.
+        struct RestartIndex
+        {
+            size_t sof_height = 0;          // offset of the frame height in the SOF segment
+            size_t data = 0;                // first byte of entropy-coded data
+            size_t end = 0;                 // the EOI marker after it
+            std::vector<size_t> markers;    // offset of every RSTn, in order
+        };
+
+        // Walks the markers up to the first scan and finds every restart marker in its data;
+        // false when the file is not a single scan followed by EOI.
+        static bool IndexRestarts(const uint8_t* file_, size_t size_, RestartIndex& index_)
+        {
+            if (size_ < 4 || file_[0] != 0xFF || file_[1] != 0xD8)
+            {
+                return false;
+            }
+
+            size_t pos = 2;
+            while (index_.data == 0)
+            {
+                while (pos + 1 < size_ && file_[pos] == 0xFF && file_[pos + 1] == 0xFF)
+                {
+                    ++pos;
+                }
+                if (pos + 4 > size_ || file_[pos] != 0xFF)
+                {
+                    return false;
+                }
+
+                const uint8_t marker = file_[pos + 1];
+                const size_t length = static_cast<size_t>(file_[pos + 2]) << 8 | file_[pos + 3];
+                if (length < 2 || pos + 2 + length > size_)
+                {
+                    return false;
+                }
+
+                // SOF0 to SOF15 apart from DHT, JPG and DAC
+                if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+                {
+                    index_.sof_height = pos + 5;
+                }
+                else if (marker == 0xDA)
+                {
+                    index_.data = pos + 2 + length;
+                }
+                pos += 2 + length;
+            }
+
+            for (size_t i = index_.data;;)
+            {
+                const uint8_t* next = static_cast<const uint8_t*>(std::memchr(file_ + i, 0xFF, size_ - i));
+                if (!next || next + 1 >= file_ + size_)
+                {
+                    return false;
+                }
+
+                const size_t at = next - file_;
+                const uint8_t marker = file_[at + 1];
+                if (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7)
+                {
+                    index_.markers.push_back(at);
+                    i = at + 2;
+                }
+                else if (marker == 0x00 || marker == 0xFF)
+                {
+                    i = at + (marker == 0x00 ? 2 : 1);  // stuffed zero or fill byte
+                }
+                else
+                {
+                    index_.end = at;
+                    return marker == JPEG_EOI && index_.sof_height != 0;
+                }
+            }
+        }
+
+        // jpeg_source_mgr reading a band: the file header, a run of entropy-coded data, then EOI.
+        struct BandSource
+        {
+            jpeg_source_mgr pub;
+            const JOCTET* data;
+            size_t data_size;
+            bool data_given;
+            bool end_given;
+        };
+
+        static const JOCTET END_OF_IMAGE[] = { 0xFF, JPEG_EOI };
+
+        static void InitBandSource(j_decompress_ptr) {}
+
+        static boolean FillBandSource(j_decompress_ptr cinfo_)
+        {
+            BandSource* src = reinterpret_cast<BandSource*>(cinfo_->src);
+            if (!src->data_given)
+            {
+                src->pub.next_input_byte = src->data;
+                src->pub.bytes_in_buffer = src->data_size;
+                src->data_given = true;
+                return TRUE;
+            }
+
+            // as jpeg_stdio_src() does at the end of a file, EOI again with a warning
+            if (src->end_given)
+            {
+                WARNMS(cinfo_, JWRN_JPEG_EOF);
+            }
+            src->pub.next_input_byte = END_OF_IMAGE;
+            src->pub.bytes_in_buffer = sizeof(END_OF_IMAGE);
+            src->end_given = true;
+            return TRUE;
         }
-        
-        void SaveSсanlineToImage(const JSAMPLE* row_, int y, Image& out_image_) 
+
+        static void SkipBandSource(j_decompress_ptr cinfo_, long count_)
         {
-            Color* line = out_image_.GetLine(y);
-            for (int x = 0; x < out_image_.GetWidth(); ++x) 
+            if (count_ <= 0)
+            {
+                return;
+            }
+
+            jpeg_source_mgr* src = cinfo_->src;
+            while (static_cast<size_t>(count_) > src->bytes_in_buffer)
             {
-                const JSAMPLE* pixel = row_ + x * 3;
-                line[x] = Color{pixel[0], pixel[1], pixel[2], {255}};
+                count_ -= static_cast<long>(src->bytes_in_buffer);
+                FillBandSource(cinfo_);
             }
+            src->next_input_byte += count_;
+            src->bytes_in_buffer -= count_;
+        }
+
+        static void TermBandSource(j_decompress_ptr) {}
+
+        static void SetBandSource(j_decompress_ptr cinfo_, const JOCTET* header_, size_t header_size_, const JOCTET* data_, size_t data_size_)
+        {
+            BandSource* src = static_cast<BandSource*>((*cinfo_->mem->alloc_small)(reinterpret_cast<j_common_ptr>(cinfo_), JPOOL_PERMANENT, sizeof(BandSource)));
+            src->pub.init_source = InitBandSource;
+            src->pub.fill_input_buffer = FillBandSource;
+            src->pub.skip_input_data = SkipBandSource;
+            src->pub.resync_to_restart = jpeg_resync_to_restart;
+            src->pub.term_source = TermBandSource;
+            src->pub.next_input_byte = header_;
+            src->pub.bytes_in_buffer = header_size_;
+            src->data = data_;
+            src->data_size = data_size_;
+            src->data_given = false;
+            src->end_given = false;
+            cinfo_->src = &src->pub;
+        }
+
+        void JpegImage::ErrorExit(j_common_ptr cinfo_)
+        {
+            ErrorManager* myerr = reinterpret_cast<ErrorManager*>(cinfo_->err);
+            (*cinfo_->err->format_message) (cinfo_, myerr->message);
+            longjmp(myerr->setjmp_buffer, 1);
+        }
+
+        JpegImage::~JpegImage()
+        {
+            ReleaseDecode();
+            ReleaseEncode();
         }
 
         const Image JpegImage::LoadImageJPEG(const Path& path_)
         {
-            jpeg_decompress_struct cinfo;
-            my_error_mgr jerr;
-    
-            FILE* file;
-            JSAMPARRAY buffer;
-            int row_stride;
+            return DecodeImage(*this, path_);
+        }
 
-            #ifdef _MSC_VER
-            if ((file = _wfopen(path_.wstring().c_str(), L"rb")) == NULL)
+        bool JpegImage::SaveImageJPEG(const Path& path_, const ImageView& image_)
+        {
+            EncodeImage(*this, path_, image_);
+            return true;
+        }
+
+        ImageInfo JpegImage::BeginDecode(const Path& path_)
+        {
+            ReleaseDecode();
+
+            decode_file = OpenFile(path_, false);
+            if (!decode_file)
             {
-            #else
-            if ((file = fopen(path_.string().c_str(), "rb")) == NULL) 
+                throw std::runtime_error("Failed to open JPEG file: "s + path_.string());
+            }
+
+            decode_cinfo.err = jpeg_std_error(&decode_error.pub);
+            decode_error.pub.error_exit = ErrorExit;
+
+            if (setjmp(decode_error.setjmp_buffer))
             {
-            #endif
-                return {};
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+
+            jpeg_create_decompress(&decode_cinfo);
+            decode_started = true;
+
+            jpeg_stdio_src(&decode_cinfo, decode_file);
+            (void) jpeg_read_header(&decode_cinfo, TRUE);
+
+            decode_path = path_;
+            decode_parallel = false;
+
+            // the output color space can still change, decompression starts with the first ReadRows()
+            decode_format = decode_cinfo.jpeg_color_space == JCS_GRAYSCALE ? PixelFormat::GRAY8 : PixelFormat::RGB8;
+            decode_decompressing = false;
+
+            return { static_cast<int>(decode_cinfo.image_width), static_cast<int>(decode_cinfo.image_height), decode_format };
+        }
+
+        PixelFormat JpegImage::GetReadFormat() const noexcept
+        {
+            return decode_format;
+        }
+
+        bool JpegImage::SetReadFormat(PixelFormat format_)
+        {
+            if (format_ != PixelFormat::GRAY8 && format_ != PixelFormat::RGB8 && format_ != PixelFormat::RGBA8)
+            {
+                return false;
+            }
+            decode_format = format_;
+            return true;
+        }
+
+        bool JpegImage::SetReadSize(int& width_, int& height_)
+        {
+            if (decode_decompressing)
+            {
+                return false;
+            }
+
+            if (setjmp(decode_error.setjmp_buffer))
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+
+            // libjpeg 9 scales the inverse DCT by N/8; the smallest N whose output still covers
+            // the request wins, and the caller's resampler takes it the rest of the way
+            for (unsigned int scale = 1; scale < 8; ++scale)
+            {
+                decode_cinfo.scale_num = scale;
+                decode_cinfo.scale_denom = 8;
+                jpeg_calc_output_dimensions(&decode_cinfo);
+
+                if (decode_cinfo.output_width >= static_cast<JDIMENSION>(width_) && decode_cinfo.output_height >= static_cast<JDIMENSION>(height_))
+                {
+                    width_ = static_cast<int>(decode_cinfo.output_width);
+                    height_ = static_cast<int>(decode_cinfo.output_height);
+                    return true;
+                }
+            }
+
+            decode_cinfo.scale_num = 1;
+            decode_cinfo.scale_denom = 1;
+            return false;
+        }
+
+        bool JpegImage::SetReadRegion(int& x_, int& y_, int& width_, int& height_)
+        {
+            if (!decode_started || decode_decompressing || decode_cinfo.block_size != DCTSIZE)
+            {
+                return false;
+            }
+
+            if (setjmp(decode_error.setjmp_buffer))
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+
+            const CropPlan plan = PlanCrop(decode_cinfo, JpegTransform::NONE, { x_, y_, width_, height_ });
+            if (x_ < 0 || y_ < 0 || x_ >= plan.full_width || y_ >= plan.full_height
+                || (plan.left == 0 && plan.top == 0 && plan.right == plan.full_width && plan.bottom == plan.full_height))
+            {
+                return false;
+            }
+
+            // the region's blocks become a JPEG of their own, so only they pass the inverse DCT,
+            // upsampling and color conversion; errors of its compressor land in decode_error too
+            region_cinfo.err = &decode_error.pub;
+            jpeg_create_compress(&region_cinfo);
+            region_started = true;
+
+            SetVectorDestination(&region_cinfo, decode_region);
+            const CoefficientCopy copy = ReadCoefficients(plan);
+            WriteCoefficients(&region_cinfo, plan, copy, {});
+
+            jpeg_destroy_compress(&region_cinfo);
+            region_started = false;
+
+            // rows now come from the copy in memory
+            decode_path.clear();
+            decode_started = false;
+            jpeg_destroy_decompress(&decode_cinfo);
+            fclose(decode_file);
+            decode_file = nullptr;
+
+            jpeg_create_decompress(&decode_cinfo);
+            decode_started = true;
+
+            jpeg_mem_src(&decode_cinfo, decode_region.data(), decode_region.size());
+            (void) jpeg_read_header(&decode_cinfo, TRUE);
+
+            x_ = plan.left;
+            y_ = plan.top;
+            width_ = plan.right - plan.left;
+            height_ = plan.bottom - plan.top;
+            return true;
+        }
+
+        int JpegImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            if (setjmp(decode_error.setjmp_buffer))
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+
+            if (decode_parallel)
+            {
+                return 0;
+            }
+
+            // the whole image in one call may be decoded in bands on the shared pool
+            if (!decode_decompressing && count_ == static_cast<int>(decode_cinfo.image_height) && ReadRowsParallel(rows_, stride_))
+            {
+                decode_parallel = true;
+                return count_;
+            }
+
+            const bool expand = decode_format == PixelFormat::RGBA8;
+            if (!decode_decompressing)
+            {
+                decode_cinfo.out_color_space = decode_format == PixelFormat::GRAY8 ? JCS_GRAYSCALE : JCS_RGB;
+                (void) jpeg_start_decompress(&decode_cinfo);
+                decode_decompressing = true;
+
+                // libjpeg hands out up to rec_outbuf_height rows per call
+                if (expand)
+                {
+                    const size_t row_size = static_cast<size_t>(decode_cinfo.output_width) * 3;
+                    decode_buffer.resize(row_size * decode_cinfo.rec_outbuf_height);
+                    decode_rows.resize(decode_cinfo.rec_outbuf_height);
+                    for (int i = 0; i < decode_cinfo.rec_outbuf_height; ++i)
+                    {
+                        decode_rows[i] = decode_buffer.data() + i * row_size;
+                    }
+                }
+            }
+
+            int rows = 0;
+            if (!expand)
+            {
+                // GRAY8 and RGB8 rows go straight into the destination, a batch per call
+                decode_rows.resize(count_);
+                for (int i = 0; i < count_; ++i)
+                {
+                    decode_rows[i] = rows_ + i * stride_;
+                }
+
+                while (rows < count_ && decode_cinfo.output_scanline < decode_cinfo.output_height)
+                {
+                    rows += static_cast<int>(jpeg_read_scanlines(&decode_cinfo, decode_rows.data() + rows, count_ - rows));
+                }
+                return rows;
+            }
+
+            const int width = static_cast<int>(decode_cinfo.output_width);
+            while (rows < count_ && decode_cinfo.output_scanline < decode_cinfo.output_height)
+            {
+                const int batch = std::min(decode_cinfo.rec_outbuf_height, count_ - rows);
+                const int read = static_cast<int>(jpeg_read_scanlines(&decode_cinfo, decode_rows.data(), batch));
+                for (int i = 0; i < read; ++i)
+                {
+                    pixel_ops::RgbToRgba(decode_rows[i], rows_ + (rows + i) * stride_, width);
+                }
+                rows += read;
             }
+            return rows;
+        }
 
-            cinfo.err = jpeg_std_error(&jerr.pub);
-            jerr.pub.error_exit = my_error_exit;
+        void JpegImage::EndDecode()
+        {
+            if (setjmp(decode_error.setjmp_buffer))
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+
+            if (decode_decompressing)
+            {
+                (void) jpeg_finish_decompress(&decode_cinfo);
+            }
+            ReleaseDecode();
+        }
+
+        bool JpegImage::ReadRowsParallel(uint8_t* rows_, ptrdiff_t stride_)
+        {
+            // a single interleaved baseline scan at full size, cut every 8 restart intervals so
+            // that each band starts at RST0 as a file of its own would
+            const jpeg_decompress_struct& cinfo = decode_cinfo;
+            const bool interleaved = cinfo.comps_in_scan == cinfo.num_components
+                && (cinfo.num_components > 1 || (cinfo.max_h_samp_factor == 1 && cinfo.max_v_samp_factor == 1));
+            if (GetParallelThreads() == 1 || cinfo.restart_interval == 0 || cinfo.progressive_mode || !interleaved
+                || cinfo.block_size != DCTSIZE || cinfo.scale_num != cinfo.scale_denom || decode_path.empty())
+            {
+                return false;
+            }
+
+            const int mcu_width = cinfo.max_h_samp_factor * DCTSIZE;
+            const int mcu_height = cinfo.max_v_samp_factor * DCTSIZE;
+            const int height = static_cast<int>(cinfo.image_height);
+            const size_t mcus_per_row = (cinfo.image_width + mcu_width - 1) / mcu_width;
+            const int mcu_rows = (height + mcu_height - 1) / mcu_height;
+            const size_t interval = cinfo.restart_interval;
+
+            std::vector<int> starts;
+            for (int row = 0; row < mcu_rows; ++row)
+            {
+                if (row * mcus_per_row % (8 * interval) == 0)
+                {
+                    starts.push_back(row);
+                }
+            }
+            if (starts.size() < 2)
+            {
+                return false;
+            }
+
+            InputSource source;
+            source.Open(decode_path);
+            const size_t size = static_cast<size_t>(source.GetSize());
+            const uint8_t* file = source.View(0, size);
+
+            RestartIndex index;
+            const size_t segments = (mcus_per_row * mcu_rows + interval - 1) / interval;
+            if (!file || !IndexRestarts(file, size, index) || index.markers.size() + 1 != segments)
+            {
+                return false;
+            }
+
+            const PixelFormat format = decode_format;
+            const int count = static_cast<int>(starts.size());
+            std::mutex mutex;
+            std::string error;
+
+            ParallelFor(count, 1, [&](int begin_, int end_)
+            {
+                const int first_row = starts[begin_];
+                const int last_row = end_ < count ? starts[end_] : mcu_rows;
+                const int top = first_row * mcu_height;
+                const int bottom = std::min(last_row * mcu_height, height);
+
+                // segment k follows marker k - 1, and the band stops before the marker ending its last one
+                const size_t first_segment = first_row * mcus_per_row / interval;
+                const size_t data = first_segment == 0 ? index.data : index.markers[first_segment - 1] + 2;
+                const size_t end = end_ < count ? index.markers[last_row * mcus_per_row / interval - 1] : index.end;
+
+                std::vector<JOCTET> header(file, file + index.data);
+                header[index.sof_height] = static_cast<JOCTET>((bottom - top) >> 8);
+                header[index.sof_height + 1] = static_cast<JOCTET>((bottom - top) & 0xFF);
+
+                char message[JMSG_LENGTH_MAX];
+                if (!DecodeBand(header.data(), header.size(), file + data, end - data, format, rows_ + top * stride_, stride_, message))
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (error.empty())
+                    {
+                        error = message;
+                    }
+                }
+            });
+
+            if (!error.empty())
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during JPEG read: "s + error);
+            }
+            return true;
+        }
+
+        bool JpegImage::DecodeBand(const JOCTET* header_, size_t header_size_, const JOCTET* data_, size_t data_size_,
+                                   PixelFormat format_, uint8_t* rows_, ptrdiff_t stride_, char* message_)
+        {
+            jpeg_decompress_struct cinfo;
+            ErrorManager error;
+            cinfo.mem = nullptr;
+            cinfo.err = jpeg_std_error(&error.pub);
+            error.pub.error_exit = ErrorExit;
 
-            if (setjmp(jerr.setjmp_buffer)) 
+            if (setjmp(error.setjmp_buffer))
             {
                 jpeg_destroy_decompress(&cinfo);
-                fclose(file);
-                return {};
+                std::strcpy(message_, error.message);
+                return false;
             }
 
             jpeg_create_decompress(&cinfo);
-            jpeg_stdio_src(&cinfo, file);
+            SetBandSource(&cinfo, header_, header_size_, data_, data_size_);
             (void) jpeg_read_header(&cinfo, TRUE);
 
-            cinfo.out_color_space = JCS_RGB;
-            cinfo.output_components = 3;
-
+            cinfo.out_color_space = format_ == PixelFormat::GRAY8 ? JCS_GRAYSCALE : JCS_RGB;
             (void) jpeg_start_decompress(&cinfo);
-    
-            row_stride = cinfo.output_width * cinfo.output_components;
-            buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
-            Image image(cinfo.output_width, cinfo.output_height, Color::Black());
 
-            while (cinfo.output_scanline < cinfo.output_height) 
+            const bool expand = format_ == PixelFormat::RGBA8;
+            const int width = static_cast<int>(cinfo.output_width);
+            JSAMPARRAY expanded = expand ? (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, width * 3, cinfo.rec_outbuf_height) : nullptr;
+
+            JSAMPROW batch[MAX_SAMP_FACTOR * DCTSIZE];
+            const int batch_size = MAX_SAMP_FACTOR * DCTSIZE;
+            while (cinfo.output_scanline < cinfo.output_height)
             {
-                int y = cinfo.output_scanline;
-                (void) jpeg_read_scanlines(&cinfo, buffer, 1);
+                const int row = static_cast<int>(cinfo.output_scanline);
+                if (!expand)
+                {
+                    const int count = std::min(batch_size, static_cast<int>(cinfo.output_height) - row);
+                    for (int i = 0; i < count; ++i)
+                    {
+                        batch[i] = rows_ + (row + i) * stride_;
+                    }
+                    (void) jpeg_read_scanlines(&cinfo, batch, count);
+                    continue;
+                }
 
-                SaveSсanlineToImage(buffer[0], y, image);
+                const int read = static_cast<int>(jpeg_read_scanlines(&cinfo, expanded, cinfo.rec_outbuf_height));
+                for (int i = 0; i < read; ++i)
+                {
+                    pixel_ops::RgbToRgba(expanded[i], rows_ + (row + i) * stride_, width);
+                }
             }
-            
+
             (void) jpeg_finish_decompress(&cinfo);
             jpeg_destroy_decompress(&cinfo);
-            fclose(file);
+            return true;
+        }
+
+        void JpegImage::BeginEncode(const Path& path_, const ImageInfo& info_)
+        {
+            ReleaseEncode();
+
+            encode_file = OpenFile(path_, true);
+            if (!encode_file)
+            {
+                throw std::runtime_error("Failed to create JPEG file: "s + path_.string());
+            }
+
+            encode_cinfo.err = jpeg_std_error(&encode_error.pub);
+            encode_error.pub.error_exit = ErrorExit;
+
+            if (setjmp(encode_error.setjmp_buffer))
+            {
+                ReleaseEncode();
+                throw std::runtime_error("Error during JPEG write: "s + encode_error.message);
+            }
+
+            jpeg_create_compress(&encode_cinfo);
+            encode_started = true;
+
+            jpeg_stdio_dest(&encode_cinfo, encode_file);
+
+            // gray sources make grayscale JPEGs; RGBA8 rows are stripped here rather than by the caller
+            if (IsGray(info_.format))
+            {
+                encode_format = PixelFormat::GRAY8;
+            }
+            else
+            {
+                encode_format = info_.format == PixelFormat::RGBA8 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+            }
 
-            return image;
+            encode_cinfo.image_width = info_.width;
+            encode_cinfo.image_height = info_.height;
+            encode_cinfo.input_components = encode_format == PixelFormat::GRAY8 ? 1 : 3;
+            encode_cinfo.in_color_space = encode_format == PixelFormat::GRAY8 ? JCS_GRAYSCALE : JCS_RGB;
+
+            jpeg_set_defaults(&encode_cinfo);
+            jpeg_set_quality(&encode_cinfo, encode_options.quality, TRUE);
+
+            // the chroma components keep the 1x1 factors set by jpeg_set_defaults()
+            if (encode_format != PixelFormat::GRAY8)
+            {
+                jpeg_component_info& luma = encode_cinfo.comp_info[0];
+                luma.h_samp_factor = encode_options.subsampling == JpegSubsampling::S444 ? 1 : 2;
+                luma.v_samp_factor = encode_options.subsampling == JpegSubsampling::S420 ? 2 : 1;
+            }
+
+            switch (encode_options.dct)
+            {
+            case JpegDct::SLOW:
+                encode_cinfo.dct_method = JDCT_ISLOW;
+                break;
+            case JpegDct::FAST:
+                encode_cinfo.dct_method = JDCT_IFAST;
+                break;
+            case JpegDct::FLOAT:
+                encode_cinfo.dct_method = JDCT_FLOAT;
+                break;
+            }
+
+            encode_cinfo.optimize_coding = encode_options.optimize_coding ? TRUE : FALSE;
+            encode_cinfo.restart_in_rows = encode_options.restart_rows;
+            if (encode_options.progressive)
+            {
+                jpeg_simple_progression(&encode_cinfo);
+            }
+
+            jpeg_start_compress(&encode_cinfo, TRUE);
+
+            // rows go in one MCU row per call
+            const int batch = encode_cinfo.max_v_samp_factor * DCTSIZE;
+            encode_rows.resize(batch);
+            if (encode_format == PixelFormat::RGBA8)
+            {
+                encode_buffer.resize(static_cast<size_t>(info_.width) * 3 * batch);
+            }
         }
 
-        bool JpegImage::SaveImageJPEG(const Path& path_, const Image& image_) const
+        PixelFormat JpegImage::GetWriteFormat() const noexcept
         {
-            jpeg_compress_struct cinfo;
-            jpeg_error_mgr jerr;
-            FILE * file;      
-            JSAMPROW row_pointer[1];  
-            int row_stride;       
+            return encode_format;
+        }
 
-            cinfo.err = jpeg_std_error(&jerr);
-            jpeg_create_compress(&cinfo);
+        void JpegImage::SetEncodeOptions(const JpegEncodeOptions& options_)
+        {
+            if (options_.quality < 1 || options_.quality > 100)
+            {
+                throw std::invalid_argument("JPEG quality must be 1 to 100");
+            }
+            if (options_.restart_rows < 0 || options_.restart_rows > 65535)
+            {
+                throw std::invalid_argument("JPEG restart interval must be 0 to 65535 rows");
+            }
+            encode_options = options_;
+        }
 
-            #ifdef _MSC_VER
-            if ((file = _wfopen(path_.wstring().c_str(), L"wb")) == NULL) 
+        void JpegImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            if (setjmp(encode_error.setjmp_buffer))
             {
-            #else
-            if ((file = fopen(path_.string().c_str(), "wb")) == NULL) 
+                ReleaseEncode();
+                throw std::runtime_error("Error during JPEG write: "s + encode_error.message);
+            }
+
+            const int width = encode_cinfo.image_width;
+            const int batch = static_cast<int>(encode_rows.size());
+
+            for (int done = 0; done < count_;)
             {
-            #endif
-                return false;
+                const int count = std::min(batch, count_ - done);
+                for (int i = 0; i < count; ++i)
+                {
+                    const uint8_t* row = rows_ + (done + i) * stride_;
+                    if (encode_format == PixelFormat::RGBA8)
+                    {
+                        JSAMPLE* stripped = encode_buffer.data() + static_cast<size_t>(i) * width * 3;
+                        pixel_ops::RgbaToRgb(row, stripped, width);
+                        encode_rows[i] = stripped;
+                    }
+                    else
+                    {
+                        encode_rows[i] = const_cast<JSAMPLE*>(row);
+                    }
+                }
+
+                done += static_cast<int>(jpeg_write_scanlines(&encode_cinfo, encode_rows.data(), count));
             }
-            jpeg_stdio_dest(&cinfo, file);
+        }
 
+        void JpegImage::EndEncode()
+        {
+            if (setjmp(encode_error.setjmp_buffer))
+            {
+                ReleaseEncode();
+                throw std::runtime_error("Error during JPEG write: "s + encode_error.message);
+            }
 
-            cinfo.image_width = image_.GetWidth(); 
-            cinfo.image_height = image_.GetHeight();
-            cinfo.input_components = 3;    
-            cinfo.in_color_space = JCS_RGB; 
+            jpeg_finish_compress(&encode_cinfo);
+            ReleaseEncode();
+        }
 
-            jpeg_set_defaults(&cinfo);
-            jpeg_start_compress(&cinfo, TRUE);
+        void JpegImage::AbortEncode() noexcept
+        {
+            ReleaseEncode();
+        }
 
-            row_stride = image_.GetWidth() * 3;
+        void JpegImage::TransformJPEG(const Path& input_, const Path& output_, JpegTransform transform_, const JpegCrop& crop_)
+        {
+            ReleaseDecode();
+            ReleaseEncode();
 
-            while (cinfo.next_scanline < cinfo.image_height) 
-            {       
-                std::vector<JSAMPLE> jsample(row_stride);
-                for (int i = 0; i < image_.GetWidth(); ++i) 
+            if (crop_.x < 0 || crop_.y < 0 || crop_.width < 0 || crop_.height < 0)
+            {
+                throw std::invalid_argument("JPEG crop must not be negative");
+            }
+
+            decode_file = OpenFile(input_, false);
+            if (!decode_file)
+            {
+                throw std::runtime_error("Failed to open JPEG file: "s + input_.string());
+            }
+
+            decode_cinfo.err = jpeg_std_error(&decode_error.pub);
+            decode_error.pub.error_exit = ErrorExit;
+            encode_cinfo.err = jpeg_std_error(&encode_error.pub);
+            encode_error.pub.error_exit = ErrorExit;
+
+            // writing over the input goes through a sibling file that replaces it at the end,
+            // so that a failed write does not lose the source
+            std::error_code error;
+            const bool in_place = std::filesystem::equivalent(input_, output_, error);
+            Path target = output_;
+            if (in_place)
+            {
+                target.replace_filename(output_.stem().string() + ".tmp"s + output_.extension().string());
+            }
+
+            if (setjmp(decode_error.setjmp_buffer))
+            {
+                AbortTransform(target);
+                throw std::runtime_error("Error during JPEG read: "s + decode_error.message);
+            }
+            if (setjmp(encode_error.setjmp_buffer))
+            {
+                AbortTransform(target);
+                throw std::runtime_error("Error during JPEG write: "s + encode_error.message);
+            }
+
+            jpeg_create_decompress(&decode_cinfo);
+            decode_started = true;
+
+            jpeg_stdio_src(&decode_cinfo, decode_file);
+            jpeg_read_header(&decode_cinfo, TRUE);
+
+            if (decode_cinfo.block_size != DCTSIZE)
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Lossless transforms need 8x8 DCT blocks: "s + input_.string());
+            }
+
+            const CropPlan plan = PlanCrop(decode_cinfo, transform_, crop_);
+            if (plan.full_width == 0 || plan.full_height == 0)
+            {
+                ReleaseDecode();
+                throw std::runtime_error("JPEG is smaller than one MCU along a mirrored side: "s + input_.string());
+            }
+            if (crop_.x >= plan.full_width || crop_.y >= plan.full_height)
+            {
+                ReleaseDecode();
+                throw std::invalid_argument("JPEG crop starts outside the image");
+            }
+
+            // the whole input is read before the output is opened, as jpegtran does; the
+            // decoder has reached EOI, so jpeg_finish_decompress() reads no more of the file
+            const CoefficientCopy copy = ReadCoefficients(plan);
+            fclose(decode_file);
+            decode_file = nullptr;
+
+            encode_file = OpenFile(target, true);
+            if (!encode_file)
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Failed to create JPEG file: "s + target.string());
+            }
+
+            jpeg_create_compress(&encode_cinfo);
+            encode_started = true;
+
+            jpeg_stdio_dest(&encode_cinfo, encode_file);
+            WriteCoefficients(&encode_cinfo, plan, copy, encode_options);
+            ReleaseEncode();
+
+            jpeg_finish_decompress(&decode_cinfo);
+            ReleaseDecode();
+
+            if (in_place)
+            {
+                std::filesystem::rename(target, output_, error);
+                if (error)
                 {
-                    jsample[3 * i] = JSAMPLE(image_.GetLine(cinfo.next_scanline)[i].r);
-                    jsample[1 + 3 * i] = JSAMPLE(image_.GetLine(cinfo.next_scanline)[i].g);
-                    jsample[2 + 3 * i] = JSAMPLE(image_.GetLine(cinfo.next_scanline)[i].b);
+                    std::filesystem::remove(target, error);
+                    throw std::runtime_error("Failed to replace JPEG file: "s + output_.string());
                 }
-                row_pointer[0] = &jsample[0];
-                (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
             }
+        }
 
-            jpeg_finish_compress(&cinfo);
-            fclose(file);
-            jpeg_destroy_compress(&cinfo);
+        void JpegImage::AbortTransform(const Path& output_) noexcept
+        {
+            const bool created = encode_file != nullptr;
+            ReleaseEncode();
+            ReleaseDecode();
 
-            return true;
+            if (created)
+            {
+                std::error_code error;
+                std::filesystem::remove(output_, error);
+            }
+        }
+
+        JpegImage::CropPlan JpegImage::PlanCrop(const jpeg_decompress_struct& cinfo_, JpegTransform transform_, const JpegCrop& crop_) noexcept
+        {
+            CropPlan plan;
+            plan.orientation = GetOrientation(transform_);
+
+            // sizes in output coordinates; the output MCU is the source one, turned when transposing
+            const bool transpose = plan.orientation.transpose;
+            plan.mcu_width = (transpose ? cinfo_.max_v_samp_factor : cinfo_.max_h_samp_factor) * DCTSIZE;
+            plan.mcu_height = (transpose ? cinfo_.max_h_samp_factor : cinfo_.max_v_samp_factor) * DCTSIZE;
+
+            plan.full_width = static_cast<int>(transpose ? cinfo_.image_height : cinfo_.image_width);
+            plan.full_height = static_cast<int>(transpose ? cinfo_.image_width : cinfo_.image_height);
+            if (plan.orientation.mirror_x)
+            {
+                plan.full_width -= plan.full_width % plan.mcu_width;
+            }
+            if (plan.orientation.mirror_y)
+            {
+                plan.full_height -= plan.full_height % plan.mcu_height;
+            }
+
+            plan.left = crop_.x - crop_.x % plan.mcu_width;
+            plan.top = crop_.y - crop_.y % plan.mcu_height;
+            plan.right = crop_.width > 0 ? std::min(plan.full_width, crop_.x + crop_.width) : plan.full_width;
+            plan.bottom = crop_.height > 0 ? std::min(plan.full_height, crop_.y + crop_.height) : plan.full_height;
+            return plan;
         }
 
+        JpegImage::CoefficientCopy JpegImage::ReadCoefficients(const CropPlan& plan_)
+        {
+            const Orientation& orientation = plan_.orientation;
+
+            // the output arrays are requested before jpeg_read_coefficients() so that it allocates them too
+            const int components = decode_cinfo.num_components;
+            CoefficientCopy copy;
+            for (int c = 0; c < components; ++c)
+            {
+                const jpeg_component_info& component = decode_cinfo.comp_info[c];
+                const int h_samp = orientation.transpose ? component.v_samp_factor : component.h_samp_factor;
+                const int v_samp = orientation.transpose ? component.h_samp_factor : component.v_samp_factor;
+
+                const int width = (((plan_.right - plan_.left) * h_samp + plan_.mcu_width - 1) / plan_.mcu_width + h_samp - 1) / h_samp * h_samp;
+                const int height = (((plan_.bottom - plan_.top) * v_samp + plan_.mcu_height - 1) / plan_.mcu_height + v_samp - 1) / v_samp * v_samp;
+                copy.dst_coefs[c] = (*decode_cinfo.mem->request_virt_barray)(reinterpret_cast<j_common_ptr>(&decode_cinfo), JPOOL_IMAGE, FALSE,
+                                                                       width, height, v_samp);
+
+                copy.mappings[c].orientation = orientation;
+                copy.mappings[c].offset_x = plan_.left / plan_.mcu_width * h_samp;
+                copy.mappings[c].offset_y = plan_.top / plan_.mcu_height * v_samp;
+                copy.mappings[c].full_width = plan_.full_width / plan_.mcu_width * h_samp;
+                copy.mappings[c].full_height = plan_.full_height / plan_.mcu_height * v_samp;
+            }
+
+            copy.src_coefs = jpeg_read_coefficients(&decode_cinfo);
+            return copy;
+        }
+
+        void JpegImage::WriteCoefficients(j_compress_ptr cinfo_, const CropPlan& plan_, const CoefficientCopy& copy_, const JpegEncodeOptions& options_)
+        {
+            const Orientation& orientation = plan_.orientation;
+            const int components = decode_cinfo.num_components;
+
+            jpeg_copy_critical_parameters(&decode_cinfo, cinfo_);
+            cinfo_->image_width = cinfo_->jpeg_width = plan_.right - plan_.left;
+            cinfo_->image_height = cinfo_->jpeg_height = plan_.bottom - plan_.top;
+
+            // transposed blocks need transposed sampling, quantization tables and pixel density
+            if (orientation.transpose)
+            {
+                for (int c = 0; c < components; ++c)
+                {
+                    jpeg_component_info& component = cinfo_->comp_info[c];
+                    std::swap(component.h_samp_factor, component.v_samp_factor);
+                }
+                for (JQUANT_TBL* table : cinfo_->quant_tbl_ptrs)
+                {
+                    for (int i = 0; table && i < DCTSIZE; ++i)
+                    {
+                        for (int j = 0; j < i; ++j)
+                        {
+                            std::swap(table->quantval[i * DCTSIZE + j], table->quantval[j * DCTSIZE + i]);
+                        }
+                    }
+                }
+                std::swap(cinfo_->X_density, cinfo_->Y_density);
+            }
+
+            cinfo_->optimize_coding = options_.optimize_coding ? TRUE : FALSE;
+            cinfo_->restart_in_rows = options_.restart_rows;
+            if (options_.progressive)
+            {
+                jpeg_simple_progression(cinfo_);
+            }
+
+            jpeg_write_coefficients(cinfo_, const_cast<jvirt_barray_ptr*>(copy_.dst_coefs));
+
+            for (int c = 0; c < components; ++c)
+            {
+                const jpeg_component_info& src = decode_cinfo.comp_info[c];
+                const jpeg_component_info& dst = cinfo_->comp_info[c];
+                const int src_width = (src.width_in_blocks + src.h_samp_factor - 1) / src.h_samp_factor * src.h_samp_factor;
+                const int src_height = (src.height_in_blocks + src.v_samp_factor - 1) / src.v_samp_factor * src.v_samp_factor;
+                const int dst_width = (dst.width_in_blocks + dst.h_samp_factor - 1) / dst.h_samp_factor * dst.h_samp_factor;
+                const int dst_height = (dst.height_in_blocks + dst.v_samp_factor - 1) / dst.v_samp_factor * dst.v_samp_factor;
+
+                CopyBlocks(&decode_cinfo, copy_.src_coefs[c], src_width, src_height, copy_.dst_coefs[c], dst_width, dst_height, dst.v_samp_factor, copy_.mappings[c]);
+            }
+
+            // the output arrays live in the decoder's pool, so the decoder finishes after this
+            jpeg_finish_compress(cinfo_);
+        }
+
+        void JpegImage::ReleaseDecode() noexcept
+        {
+            if (region_started)
+            {
+                jpeg_destroy_compress(&region_cinfo);
+                region_started = false;
+            }
+            if (decode_started)
+            {
+                jpeg_destroy_decompress(&decode_cinfo);
+                decode_started = false;
+            }
+            if (decode_file)
+            {
+                fclose(decode_file);
+                decode_file = nullptr;
+            }
+        }
+
+        void JpegImage::ReleaseEncode() noexcept
+        {
+            if (encode_started)
+            {
+                jpeg_destroy_compress(&encode_cinfo);
+                encode_started = false;
+            }
+            if (encode_file)
+            {
+                fclose(encode_file);
+                encode_file = nullptr;
+            }
+        }
 
     } // end namespace jpeg_image
 
-} // end namespace img_lib
\ No newline at end of file
+} // end namespace img_lib
@@ -1,202 +1,468 @@
 #include <iostream>
+#include <map>
 
-#include "ppm_image.h"
-#include "bmp_image.h"
-#include "ico_image.h"
-#include "tiff_image.h"
-#include "png_image.h"
-#include "jpeg_image.h"
-#include "gif_image.h"
+#include "batch_converter.h"
+#include "converter.h"
+#include "thread_pool.h"
 
 #include "image.h"
+#include "jpeg_image.h"
 
 using namespace std;
 
-using img_lib::Image;
 using img_lib::Path;
+using img_lib::resample::Filter;
+
+using img_lib::PngFilter;
+using img_lib::PngReduce;
+using img_lib::PngStrategy;
 
-enum class Format { PPM, BMP, TIFF, PNG, JPEG, ICO, GIF, UNKNOWN };
+using img_lib::JpegDct;
+using img_lib::JpegSubsampling;
 
-Format GetFormatByExtension(const Path& input_file_)
+using img_lib::jpeg_image::JpegCrop;
+using img_lib::jpeg_image::JpegTransform;
+
+// options accepted in every mode
+static const vector<string> COMMON_OPTIONS = { "--threads"s, "--png-preset"s, "--png-level"s, "--png-strategy"s, "--png-filter"s, "--png-mem-level"s, "--png-window-bits"s, "--png-reduce"s,
+                                                "--jpeg-preset"s, "--jpeg-quality"s, "--jpeg-subsampling"s, "--jpeg-progressive"s, "--jpeg-optimize"s, "--jpeg-dct"s, "--jpeg-restart"s };
+
+void PrintUsage(const char* program_)
 {
-    const string ext = input_file_.extension().string();
+    cerr << "Usage: "s << program_ << " [options] [--region <width>x<height>[+<x>+<y>]] [--resize <width>x<height>] [--filter <filter>] <input_file> <output_file>"s << endl;
+    cerr << "       "s << program_ << " [options] [--transform <transform>] [--crop <width>x<height>[+<x>+<y>]] <input_jpeg> <output_jpeg>"s << endl;
+    cerr << "       "s << program_ << " [options] --batch <manifest_file>"s << endl;
+    cerr << "       "s << program_ << " [options] --in-dir <dir> --out-dir <dir> --to <extension>"s << endl;
+    cerr << "Options: --threads <n>"s << endl;
+    cerr << "         --png-preset fast|default, --png-level 0-9, --png-strategy default|filtered|rle|huffman"s << endl;
+    cerr << "         --png-filter none|sub|up|avg|paeth|adaptive, --png-mem-level 1-9, --png-window-bits 9-15"s << endl;
+    cerr << "         --png-reduce auto|on|off (smallest color type that keeps every pixel; auto only when the"s << endl;
+    cerr << "           whole image is in memory, on also holds streamed rows until the end; default auto)"s << endl;
+    cerr << "         --jpeg-preset fast|default|compact, --jpeg-quality 1-100, --jpeg-subsampling 444|422|420"s << endl;
+    cerr << "         --jpeg-progressive on|off, --jpeg-optimize on|off, --jpeg-dct slow|fast|float"s << endl;
+    cerr << "         --jpeg-restart <MCU rows between restart markers, 0 for none>"s << endl;
+    cerr << "Filters: box, triangle, catmull-rom, mitchell, lanczos3 (default triangle)"s << endl;
+    cerr << "Transforms: rotate-90, rotate-180, rotate-270, flip-h, flip-v, transpose, transverse (lossless, JPEG only)"s << endl;
+}
 
-    if (ext == ".ppm"s || ext == ".p3"s)
+int ParseCount(const string& value_, const string& option_)
+{
+    size_t used = 0;
+    int count = -1;
+    try
     {
-        return Format::PPM;
+        count = stoi(value_, &used);
     }
-
-    if (ext == ".bmp"s)
+    catch (const exception&)
     {
-        return Format::BMP;
     }
 
-    if (ext == ".tiff"s)
+    if (used != value_.size() || count < 0)
     {
-        return Format::TIFF;
+        throw invalid_argument("Invalid value for "s + option_ + ": "s + value_);
     }
+    return count;
+}
 
-    if (ext == ".png"s)
+int ParseInRange(const string& value_, const string& option_, int min_, int max_)
+{
+    const int value = ParseCount(value_, option_);
+    if (value < min_ || value > max_)
     {
-        return Format::PNG;
+        throw invalid_argument(option_ + " must be "s + to_string(min_) + " to "s + to_string(max_) + ": "s + value_);
     }
+    return value;
+}
 
-    if (ext == ".jpeg" || ext == ".jpg")
+template <typename T>
+T ParseChoice(const string& value_, const string& option_, const map<string, T>& choices_)
+{
+    const auto it = choices_.find(value_);
+    if (it == choices_.end())
     {
-        return Format::JPEG;
+        throw invalid_argument("Unknown value for "s + option_ + ": "s + value_);
     }
+    return it->second;
+}
 
-    if (ext == ".ico"s)
+pair<int, int> ParseSize(const string& value_)
+{
+    const size_t separator = value_.find('x');
+    if (separator == string::npos)
     {
-        return Format::ICO;
+        throw invalid_argument("Resize size must look like <width>x<height>: "s + value_);
     }
 
-    if (ext == ".gif"s)
+    const int width = ParseCount(value_.substr(0, separator), "--resize"s);
+    const int height = ParseCount(value_.substr(separator + 1), "--resize"s);
+    if (width == 0 || height == 0)
     {
-        return Format::GIF;
+        throw invalid_argument("Resize size must be positive: "s + value_);
     }
+    return { width, height };
+}
 
-    return Format::UNKNOWN;
+Filter ParseFilter(const string& value_)
+{
+    static const map<string, Filter> filters =
+    {
+        { "box"s, Filter::BOX },
+        { "triangle"s, Filter::TRIANGLE },
+        { "catmull-rom"s, Filter::CATMULL_ROM },
+        { "mitchell"s, Filter::MITCHELL },
+        { "lanczos3"s, Filter::LANCZOS3 },
+    };
+    return ParseChoice(value_, "--filter"s, filters);
 }
 
-Image LoadImage(const Path& input_file_, Format format_)
+JpegTransform ParseTransform(const string& value_)
 {
-    img_lib::ppm_image::PpmImage ppm_image;
-    img_lib::bmp_image::BmpImage bmp_image;
-    img_lib::tiff_image::TiffImage tiff_image;
-    img_lib::png_image::PngImage png_image;
-    img_lib::jpeg_image::JpegImage jpeg_image;
-    img_lib::ico_image::IcoImage ico_image;
-    img_lib::gif_image::GifImage gif_image;
+    static const map<string, JpegTransform> transforms =
+    {
+        { "rotate-90"s, JpegTransform::ROTATE_90 },
+        { "rotate-180"s, JpegTransform::ROTATE_180 },
+        { "rotate-270"s, JpegTransform::ROTATE_270 },
+        { "flip-h"s, JpegTransform::FLIP_H },
+        { "flip-v"s, JpegTransform::FLIP_V },
+        { "transpose"s, JpegTransform::TRANSPOSE },
+        { "transverse"s, JpegTransform::TRANSVERSE },
+    };
+    return ParseChoice(value_, "--transform"s, transforms);
+}
 
-    switch (format_) 
+struct Rectangle
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// <width>x<height>[+<x>+<y>], as jpegtran takes it
+Rectangle ParseRectangle(const string& value_, const string& option_)
+{
+    const size_t separator = value_.find('x');
+    const size_t offset = value_.find('+');
+    const size_t offset_y = offset == string::npos ? string::npos : value_.find('+', offset + 1);
+    if (separator == string::npos || separator > offset || (offset != string::npos && offset_y == string::npos))
     {
-    case Format::PPM:
-        return ppm_image.LoadImagePPM(input_file_);
+        throw invalid_argument(option_ + " must look like <width>x<height>[+<x>+<y>]: "s + value_);
+    }
 
-    case Format::BMP:
-        return bmp_image.LoadImageBMP(input_file_);
+    Rectangle rectangle;
+    rectangle.width = ParseCount(value_.substr(0, separator), option_);
+    rectangle.height = ParseCount(value_.substr(separator + 1, offset == string::npos ? string::npos : offset - separator - 1), option_);
+    if (offset != string::npos)
+    {
+        rectangle.x = ParseCount(value_.substr(offset + 1, offset_y - offset - 1), option_);
+        rectangle.y = ParseCount(value_.substr(offset_y + 1), option_);
+    }
+    if (rectangle.width == 0 || rectangle.height == 0)
+    {
+        throw invalid_argument(option_ + " size must be positive: "s + value_);
+    }
+    return rectangle;
+}
 
-    case Format::TIFF:
-        return tiff_image.LoadImageTIFF(input_file_);
+// The preset comes first, the other --png-* options override its fields.
+img_lib::PngEncodeOptions ParsePngOptions(const map<string, string>& options_)
+{
+    static const map<string, PngStrategy> strategies =
+    {
+        { "default"s, PngStrategy::DEFAULT },
+        { "filtered"s, PngStrategy::FILTERED },
+        { "rle"s, PngStrategy::RLE },
+        { "huffman"s, PngStrategy::HUFFMAN_ONLY },
+    };
 
-    case Format::PNG:
-        return png_image.LoadImagePNG(input_file_);
+    static const map<string, PngFilter> filters =
+    {
+        { "none"s, PngFilter::NONE },
+        { "sub"s, PngFilter::SUB },
+        { "up"s, PngFilter::UP },
+        { "avg"s, PngFilter::AVG },
+        { "paeth"s, PngFilter::PAETH },
+        { "adaptive"s, PngFilter::ADAPTIVE },
+    };
+
+    static const map<string, PngReduce> reductions =
+    {
+        { "auto"s, PngReduce::WHOLE_IMAGE },
+        { "on"s, PngReduce::ALWAYS },
+        { "off"s, PngReduce::OFF },
+    };
 
-    case Format::JPEG:
-        return jpeg_image.LoadImageJPEG(input_file_);
+    img_lib::PngEncodeOptions png;
+    if (options_.count("--png-preset"s))
+    {
+        const map<string, img_lib::PngEncodeOptions> presets = { { "default"s, {} }, { "fast"s, img_lib::PngEncodeOptions::Fast() } };
+        png = ParseChoice(options_.at("--png-preset"s), "--png-preset"s, presets);
+    }
+    if (options_.count("--png-level"s))
+    {
+        png.level = ParseInRange(options_.at("--png-level"s), "--png-level"s, 0, 9);
+    }
+    if (options_.count("--png-strategy"s))
+    {
+        png.strategy = ParseChoice(options_.at("--png-strategy"s), "--png-strategy"s, strategies);
+    }
+    if (options_.count("--png-filter"s))
+    {
+        png.filter = ParseChoice(options_.at("--png-filter"s), "--png-filter"s, filters);
+    }
+    if (options_.count("--png-mem-level"s))
+    {
+        png.mem_level = ParseInRange(options_.at("--png-mem-level"s), "--png-mem-level"s, 1, 9);
+    }
+    if (options_.count("--png-window-bits"s))
+    {
+        png.window_bits = ParseInRange(options_.at("--png-window-bits"s), "--png-window-bits"s, 9, 15);
+    }
+    if (options_.count("--png-reduce"s))
+    {
+        png.reduce = ParseChoice(options_.at("--png-reduce"s), "--png-reduce"s, reductions);
+    }
+    return png;
+}
+
+// The preset comes first, the other --jpeg-* options override its fields.
+img_lib::JpegEncodeOptions ParseJpegOptions(const map<string, string>& options_)
+{
+    static const map<string, JpegSubsampling> subsamplings =
+    {
+        { "444"s, JpegSubsampling::S444 },
+        { "422"s, JpegSubsampling::S422 },
+        { "420"s, JpegSubsampling::S420 },
+    };
 
-    case Format::ICO:
-        return ico_image.LoadImageICO(input_file_);
+    static const map<string, JpegDct> dcts =
+    {
+        { "slow"s, JpegDct::SLOW },
+        { "fast"s, JpegDct::FAST },
+        { "float"s, JpegDct::FLOAT },
+    };
 
-    case Format::GIF:
-        return gif_image.LoadImageGIF(input_file_);
+    static const map<string, bool> switches = { { "on"s, true }, { "off"s, false } };
 
-    default:
-        throw std::runtime_error("Unsupported input file format"s);
+    img_lib::JpegEncodeOptions jpeg;
+    if (options_.count("--jpeg-preset"s))
+    {
+        const map<string, img_lib::JpegEncodeOptions> presets =
+        {
+            { "default"s, {} },
+            { "fast"s, img_lib::JpegEncodeOptions::Fast() },
+            { "compact"s, img_lib::JpegEncodeOptions::Compact() },
+        };
+        jpeg = ParseChoice(options_.at("--jpeg-preset"s), "--jpeg-preset"s, presets);
+    }
+    if (options_.count("--jpeg-quality"s))
+    {
+        jpeg.quality = ParseInRange(options_.at("--jpeg-quality"s), "--jpeg-quality"s, 1, 100);
+    }
+    if (options_.count("--jpeg-subsampling"s))
+    {
+        jpeg.subsampling = ParseChoice(options_.at("--jpeg-subsampling"s), "--jpeg-subsampling"s, subsamplings);
     }
+    if (options_.count("--jpeg-progressive"s))
+    {
+        jpeg.progressive = ParseChoice(options_.at("--jpeg-progressive"s), "--jpeg-progressive"s, switches);
+    }
+    if (options_.count("--jpeg-optimize"s))
+    {
+        jpeg.optimize_coding = ParseChoice(options_.at("--jpeg-optimize"s), "--jpeg-optimize"s, switches);
+    }
+    if (options_.count("--jpeg-dct"s))
+    {
+        jpeg.dct = ParseChoice(options_.at("--jpeg-dct"s), "--jpeg-dct"s, dcts);
+    }
+    if (options_.count("--jpeg-restart"s))
+    {
+        jpeg.restart_rows = ParseInRange(options_.at("--jpeg-restart"s), "--jpeg-restart"s, 0, 65535);
+    }
+    return jpeg;
 }
 
-void SaveImage(const Path& output_file_, const Image& image_, Format format_)
+int RunBatchMode(const map<string, string>& options_, int threads_, const img_lib::EncodeOptions& encode_options_)
 {
-    img_lib::ppm_image::PpmImage ppm_image;
-    img_lib::bmp_image::BmpImage bmp_image;
-    img_lib::tiff_image::TiffImage tiff_image;
-    img_lib::png_image::PngImage png_image;
-    img_lib::jpeg_image::JpegImage jpeg_image;
-    img_lib::ico_image::IcoImage ico_image;
-    img_lib::gif_image::GifImage gif_image;
-
-    switch (format_) 
-    {
-    case Format::PPM:
-        ppm_image.SaveImagePPM(output_file_, image_);
-        break;
-
-    case Format::BMP:
-        bmp_image.SaveImageBMP(output_file_, image_);
-        break;
-
-    case Format::TIFF:
-        tiff_image.SaveImageTIFF(output_file_, image_);
-        break;
-
-    case Format::PNG:
-        png_image.SaveImagePNG(output_file_, image_);
-        break;
-
-    case Format::JPEG:
-        jpeg_image.SaveImageJPEG(output_file_, image_);
-        break;
-    
-    case Format::ICO:
-        ico_image.SaveImageICO(output_file_, image_);
-        break;
-
-    case Format::GIF:
-        gif_image.SaveImageGIF(output_file_, image_);
-        break;
-
-    default:
-        throw std::runtime_error("Unsupported output file format"s);
-    
+    vector<img_lib::BatchJob> jobs;
+
+    try
+    {
+        if (options_.count("--batch"s))
+        {
+            jobs = img_lib::ReadManifest(options_.at("--batch"s));
+        }
+        else
+        {
+            jobs = img_lib::ListDirectoryJobs(options_.at("--in-dir"s), options_.at("--out-dir"s), options_.at("--to"s));
+        }
     }
+    catch (const exception& e)
+    {
+        cerr << "Error preparing batch: "s << e.what() << endl;
+        return 1;
+    }
+
+    // the files are already spread over the threads, so each image is processed on one
+    img_lib::SetParallelThreads(1);
+
+    const img_lib::BatchStats stats = img_lib::RunBatch(jobs, threads_, cerr, encode_options_);
+    img_lib::PrintBatchStats(stats, cout);
+
+    return stats.failed == 0 ? 0 : 1;
 }
 
 int main(int argc_, const char** argv_)
 {
-    if (argc_ != 3) 
+    map<string, string> options;
+    vector<string> files;
+
+    for (int i = 1; i < argc_; ++i)
     {
-        cerr << "Usage: "s << argv_[0] << " <input_file> <output_file>"s << endl;
-        return 1;
+        const string argument = argv_[i];
+        if (argument.rfind("--"s, 0) != 0)
+        {
+            files.push_back(argument);
+        }
+        else if (i + 1 < argc_)
+        {
+            options[argument] = argv_[++i];
+        }
+        else
+        {
+            PrintUsage(argv_[0]);
+            return 1;
+        }
     }
 
-    Path input_file = argv_[1];
-    Path output_file = argv_[2];
-
-    Format input_format = GetFormatByExtension(input_file);
+    int threads = 0;
+    pair<int, int> resize_size{ 0, 0 };
+    Filter filter = Filter::TRIANGLE;
+    JpegTransform transform = JpegTransform::NONE;
+    JpegCrop crop;
+    Rectangle region;
+    img_lib::EncodeOptions encode_options;
 
-    if (input_format == Format::UNKNOWN)
+    try
     {
-        cerr << "Unknown input file format: "s << input_file.extension().string() << endl;
+        if (options.count("--threads"s))
+        {
+            threads = ParseCount(options.at("--threads"s), "--threads"s);
+        }
+        if (options.count("--resize"s))
+        {
+            resize_size = ParseSize(options.at("--resize"s));
+        }
+        if (options.count("--filter"s))
+        {
+            filter = ParseFilter(options.at("--filter"s));
+        }
+        if (options.count("--transform"s))
+        {
+            transform = ParseTransform(options.at("--transform"s));
+        }
+        if (options.count("--crop"s))
+        {
+            const Rectangle rectangle = ParseRectangle(options.at("--crop"s), "--crop"s);
+            crop = { rectangle.x, rectangle.y, rectangle.width, rectangle.height };
+        }
+        if (options.count("--region"s))
+        {
+            region = ParseRectangle(options.at("--region"s), "--region"s);
+        }
+        encode_options.png = ParsePngOptions(options);
+        encode_options.jpeg = ParseJpegOptions(options);
+    }
+    catch (const exception& e)
+    {
+        cerr << e.what() << endl;
         return 1;
     }
 
-   Image image;
-
-    try 
+    size_t common = 0;
+    for (const string& option : COMMON_OPTIONS)
     {
-        image = LoadImage(input_file, input_format);
+        common += options.count(option);
     }
-    catch (const exception& e) 
+    const size_t resizing = options.count("--resize"s) + options.count("--filter"s) + options.count("--region"s);
+    const size_t transforming = options.count("--transform"s) + options.count("--crop"s);
+
+    if (options.count("--batch"s) || options.count("--in-dir"s))
     {
-        cerr << "Error loading image: "s << e.what() << endl;
-        return 1;
+        const bool manifest = options.size() == common + 1 && options.count("--batch"s);
+        const bool directory = options.size() == common + 3 && options.count("--in-dir"s) && options.count("--out-dir"s) && options.count("--to"s);
+
+        if (!files.empty() || (!manifest && !directory))
+        {
+            PrintUsage(argv_[0]);
+            return 1;
+        }
+
+        return RunBatchMode(options, threads, encode_options);
     }
 
-    if (!image) 
+    if (files.size() != 2 || options.size() != common + resizing + transforming || (options.count("--filter"s) && !options.count("--resize"s))
+        || (resizing > 0 && transforming > 0))
     {
-        cerr << "Failed to load image: "s << input_file.string() << endl;
+        PrintUsage(argv_[0]);
         return 1;
     }
 
-    Format output_format = GetFormatByExtension(output_file);
+    img_lib::SetParallelThreads(threads);
+
+    Path input_file = files[0];
+    Path output_file = files[1];
 
-    if (output_format == Format::UNKNOWN) 
+    if (!img_lib::FindCodecByExtension(output_file))
     {
         cerr << "Unknown output file format: "s << output_file.extension().string() << endl;
         return 1;
     }
 
-    try 
+    if (transforming > 0)
     {
-        SaveImage(output_file, image, output_format);
+        try
+        {
+            const img_lib::CodecEntry* input = img_lib::SniffCodec(input_file);
+            if (!input || input->format != img_lib::Format::JPEG || img_lib::GetFormatByExtension(output_file) != img_lib::Format::JPEG)
+            {
+                throw invalid_argument("--transform and --crop work from JPEG to JPEG only"s);
+            }
+
+            img_lib::jpeg_image::JpegImage jpeg;
+            jpeg.SetEncodeOptions(encode_options.jpeg);
+            jpeg.TransformJPEG(input_file, output_file, transform, crop);
+        }
+        catch (const exception& e)
+        {
+            cerr << "Error transforming image: "s << e.what() << endl;
+            return 1;
+        }
+
+        cout << "Image successfully transformed from "s << input_file.string() << " to "s << output_file.string() << endl;
+        return 0;
     }
-    catch (const exception& e) 
+
+    img_lib::Converter converter;
+
+    try
     {
-        cerr << "Error saving image: "s << e.what() << endl;
+        converter.SetEncodeOptions(encode_options);
+        if (region.width > 0)
+        {
+            converter.SetRegion(region.x, region.y, region.width, region.height);
+        }
+        if (resize_size.first > 0)
+        {
+            converter.SetResize(resize_size.first, resize_size.second, filter);
+        }
+        converter.Convert(input_file, output_file);
+    }
+    catch (const exception& e)
+    {
+        cerr << "Error converting image: "s << e.what() << endl;
         return 1;
     }
 
     cout << "Image successfully converted from "s << input_file.string() << " to "s << output_file.string() << endl;
-}
\ No newline at end of file
+}
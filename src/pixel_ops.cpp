@@ -0,0 +1,606 @@
+#include "pixel_ops.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef IMG_LIB_X86
+#include <immintrin.h>
+#endif
+
+namespace img_lib
+{
+    namespace pixel_ops
+    {
+        static const int CONVERT_CHUNK_PIXELS = 256;
+
+        // SWAP selects B,G,R source order, otherwise R,G,B
+        template <bool SWAP>
+        static void ExpandToRgbaScalar(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, src_ += 3)
+            {
+                uint8_t* dst = dst_ + x * 4;
+                dst[0] = src_[SWAP ? 2 : 0];
+                dst[1] = src_[1];
+                dst[2] = src_[SWAP ? 0 : 2];
+                dst[3] = 255;
+            }
+        }
+
+        static void BgraToRgbaScalar(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, src_ += 4)
+            {
+                uint8_t* dst = dst_ + x * 4;
+                dst[0] = src_[2];
+                dst[1] = src_[1];
+                dst[2] = src_[0];
+                dst[3] = src_[3];
+            }
+        }
+
+        // SWAP selects B,G,R,A source order, otherwise R,G,B,A
+        template <bool SWAP>
+        static void ShrinkToRgbScalar(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, src_ += 4, dst_ += 3)
+            {
+                dst_[0] = src_[SWAP ? 2 : 0];
+                dst_[1] = src_[1];
+                dst_[2] = src_[SWAP ? 0 : 2];
+            }
+        }
+
+        static void BgrToRgbScalar(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, src_ += 3, dst_ += 3)
+            {
+                const uint8_t b = src_[0];
+                dst_[1] = src_[1];
+                dst_[0] = src_[2];
+                dst_[2] = b;
+            }
+        }
+
+        static void PaletteToRgbaScalar(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, dst_ += 4)
+            {
+                std::memcpy(dst_, &palette_[src_[x]], 4);
+            }
+        }
+
+        static void PaletteToRgbScalar(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, dst_ += 3)
+            {
+                const uint32_t color = palette_[src_[x]];
+                dst_[0] = static_cast<uint8_t>(color);
+                dst_[1] = static_cast<uint8_t>(color >> 8);
+                dst_[2] = static_cast<uint8_t>(color >> 16);
+            }
+        }
+
+    #ifdef IMG_LIB_X86
+
+        // swaps bytes 0 and 2 of every 32-bit pixel without pshufb
+        IMG_LIB_TARGET("sse2")
+        static void BgraToRgbaSse2(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m128i keep = _mm_set1_epi32(static_cast<int>(0xFF00FF00u));
+            const __m128i low = _mm_set1_epi32(0x000000FF);
+
+            int x = 0;
+            for (; x + 4 <= count_; x += 4)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ + x * 4));
+                const __m128i swapped = _mm_or_si128(
+                    _mm_and_si128(v, keep),
+                    _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low), _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_ + x * 4), swapped);
+            }
+
+            BgraToRgbaScalar(src_ + x * 4, dst_ + x * 4, count_ - x);
+        }
+
+        IMG_LIB_TARGET("ssse3")
+        static void BgraToRgbaSsse3(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+            int x = 0;
+            for (; x + 4 <= count_; x += 4)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ + x * 4));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_ + x * 4), _mm_shuffle_epi8(v, shuffle));
+            }
+
+            BgraToRgbaScalar(src_ + x * 4, dst_ + x * 4, count_ - x);
+        }
+
+        // 16 pixels per step; the three 16-byte loads are realigned with palignr so nothing
+        // past the last source pixel is touched
+        template <bool SWAP>
+        IMG_LIB_TARGET("ssse3")
+        static void ExpandToRgbaSsse3(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m128i shuffle = SWAP
+                ? _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1)
+                : _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+            const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000u));
+
+            int x = 0;
+            for (; x + 16 <= count_; x += 16)
+            {
+                const uint8_t* src = src_ + x * 3;
+                const __m128i in0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+                const __m128i in1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+                const __m128i in2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+
+                const __m128i p0 = in0;
+                const __m128i p1 = _mm_alignr_epi8(in1, in0, 12);
+                const __m128i p2 = _mm_alignr_epi8(in2, in1, 8);
+                const __m128i p3 = _mm_srli_si128(in2, 4);
+
+                __m128i* dst = reinterpret_cast<__m128i*>(dst_ + x * 4);
+                _mm_storeu_si128(dst + 0, _mm_or_si128(_mm_shuffle_epi8(p0, shuffle), alpha));
+                _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_shuffle_epi8(p1, shuffle), alpha));
+                _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_shuffle_epi8(p2, shuffle), alpha));
+                _mm_storeu_si128(dst + 3, _mm_or_si128(_mm_shuffle_epi8(p3, shuffle), alpha));
+            }
+
+            ExpandToRgbaScalar<SWAP>(src_ + x * 3, dst_ + x * 4, count_ - x);
+        }
+
+        // 16 pixels per step: four 4-byte pixel blocks are packed to 12 bytes each and
+        // stitched into three stores
+        template <bool SWAP>
+        IMG_LIB_TARGET("ssse3")
+        static void ShrinkToRgbSsse3(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m128i shuffle = SWAP
+                ? _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+                : _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+            int x = 0;
+            for (; x + 16 <= count_; x += 16)
+            {
+                const __m128i* src = reinterpret_cast<const __m128i*>(src_ + x * 4);
+                const __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(src + 0), shuffle);
+                const __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(src + 1), shuffle);
+                const __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(src + 2), shuffle);
+                const __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(src + 3), shuffle);
+
+                __m128i* dst = reinterpret_cast<__m128i*>(dst_ + x * 3);
+                _mm_storeu_si128(dst + 0, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+                _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+                _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+            }
+
+            ShrinkToRgbScalar<SWAP>(src_ + x * 4, dst_ + x * 3, count_ - x);
+        }
+
+        // 16 pixels per step; every output block gathers its bytes from up to three input blocks
+        IMG_LIB_TARGET("ssse3")
+        static void BgrToRgbSsse3(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m128i m00 = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, -1);
+            const __m128i m01 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1);
+            const __m128i m10 = _mm_setr_epi8(-1, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+            const __m128i m11 = _mm_setr_epi8(0, -1, 4, 3, 2, 7, 6, 5, 10, 9, 8, 13, 12, 11, -1, 15);
+            const __m128i m12 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, -1);
+            const __m128i m21 = _mm_setr_epi8(14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+            const __m128i m22 = _mm_setr_epi8(-1, 3, 2, 1, 6, 5, 4, 9, 8, 7, 12, 11, 10, 15, 14, 13);
+
+            int x = 0;
+            for (; x + 16 <= count_; x += 16)
+            {
+                const __m128i* src = reinterpret_cast<const __m128i*>(src_ + x * 3);
+                const __m128i in0 = _mm_loadu_si128(src + 0);
+                const __m128i in1 = _mm_loadu_si128(src + 1);
+                const __m128i in2 = _mm_loadu_si128(src + 2);
+
+                __m128i* dst = reinterpret_cast<__m128i*>(dst_ + x * 3);
+                _mm_storeu_si128(dst + 0, _mm_or_si128(_mm_shuffle_epi8(in0, m00), _mm_shuffle_epi8(in1, m01)));
+                _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, m10), _mm_shuffle_epi8(in1, m11)), _mm_shuffle_epi8(in2, m12)));
+                _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_shuffle_epi8(in1, m21), _mm_shuffle_epi8(in2, m22)));
+            }
+
+            BgrToRgbScalar(src_ + x * 3, dst_ + x * 3, count_ - x);
+        }
+
+        IMG_LIB_TARGET("avx2")
+        static void BgraToRgbaAvx2(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m256i shuffle = _mm256_setr_epi8(
+                2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+            int x = 0;
+            for (; x + 8 <= count_; x += 8)
+            {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src_ + x * 4));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_ + x * 4), _mm256_shuffle_epi8(v, shuffle));
+            }
+
+            BgraToRgbaSsse3(src_ + x * 4, dst_ + x * 4, count_ - x);
+        }
+
+        // 32 pixels (96 bytes) per step: each 128-bit lane takes 4 pixels from a 16-byte window,
+        // the last window ends exactly at byte 96
+        template <bool SWAP>
+        IMG_LIB_TARGET("avx2")
+        static void ExpandToRgbaAvx2(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            const __m256i shuffle = SWAP
+                ? _mm256_setr_epi8(
+                    2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+                    6, 5, 4, -1, 9, 8, 7, -1, 12, 11, 10, -1, 15, 14, 13, -1)
+                : _mm256_setr_epi8(
+                    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                    4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+            const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+
+            int x = 0;
+            for (; x + 32 <= count_; x += 32)
+            {
+                const uint8_t* src = src_ + x * 3;
+                __m256i* dst = reinterpret_cast<__m256i*>(dst_ + x * 4);
+
+                // lane 0 starts at pixel 0, lane 1 four bytes early so it never reads past pixel 7
+                for (int i = 0; i < 4; ++i)
+                {
+                    const uint8_t* block = src + i * 24;
+                    const __m256i v = _mm256_inserti128_si256(
+                        _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(block))),
+                        _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 8)), 1);
+                    _mm256_storeu_si256(dst + i, _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+                }
+            }
+
+            ExpandToRgbaSsse3<SWAP>(src_ + x * 3, dst_ + x * 4, count_ - x);
+        }
+
+        IMG_LIB_TARGET("avx2")
+        static void PaletteToRgbaAvx2(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+            const int* table = reinterpret_cast<const int*>(palette_);
+
+            int x = 0;
+            for (; x + 8 <= count_; x += 8)
+            {
+                const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src_ + x)));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_ + x * 4), _mm256_i32gather_epi32(table, index, 4));
+            }
+
+            PaletteToRgbaScalar(src_ + x, palette_, dst_ + x * 4, count_ - x);
+        }
+
+        // 16 pixels per step: two gathers of 8 colors, packed to 12 bytes per lane and stitched
+        // into three stores as in ShrinkToRgbSsse3
+        IMG_LIB_TARGET("avx2")
+        static void PaletteToRgbAvx2(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+            const int* table = reinterpret_cast<const int*>(palette_);
+            const __m256i shuffle = _mm256_setr_epi8(
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+            int x = 0;
+            for (; x + 16 <= count_; x += 16)
+            {
+                const __m128i indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ + x));
+                const __m256i low = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(indices), 4), shuffle);
+                const __m256i high = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, _mm256_cvtepu8_epi32(_mm_srli_si128(indices, 8)), 4), shuffle);
+
+                const __m128i a = _mm256_castsi256_si128(low);
+                const __m128i b = _mm256_extracti128_si256(low, 1);
+                const __m128i c = _mm256_castsi256_si128(high);
+                const __m128i d = _mm256_extracti128_si256(high, 1);
+
+                __m128i* dst = reinterpret_cast<__m128i*>(dst_ + x * 3);
+                _mm_storeu_si128(dst + 0, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+                _mm_storeu_si128(dst + 1, _mm_or_si128(_mm_srli_si128(b, 4), _mm_slli_si128(c, 8)));
+                _mm_storeu_si128(dst + 2, _mm_or_si128(_mm_srli_si128(c, 8), _mm_slli_si128(d, 4)));
+            }
+
+            PaletteToRgbScalar(src_ + x, palette_, dst_ + x * 3, count_ - x);
+        }
+
+    #endif // IMG_LIB_X86
+
+        template <bool SWAP>
+        static void ExpandToRgba(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return ExpandToRgbaAvx2<SWAP>(src_, dst_, count_);
+
+            case SimdLevel::SSSE3:
+                return ExpandToRgbaSsse3<SWAP>(src_, dst_, count_);
+
+            default:
+                break;
+            }
+        #endif
+            ExpandToRgbaScalar<SWAP>(src_, dst_, count_);
+        }
+
+        template <bool SWAP>
+        static void ShrinkToRgb(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::SSSE3)
+            {
+                return ShrinkToRgbSsse3<SWAP>(src_, dst_, count_);
+            }
+        #endif
+            ShrinkToRgbScalar<SWAP>(src_, dst_, count_);
+        }
+
+        void BgrToRgba(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            ExpandToRgba<true>(src_, dst_, count_);
+        }
+
+        void RgbToRgba(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            ExpandToRgba<false>(src_, dst_, count_);
+        }
+
+        void BgraToRgba(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return BgraToRgbaAvx2(src_, dst_, count_);
+
+            case SimdLevel::SSSE3:
+                return BgraToRgbaSsse3(src_, dst_, count_);
+
+            case SimdLevel::SSE2:
+                return BgraToRgbaSse2(src_, dst_, count_);
+
+            default:
+                break;
+            }
+        #endif
+            BgraToRgbaScalar(src_, dst_, count_);
+        }
+
+        void BgrToRgb(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::SSSE3)
+            {
+                return BgrToRgbSsse3(src_, dst_, count_);
+            }
+        #endif
+            BgrToRgbScalar(src_, dst_, count_);
+        }
+
+        void RgbaToRgb(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            ShrinkToRgb<false>(src_, dst_, count_);
+        }
+
+        void BgraToRgb(const uint8_t* src_, uint8_t* dst_, int count_)
+        {
+            ShrinkToRgb<true>(src_, dst_, count_);
+        }
+
+        void PaletteToRgba(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::AVX2)
+            {
+                return PaletteToRgbaAvx2(src_, palette_, dst_, count_);
+            }
+        #endif
+            PaletteToRgbaScalar(src_, palette_, dst_, count_);
+        }
+
+        void PaletteToRgb(const uint8_t* src_, const uint32_t* palette_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::AVX2)
+            {
+                return PaletteToRgbAvx2(src_, palette_, dst_, count_);
+            }
+        #endif
+            PaletteToRgbScalar(src_, palette_, dst_, count_);
+        }
+
+        static uint16_t LoadSample16(const uint8_t* src_) noexcept
+        {
+            uint16_t value;
+            std::memcpy(&value, src_, sizeof(value));
+            return value;
+        }
+
+        static void StoreSample16(uint8_t* dst_, uint16_t value_) noexcept
+        {
+            std::memcpy(dst_, &value_, sizeof(value_));
+        }
+
+        // BT.601 luma
+        static uint8_t Luma8(uint32_t r_, uint32_t g_, uint32_t b_) noexcept
+        {
+            return static_cast<uint8_t>((77 * r_ + 150 * g_ + 29 * b_ + 128) >> 8);
+        }
+
+        static uint16_t Luma16(uint32_t r_, uint32_t g_, uint32_t b_) noexcept
+        {
+            return static_cast<uint16_t>((19595 * r_ + 38470 * g_ + 7471 * b_ + 32768) >> 16);
+        }
+
+        // 8-bit formats to R,G,B,A bytes
+        static void ToRgba8(const uint8_t* src_, PixelFormat format_, uint8_t* dst_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, dst_ += 4)
+            {
+                switch (format_)
+                {
+                case PixelFormat::GRAY8:
+                    dst_[0] = dst_[1] = dst_[2] = src_[x];
+                    dst_[3] = 255;
+                    break;
+
+                case PixelFormat::GRAYA8:
+                    dst_[0] = dst_[1] = dst_[2] = src_[x * 2];
+                    dst_[3] = src_[x * 2 + 1];
+                    break;
+
+                case PixelFormat::RGB8:
+                    std::memcpy(dst_, src_ + x * 3, 3);
+                    dst_[3] = 255;
+                    break;
+
+                default:
+                    std::memcpy(dst_, src_ + x * 4, 4);
+                    break;
+                }
+            }
+        }
+
+        // R,G,B,A bytes to 8-bit formats
+        static void FromRgba8(const uint8_t* src_, uint8_t* dst_, PixelFormat format_, int count_)
+        {
+            for (int x = 0; x < count_; ++x, src_ += 4)
+            {
+                switch (format_)
+                {
+                case PixelFormat::GRAY8:
+                    dst_[x] = Luma8(src_[0], src_[1], src_[2]);
+                    break;
+
+                case PixelFormat::GRAYA8:
+                    dst_[x * 2] = Luma8(src_[0], src_[1], src_[2]);
+                    dst_[x * 2 + 1] = src_[3];
+                    break;
+
+                case PixelFormat::RGB8:
+                    std::memcpy(dst_ + x * 3, src_, 3);
+                    break;
+
+                default:
+                    std::memcpy(dst_ + x * 4, src_, 4);
+                    break;
+                }
+            }
+        }
+
+        // any format to 16-bit R,G,B,A; 8-bit samples are scaled by 257
+        static void ToRgba16(const uint8_t* src_, PixelFormat format_, uint16_t* dst_, int count_)
+        {
+            const int channels = GetChannelCount(format_);
+            const bool wide = GetBitDepth(format_) == 16;
+
+            for (int x = 0; x < count_; ++x, dst_ += 4)
+            {
+                uint16_t samples[4] = { 0, 0, 0, 65535 };
+                for (int c = 0; c < channels; ++c)
+                {
+                    samples[c] = wide ? LoadSample16(src_ + (x * channels + c) * 2) : static_cast<uint16_t>(src_[x * channels + c] * 257);
+                }
+
+                if (IsGray(format_))
+                {
+                    dst_[0] = dst_[1] = dst_[2] = samples[0];
+                    dst_[3] = channels == 2 ? samples[1] : 65535;
+                }
+                else
+                {
+                    std::memcpy(dst_, samples, sizeof(samples));
+                }
+            }
+        }
+
+        // 16-bit R,G,B,A to any format; 8-bit samples keep the high byte
+        static void FromRgba16(const uint16_t* src_, uint8_t* dst_, PixelFormat format_, int count_)
+        {
+            const int channels = GetChannelCount(format_);
+            const bool wide = GetBitDepth(format_) == 16;
+
+            for (int x = 0; x < count_; ++x, src_ += 4)
+            {
+                uint16_t samples[4] = { src_[0], src_[1], src_[2], src_[3] };
+                if (IsGray(format_))
+                {
+                    samples[0] = Luma16(src_[0], src_[1], src_[2]);
+                    samples[1] = src_[3];
+                }
+
+                for (int c = 0; c < channels; ++c)
+                {
+                    if (wide)
+                    {
+                        StoreSample16(dst_ + (x * channels + c) * 2, samples[c]);
+                    }
+                    else
+                    {
+                        dst_[x * channels + c] = static_cast<uint8_t>(samples[c] >> 8);
+                    }
+                }
+            }
+        }
+
+        void ConvertPixels(const uint8_t* src_, PixelFormat src_format_, uint8_t* dst_, PixelFormat dst_format_, int count_)
+        {
+            if (src_format_ == dst_format_)
+            {
+                std::memcpy(dst_, src_, static_cast<size_t>(count_) * GetBytesPerPixel(src_format_));
+                return;
+            }
+
+            if (src_format_ == PixelFormat::RGB8 && dst_format_ == PixelFormat::RGBA8)
+            {
+                return RgbToRgba(src_, dst_, count_);
+            }
+            if (src_format_ == PixelFormat::RGBA8 && dst_format_ == PixelFormat::RGB8)
+            {
+                return RgbaToRgb(src_, dst_, count_);
+            }
+
+            const bool narrow = GetBitDepth(src_format_) == 8 && GetBitDepth(dst_format_) == 8;
+            if (narrow && src_format_ == PixelFormat::RGBA8)
+            {
+                return FromRgba8(src_, dst_, dst_format_, count_);
+            }
+            if (narrow && dst_format_ == PixelFormat::RGBA8)
+            {
+                return ToRgba8(src_, src_format_, dst_, count_);
+            }
+
+            // everything else goes through a small RGBA chunk of the wider depth
+            const int src_size = GetBytesPerPixel(src_format_);
+            const int dst_size = GetBytesPerPixel(dst_format_);
+
+            for (int x = 0; x < count_; x += CONVERT_CHUNK_PIXELS)
+            {
+                const int count = std::min(CONVERT_CHUNK_PIXELS, count_ - x);
+                const uint8_t* src = src_ + static_cast<size_t>(x) * src_size;
+                uint8_t* dst = dst_ + static_cast<size_t>(x) * dst_size;
+
+                if (narrow)
+                {
+                    uint8_t rgba[CONVERT_CHUNK_PIXELS * 4];
+                    ToRgba8(src, src_format_, rgba, count);
+                    FromRgba8(rgba, dst, dst_format_, count);
+                }
+                else
+                {
+                    uint16_t rgba[CONVERT_CHUNK_PIXELS * 4];
+                    ToRgba16(src, src_format_, rgba, count);
+                    FromRgba16(rgba, dst, dst_format_, count);
+                }
+            }
+        }
+
+    } // end namespace pixel_ops
+
+} // end namespace img_lib
@@ -0,0 +1,476 @@
+#include "png_deflate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+namespace img_lib
+{
+    namespace png_image
+    {
+        struct IdatEncoder::Block
+        {
+            std::vector<uint8_t> raw;   // big-endian rows: context rows, then the block's own
+            int context = 0;            // leading rows that only feed the filters and the dictionary
+            int rows = 0;
+            bool last = false;
+
+            std::vector<uint8_t> deflated;
+            unsigned long adler = 1;    // of the block's filtered bytes
+            size_t length = 0;
+
+            std::atomic<bool> started{ false };
+            bool done = false;          // guarded by Progress::mutex
+            std::exception_ptr error;
+        };
+
+        // Blocks done by a pool worker are reported here; tasks may outlive the encoder when it is
+        // destroyed after an error, so they hold it by shared_ptr.
+        struct IdatEncoder::Progress
+        {
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+
+        enum : uint8_t { FILTER_NONE, FILTER_SUB, FILTER_UP, FILTER_AVG, FILTER_PAETH };
+
+        static bool IsLittleEndian() noexcept
+        {
+            const uint16_t probe = 1;
+            return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        }
+
+        static int GetZlibStrategy(PngStrategy strategy_) noexcept
+        {
+            switch (strategy_)
+            {
+            case PngStrategy::FILTERED:
+                return Z_FILTERED;
+
+            case PngStrategy::HUFFMAN_ONLY:
+                return Z_HUFFMAN_ONLY;
+
+            case PngStrategy::RLE:
+                return Z_RLE;
+
+            default:
+                return Z_DEFAULT_STRATEGY;
+            }
+        }
+
+        // the two bytes deflateInit2() would start a zlib stream with
+        static void WriteZlibHeader(const PngEncodeOptions& options_, uint8_t* out_) noexcept
+        {
+            int level_flags = 3;
+            if (options_.strategy == PngStrategy::HUFFMAN_ONLY || options_.strategy == PngStrategy::RLE || options_.level < 2)
+            {
+                level_flags = 0;
+            }
+            else if (options_.level < 6)
+            {
+                level_flags = 1;
+            }
+            else if (options_.level == 6)
+            {
+                level_flags = 2;
+            }
+
+            unsigned header = (Z_DEFLATED + ((options_.window_bits - 8) << 4)) << 8 | level_flags << 6;
+            header += 31 - header % 31;
+
+            out_[0] = static_cast<uint8_t>(header >> 8);
+            out_[1] = static_cast<uint8_t>(header);
+        }
+
+        static inline uint8_t Paeth(int a_, int b_, int c_) noexcept
+        {
+            const int pa = std::abs(b_ - c_);
+            const int pb = std::abs(a_ - c_);
+            const int pc = std::abs(a_ + b_ - 2 * c_);
+            return static_cast<uint8_t>(pa <= pb && pa <= pc ? a_ : pb <= pc ? b_ : c_);
+        }
+
+        // out_[0] gets the filter type, out_[1..size_] the filtered row
+        static void FilterRow(uint8_t filter_, const uint8_t* row_, const uint8_t* prev_, size_t size_, int bpp_, uint8_t* out_) noexcept
+        {
+            *out_++ = filter_;
+            const size_t left = std::min(static_cast<size_t>(bpp_), size_);
+
+            switch (filter_)
+            {
+            case FILTER_SUB:
+                std::memcpy(out_, row_, left);
+                for (size_t i = left; i < size_; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - row_[i - bpp_]);
+                }
+                break;
+
+            case FILTER_UP:
+                for (size_t i = 0; i < size_; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - prev_[i]);
+                }
+                break;
+
+            case FILTER_AVG:
+                for (size_t i = 0; i < left; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - (prev_[i] >> 1));
+                }
+                for (size_t i = left; i < size_; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - ((row_[i - bpp_] + prev_[i]) >> 1));
+                }
+                break;
+
+            case FILTER_PAETH:
+                for (size_t i = 0; i < left; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - prev_[i]);
+                }
+                for (size_t i = left; i < size_; ++i)
+                {
+                    out_[i] = static_cast<uint8_t>(row_[i] - Paeth(row_[i - bpp_], prev_[i], prev_[i - bpp_]));
+                }
+                break;
+
+            default:
+                std::memcpy(out_, row_, size_);
+                break;
+            }
+        }
+
+        // libpng's heuristic: the filter whose output has the smallest sum of bytes taken as signed
+        static size_t GetFilterCost(const uint8_t* filtered_, size_t size_) noexcept
+        {
+            size_t sum = 0;
+            for (size_t i = 0; i < size_; ++i)
+            {
+                sum += static_cast<size_t>(std::abs(static_cast<int8_t>(filtered_[i])));
+            }
+            return sum;
+        }
+
+        // rows_ holds context_ + count_ rows; all but the first are filtered into out_, the first
+        // only serves as the row above
+        static void FilterRows(const uint8_t* rows_, int context_, int count_, size_t size_, int bpp_, PngFilter filter_, uint8_t* out_)
+        {
+            const size_t line = size_ + 1;
+            const std::vector<uint8_t> zero(context_ > 0 ? 0 : size_, 0);
+            const bool adaptive = filter_ == PngFilter::ADAPTIVE;
+
+            std::vector<uint8_t> trial(adaptive ? line : 0);
+
+            for (int r = context_ > 0 ? 1 : 0; r < context_ + count_; ++r)
+            {
+                const uint8_t* row = rows_ + r * size_;
+                const uint8_t* prev = r > 0 ? row - size_ : zero.data();
+
+                if (!adaptive)
+                {
+                    FilterRow(static_cast<uint8_t>(filter_), row, prev, size_, bpp_, out_);
+                    out_ += line;
+                    continue;
+                }
+
+                FilterRow(FILTER_NONE, row, prev, size_, bpp_, out_);
+                size_t best = GetFilterCost(out_ + 1, size_);
+                for (uint8_t filter = FILTER_SUB; filter <= FILTER_PAETH; ++filter)
+                {
+                    FilterRow(filter, row, prev, size_, bpp_, trial.data());
+                    const size_t cost = GetFilterCost(trial.data() + 1, size_);
+                    if (cost < best)
+                    {
+                        best = cost;
+                        std::memcpy(out_, trial.data(), line);
+                    }
+                }
+                out_ += line;
+            }
+        }
+
+        void IdatEncoder::Deflate(const Settings& settings_, Block& block_)
+        {
+            const PngEncodeOptions& options = settings_.options;
+            const size_t line = settings_.row_bytes + 1;
+            const size_t dictionary = static_cast<size_t>(std::max(block_.context - 1, 0)) * line;
+
+            std::vector<uint8_t> filtered(dictionary + static_cast<size_t>(block_.rows) * line);
+            FilterRows(block_.raw.data(), block_.context, block_.rows, settings_.row_bytes, settings_.pixel_bytes, options.filter, filtered.data());
+
+            uint8_t* data = filtered.data() + dictionary;
+            block_.length = static_cast<size_t>(block_.rows) * line;
+            block_.adler = adler32(1, data, static_cast<uInt>(block_.length));
+
+            z_stream stream = {};
+            if (deflateInit2(&stream, options.level, Z_DEFLATED, -options.window_bits, options.mem_level, GetZlibStrategy(options.strategy)) != Z_OK)
+            {
+                throw std::runtime_error("Failed to initialize PNG compression");
+            }
+
+            if (dictionary > 0)
+            {
+                const size_t window = std::min(dictionary, static_cast<size_t>(1) << options.window_bits);
+                deflateSetDictionary(&stream, data - window, static_cast<uInt>(window));
+            }
+
+            // the first block opens the zlib stream
+            const size_t header = block_.context == 0 ? 2 : 0;
+            block_.deflated.resize(header + deflateBound(&stream, static_cast<uLong>(block_.length)) + 16);
+            if (header)
+            {
+                WriteZlibHeader(options, block_.deflated.data());
+            }
+
+            stream.next_in = data;
+            stream.avail_in = static_cast<uInt>(block_.length);
+            size_t produced = header;
+
+            int result = Z_OK;
+            do
+            {
+                if (produced == block_.deflated.size())
+                {
+                    block_.deflated.resize(block_.deflated.size() * 2);
+                }
+                stream.next_out = block_.deflated.data() + produced;
+                stream.avail_out = static_cast<uInt>(block_.deflated.size() - produced);
+
+                result = deflate(&stream, block_.last ? Z_FINISH : Z_SYNC_FLUSH);
+                produced = block_.deflated.size() - stream.avail_out;
+            } while (result == Z_OK && stream.avail_out == 0);
+
+            deflateEnd(&stream);
+            if (result != (block_.last ? Z_STREAM_END : Z_OK))
+            {
+                throw std::runtime_error("PNG compression failed");
+            }
+
+            block_.deflated.resize(produced);
+        }
+
+        IdatEncoder::IdatEncoder(int width_, int height_, int channels_, int bit_depth_, const PngEncodeOptions& options_, Sink sink_)
+            : sink(std::move(sink_))
+            , height(height_)
+            , pool(GetParallelPool())
+            , progress(std::make_shared<Progress>())
+        {
+            // filters look one whole pixel back, or one byte below 8 bits per pixel
+            settings.pixel_bytes = std::max(channels_ * bit_depth_ / 8, 1);
+            settings.row_bytes = (static_cast<size_t>(width_) * channels_ * bit_depth_ + 7) / 8;
+            settings.options = options_;
+
+            const size_t line = settings.row_bytes + 1;
+            const size_t window = static_cast<size_t>(1) << options_.window_bits;
+            rows_per_block = static_cast<int>(std::max<size_t>(1, BLOCK_BYTES / line));
+            context_rows = static_cast<int>((window + line - 1) / line) + 1;
+            swap_bytes = bit_depth_ == 16 && IsLittleEndian();
+
+            // the writing thread deflates too while it waits, so two blocks per thread keep everyone busy
+            max_in_flight = pool ? 2 * static_cast<size_t>(pool->GetThreadCount() + 1) : 0;
+            current = NewBlock();
+        }
+
+        IdatEncoder::~IdatEncoder()
+        {
+            for (const std::shared_ptr<Block>& block : in_flight)
+            {
+                // claims the blocks nobody started, so their tasks return at once
+                if (block->started.exchange(true))
+                {
+                    std::unique_lock<std::mutex> lock(progress->mutex);
+                    progress->done.wait(lock, [&] { return block->done; });
+                }
+            }
+        }
+
+        std::shared_ptr<IdatEncoder::Block> IdatEncoder::NewBlock() const
+        {
+            auto block = std::make_shared<Block>();
+            block->raw.resize(static_cast<size_t>(context_rows + rows_per_block) * settings.row_bytes);
+            return block;
+        }
+
+        void IdatEncoder::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            if (count_ > height - written)
+            {
+                throw std::invalid_argument("More PNG rows written than the image has");
+            }
+
+            const size_t size = settings.row_bytes;
+            for (int i = 0; i < count_; ++i)
+            {
+                const uint8_t* src = rows_ + i * stride_;
+                uint8_t* dst = current->raw.data() + static_cast<size_t>(current->context + current->rows) * size;
+
+                if (swap_bytes)
+                {
+                    for (size_t j = 0; j < size; j += 2)
+                    {
+                        dst[j] = src[j + 1];
+                        dst[j + 1] = src[j];
+                    }
+                }
+                else
+                {
+                    std::memcpy(dst, src, size);
+                }
+
+                ++written;
+                if (++current->rows == rows_per_block || written == height)
+                {
+                    Submit();
+                }
+            }
+        }
+
+        void IdatEncoder::Finish()
+        {
+            if (written != height)
+            {
+                throw std::runtime_error("PNG image is missing rows");
+            }
+
+            while (!in_flight.empty())
+            {
+                const std::shared_ptr<Block> block = in_flight.front();
+                Complete(*block);
+                in_flight.pop_front();
+                Emit(*block);
+            }
+        }
+
+        void IdatEncoder::Submit()
+        {
+            std::shared_ptr<Block> block = std::move(current);
+            block->last = written == height;
+
+            if (!block->last)
+            {
+                // the next block starts with the tail of this one
+                current = NewBlock();
+                const int carried = std::min(context_rows, block->context + block->rows);
+                const size_t offset = static_cast<size_t>(block->context + block->rows - carried) * settings.row_bytes;
+                std::memcpy(current->raw.data(), block->raw.data() + offset, carried * settings.row_bytes);
+                current->context = carried;
+            }
+
+            if (!pool)
+            {
+                block->started = true;
+                Deflate(settings, *block);
+                Emit(*block);
+                return;
+            }
+
+            while (in_flight.size() >= max_in_flight)
+            {
+                const std::shared_ptr<Block> front = in_flight.front();
+                Complete(*front);
+                in_flight.pop_front();
+                Emit(*front);
+            }
+
+            in_flight.push_back(block);
+            pool->Submit([block, settings = settings, progress = progress](int)
+            {
+                if (block->started.exchange(true))
+                {
+                    return;
+                }
+
+                try
+                {
+                    Deflate(settings, *block);
+                }
+                catch (...)
+                {
+                    block->error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(progress->mutex);
+                block->done = true;
+                progress->done.notify_all();
+            });
+
+            EmitReady();
+        }
+
+        void IdatEncoder::Complete(Block& block_)
+        {
+            // rather than wait for a worker, the writing thread deflates blocks nobody picked up yet
+            if (!block_.started.exchange(true))
+            {
+                try
+                {
+                    Deflate(settings, block_);
+                }
+                catch (...)
+                {
+                    block_.error = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(progress->mutex);
+                block_.done = true;
+            }
+
+            std::unique_lock<std::mutex> lock(progress->mutex);
+            progress->done.wait(lock, [&] { return block_.done; });
+            if (block_.error)
+            {
+                std::rethrow_exception(block_.error);
+            }
+        }
+
+        void IdatEncoder::Emit(Block& block_)
+        {
+            adler = adler32_combine(adler, block_.adler, static_cast<z_off_t>(block_.length));
+            if (block_.last)
+            {
+                for (int shift = 24; shift >= 0; shift -= 8)
+                {
+                    block_.deflated.push_back(static_cast<uint8_t>(adler >> shift));
+                }
+            }
+
+            sink(block_.deflated.data(), block_.deflated.size());
+
+            block_.raw = {};
+            block_.deflated = {};
+        }
+
+        void IdatEncoder::EmitReady()
+        {
+            while (!in_flight.empty())
+            {
+                const std::shared_ptr<Block> block = in_flight.front();
+                {
+                    std::lock_guard<std::mutex> lock(progress->mutex);
+                    if (!block->done)
+                    {
+                        return;
+                    }
+                }
+
+                if (block->error)
+                {
+                    std::rethrow_exception(block->error);
+                }
+                in_flight.pop_front();
+                Emit(*block);
+            }
+        }
+
+    } // end namespace png_image
+
+} // end namespace img_lib
@@ -1,66 +1,148 @@
 #include "png_image.h"
 
+#include <algorithm>
+#include <cstring>
 #include <setjmp.h>
 #include <stdexcept>
+#include <vector>
 
 namespace img_lib
 {
     namespace png_image
     {
-        const Image PngImage::LoadImagePNG(const Path& path_)
+        static FILE* OpenFile(const Path& path_, bool write_)
         {
-            FILE* file;
-
             #ifdef _MSC_VER
-            if ((file = _wfopen(path_.wstring().c_str(), L"rb")) == NULL)
-            {
+            return _wfopen(path_.wstring().c_str(), write_ ? L"wb" : L"rb");
             #else
-            if ((file = fopen(path_.string().c_str(), "rb")) == NULL) 
-            {
+            return fopen(path_.string().c_str(), write_ ? "wb" : "rb");
             #endif
-                return {};
+        }
+
+        // PNG stores 16-bit samples big-endian, images keep them in native order
+        static bool IsLittleEndian() noexcept
+        {
+            const uint16_t probe = 1;
+            return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        }
+
+        PngImage::~PngImage()
+        {
+            ReleaseDecode();
+            ReleaseEncode();
+        }
+
+        const Image PngImage::LoadImagePNG(const Path& path_)
+        {
+            return DecodeImage(*this, path_);
+        }
+
+        bool PngImage::SaveImagePNG(const Path& path_, const ImageView& image_)
+        {
+            if (encode_options.reduce != PngReduce::OFF)
+            {
+                encode_layout = ChooseLayout(image_);
             }
 
-            if (!file)
+            EncodeImage(*this, path_, image_);
+            return true;
+        }
+
+        ImageInfo PngImage::BeginDecode(const Path& path_)
+        {
+            ReleaseDecode();
+
+            decode_file = OpenFile(path_, false);
+            if (!decode_file)
             {
                 throw std::runtime_error("Failed to open file for reading: " + path_.string());
             }
 
-            png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-            if (!png)
+            decode_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+            if (!decode_png)
             {
-                fclose(file);
+                ReleaseDecode();
                 throw std::runtime_error("Failed to create PNG read struct");
             }
 
-            png_infop info = png_create_info_struct(png);
-            if (!info)
+            decode_png_info = png_create_info_struct(decode_png);
+            if (!decode_png_info)
             {
-                png_destroy_read_struct(&png, nullptr, nullptr);
-                fclose(file);
+                ReleaseDecode();
                 throw std::runtime_error("Failed to create PNG info struct");
             }
 
-            if (setjmp(png_jmpbuf(png)))
+            if (setjmp(png_jmpbuf(decode_png)))
             {
-                png_destroy_read_struct(&png, &info, nullptr);
-                fclose(file);
+                ReleaseDecode();
                 throw std::runtime_error("Error during PNG read");
             }
 
-            png_init_io(png, file);
+            png_structp png = decode_png;
+            png_infop info = decode_png_info;
+
+            png_init_io(png, decode_file);
 
             png_read_info(png, info);
 
-            int width = png_get_image_width(png, info);
-            int height = png_get_image_height(png, info);
-            png_byte color_type = png_get_color_type(png, info);
-            png_byte bit_depth = png_get_bit_depth(png, info);
+            const int width = png_get_image_width(png, info);
+            const int height = png_get_image_height(png, info);
 
-            if (bit_depth == 16)
+            decode_info = { width, height, GetNativeFormat(png, info) };
+            decode_row = 0;
+            decode_prepared = false;
+            decode_interlace = false;
+            decode_interlaced.clear();
+
+            return decode_info;
+        }
+
+        PixelFormat PngImage::GetReadFormat() const noexcept
+        {
+            return decode_info.format;
+        }
+
+        bool PngImage::SetReadFormat(PixelFormat format_)
+        {
+            // libpng can produce any format, the transforms are set up by the first ReadRows()
+            decode_info.format = format_;
+            return true;
+        }
+
+        // Storage format closest to the file's color type and bit depth; palettes expand to RGB and
+        // a tRNS chunk to an alpha channel.
+        PixelFormat PngImage::GetNativeFormat(png_structp png_, png_infop info_) noexcept
+        {
+            const png_byte color_type = png_get_color_type(png_, info_);
+            const bool deep = png_get_bit_depth(png_, info_) == 16;
+            const bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0 || png_get_valid(png_, info_, PNG_INFO_tRNS) != 0;
+
+            if ((color_type & PNG_COLOR_MASK_COLOR) == 0)
             {
-                png_set_strip_16(png);
+                if (!deep)
+                {
+                    return alpha ? PixelFormat::GRAYA8 : PixelFormat::GRAY8;
+                }
+                // there is no 16-bit gray + alpha format
+                return alpha ? PixelFormat::RGBA16 : PixelFormat::GRAY16;
+            }
+
+            if (deep)
+            {
+                return alpha ? PixelFormat::RGBA16 : PixelFormat::RGB16;
             }
+            return alpha ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+        }
+
+        // Sets up the libpng transforms from the stored pixels to decode_info.format.
+        void PngImage::PrepareDecode()
+        {
+            png_structp png = decode_png;
+            png_infop info = decode_png_info;
+
+            const png_byte color_type = png_get_color_type(png, info);
+            const png_byte bit_depth = png_get_bit_depth(png, info);
+            const PixelFormat format = decode_info.format;
 
             if (color_type == PNG_COLOR_TYPE_PALETTE)
             {
@@ -72,128 +154,406 @@ namespace img_lib
                 png_set_expand_gray_1_2_4_to_8(png);
             }
 
-            if (png_get_valid(png, info, PNG_INFO_tRNS))
+            const bool has_trns = png_get_valid(png, info, PNG_INFO_tRNS) != 0;
+            if (has_trns)
             {
                 png_set_tRNS_to_alpha(png);
             }
 
-            if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_PALETTE)
+            if (GetBitDepth(format) == 16 && bit_depth < 16)
             {
-                png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+                png_set_expand_16(png);
+            }
+            else if (GetBitDepth(format) == 8 && bit_depth == 16)
+            {
+                png_set_strip_16(png);
             }
 
-            if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+            const bool gray = (color_type & PNG_COLOR_MASK_COLOR) == 0;
+            if (gray && !IsGray(format))
             {
                 png_set_gray_to_rgb(png);
             }
-            png_read_update_info(png, info);
+            else if (!gray && IsGray(format))
+            {
+                // BT.601 weights, as used by pixel_ops::ConvertPixels
+                png_set_rgb_to_gray_fixed(png, 1, 29900, 58700);
+            }
 
-            std::vector<png_bytep> row_pointers(height);
-            std::vector<Color> pixels(width * height);
+            const bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0 || has_trns;
+            if (alpha && !HasAlpha(format))
+            {
+                png_set_strip_alpha(png);
+            }
+            else if (!alpha && HasAlpha(format))
+            {
+                png_set_add_alpha(png, 0xFFFF, PNG_FILLER_AFTER);
+            }
 
-            for (int y = 0; y < height; y++)
+            if (GetBitDepth(format) == 16 && IsLittleEndian())
             {
-                row_pointers[y] = reinterpret_cast<png_bytep>(&pixels[y * width]);
+                png_set_swap(png);
             }
 
-            png_read_image(png, row_pointers.data());
+            decode_interlace = png_get_interlace_type(png, info) != PNG_INTERLACE_NONE;
+            if (decode_interlace)
+            {
+                png_set_interlace_handling(png);
+            }
 
-            fclose(file);
+            png_read_update_info(png, info);
+            decode_prepared = true;
+        }
 
-            png_destroy_read_struct(&png, &info, nullptr);
+        // Runs every Adam7 pass over the whole image at rows_.
+        void PngImage::ReadInterlaced(uint8_t* rows_, ptrdiff_t stride_)
+        {
+            decode_row_pointers.resize(decode_info.height);
+            for (int y = 0; y < decode_info.height; y++)
+            {
+                decode_row_pointers[y] = rows_ + y * stride_;
+            }
 
-            Image image(width, height);
-            image.GetPixels() = std::move(pixels);
-            return image;
+            png_read_image(decode_png, decode_row_pointers.data());
         }
-        
-        bool PngImage::SaveImagePNG(const Path& path_, const Image& image_) const
+
+        int PngImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
         {
-            FILE* file;
+            const int rows = std::min(count_, decode_info.height - decode_row);
 
-            #ifdef _MSC_VER
-            if ((file = _wfopen(path_.wstring().c_str(), L"rb")) == NULL)
+            if (setjmp(png_jmpbuf(decode_png)))
             {
-            #else
-            if ((file = fopen(path_.string().c_str(), "rb")) == NULL) 
+                ReleaseDecode();
+                throw std::runtime_error("Error during PNG read");
+            }
+
+            if (!decode_prepared)
             {
-            #endif
-                return {};
+                PrepareDecode();
             }
 
-            if (!file)
+            // Adam7 passes revisit every row: a call for the whole image is decoded in place,
+            // anything smaller is served from a deinterlaced copy
+            if (decode_interlace && decode_row == 0 && rows == decode_info.height)
+            {
+                ReadInterlaced(rows_, stride_);
+
+                decode_row += rows;
+                return rows;
+            }
+
+            if (decode_interlace)
+            {
+                const size_t row_size = static_cast<size_t>(decode_info.width) * GetBytesPerPixel(decode_info.format);
+                if (decode_interlaced.empty())
+                {
+                    decode_interlaced.resize(row_size * decode_info.height);
+                    ReadInterlaced(decode_interlaced.data(), static_cast<ptrdiff_t>(row_size));
+                }
+
+                for (int i = 0; i < rows; ++i)
+                {
+                    std::memcpy(rows_ + i * stride_, decode_interlaced.data() + row_size * (decode_row + i), row_size);
+                }
+
+                decode_row += rows;
+                return rows;
+            }
+
+            for (int i = 0; i < rows; ++i)
+            {
+                png_read_row(decode_png, rows_ + i * stride_, nullptr);
+            }
+
+            decode_row += rows;
+            return rows;
+        }
+
+        void PngImage::EndDecode()
+        {
+            if (setjmp(png_jmpbuf(decode_png)))
+            {
+                ReleaseDecode();
+                throw std::runtime_error("Error during PNG read");
+            }
+
+            png_read_end(decode_png, nullptr);
+            ReleaseDecode();
+        }
+
+        void PngImage::BeginEncode(const Path& path_, const ImageInfo& info_)
+        {
+            std::optional<PngLayout> layout;
+            layout.swap(encode_layout);
+
+            ReleaseEncode();
+
+            encode_file = OpenFile(path_, true);
+            if (!encode_file)
             {
                 throw std::runtime_error("Failed to open file for writing: " + path_.string());
             }
 
-            png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-            if (!png)
+            encode_png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+            if (!encode_png)
             {
-                fclose(file);
+                ReleaseEncode();
                 throw std::runtime_error("Failed to create PNG write struct");
             }
 
-            png_infop info = png_create_info_struct(png);
-            if (!info)
+            encode_png_info = png_create_info_struct(encode_png);
+            if (!encode_png_info)
             {
-                png_destroy_write_struct(&png, nullptr);
-                fclose(file);
+                ReleaseEncode();
                 throw std::runtime_error("Failed to create PNG info struct");
             }
 
-            if (setjmp(png_jmpbuf(png)))
+            if (setjmp(png_jmpbuf(encode_png)))
             {
-                png_destroy_write_struct(&png, &info);
-                fclose(file);
+                ReleaseEncode();
                 throw std::runtime_error("Error during PNG write");
             }
 
-            png_init_io(png, file);
+            png_init_io(encode_png, encode_file);
+
+            encode_info = info_;
+
+            if (layout)
+            {
+                StartImageData(*layout);
+            }
+            else if (encode_options.reduce == PngReduce::ALWAYS)
+            {
+                encode_spill = Image(encode_info.width, encode_info.height, encode_info.format);
+                encode_spilled = 0;
+            }
+            else
+            {
+                StartImageData(GetDirectLayout(encode_info.format));
+            }
+        }
+
+        void PngImage::StartImageData(const PngLayout& layout_)
+        {
+            if (setjmp(png_jmpbuf(encode_png)))
+            {
+                ReleaseEncode();
+                throw std::runtime_error("Error during PNG write");
+            }
 
-            int width = image_.GetWidth();
-            int height = image_.GetHeight();
+            int color_type = PNG_COLOR_TYPE_PALETTE;
+            if (layout_.palette.empty())
+            {
+                switch (layout_.format)
+                {
+                case PixelFormat::GRAY8:
+                case PixelFormat::GRAY16:
+                    color_type = PNG_COLOR_TYPE_GRAY;
+                    break;
+
+                case PixelFormat::GRAYA8:
+                    color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+                    break;
+
+                case PixelFormat::RGB8:
+                case PixelFormat::RGB16:
+                    color_type = PNG_COLOR_TYPE_RGB;
+                    break;
+
+                default:
+                    color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+                    break;
+                }
+            }
 
             png_set_IHDR(
-                png,
-                info,
-                width, height,
-                8,
-                PNG_COLOR_TYPE_RGBA,
+                encode_png,
+                encode_png_info,
+                encode_info.width, encode_info.height,
+                layout_.bit_depth,
+                color_type,
                 PNG_INTERLACE_NONE,
                 PNG_COMPRESSION_TYPE_DEFAULT,
                 PNG_FILTER_TYPE_DEFAULT
             );
-            png_write_info(png, info);
 
-            std::vector<png_bytep> row_pointers(height);
-            std::vector<png_byte> temp_buffer(width * height * 4);
+            if (!layout_.palette.empty())
+            {
+                std::vector<png_color> colors;
+                std::vector<png_byte> alphas;
+                for (uint32_t color : layout_.palette)
+                {
+                    colors.push_back({ static_cast<png_byte>(color), static_cast<png_byte>(color >> 8), static_cast<png_byte>(color >> 16) });
+                    alphas.push_back(static_cast<png_byte>(color >> 24));
+                }
 
-            for (int y = 0; y < height; y++)
+                png_set_PLTE(encode_png, encode_png_info, colors.data(), static_cast<int>(colors.size()));
+                if (const int translucent = layout_.GetTranslucentCount())
+                {
+                    png_set_tRNS(encode_png, encode_png_info, alphas.data(), translucent, nullptr);
+                }
+            }
+
+            png_write_info(encode_png, encode_png_info);
+
+            // libpng writes the signature, the header and IEND; the image data is filtered and
+            // deflated by IdatEncoder and written as one IDAT chunk per block
+            encode_packer = std::make_unique<RowPacker>(layout_, encode_info.format, encode_info.width);
+            encode_idat = std::make_unique<IdatEncoder>(encode_info.width, encode_info.height, layout_.GetChannelCount(), layout_.bit_depth, encode_options, [this](const uint8_t* data_, size_t size_)
             {
-                const Color* row = image_.GetLine(y);
-                png_bytep row_pointer = &temp_buffer[y * width * 4];
-                
-                for (int x = 0; x < width; x++)
+                if (setjmp(png_jmpbuf(encode_png)))
                 {
-                    const Color& pixel = row[x];
-                    row_pointer[x * 4 + 0] = pixel.r;
-                    row_pointer[x * 4 + 1] = pixel.g;
-                    row_pointer[x * 4 + 2] = pixel.b;
-                    row_pointer[x * 4 + 3] = pixel.a;
+                    throw std::runtime_error("Error during PNG write");
                 }
-                row_pointers[y] = row_pointer;
+                png_write_chunk(encode_png, reinterpret_cast<png_const_bytep>("IDAT"), data_, size_);
+            });
+        }
+
+        void PngImage::WritePacked(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            if (encode_packer->IsDirect())
+            {
+                encode_idat->WriteRows(rows_, stride_, count_);
+                return;
             }
 
-            png_write_image(png, row_pointers.data());
-            png_write_end(png, nullptr);
+            for (int i = 0; i < count_; ++i)
+            {
+                encode_idat->WriteRows(encode_packer->Pack(rows_ + i * stride_), 0, 1);
+            }
+        }
 
-            fclose(file);
+        PixelFormat PngImage::GetWriteFormat() const noexcept
+        {
+            return encode_info.format;
+        }
 
-            png_destroy_write_struct(&png, &info);
+        void PngImage::SetEncodeOptions(const PngEncodeOptions& options_)
+        {
+            if (options_.level < 0 || options_.level > 9)
+            {
+                throw std::invalid_argument("PNG compression level must be 0 to 9");
+            }
+            if (options_.mem_level < 1 || options_.mem_level > 9)
+            {
+                throw std::invalid_argument("PNG memory level must be 1 to 9");
+            }
+            if (options_.window_bits < 9 || options_.window_bits > 15)
+            {
+                throw std::invalid_argument("PNG window bits must be 9 to 15");
+            }
+            encode_options = options_;
+        }
 
-            return true;
+        void PngImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            try
+            {
+                if (!encode_idat)
+                {
+                    if (count_ > encode_info.height - encode_spilled)
+                    {
+                        throw std::invalid_argument("More PNG rows written than the image has");
+                    }
+
+                    const size_t size = static_cast<size_t>(encode_info.width) * GetBytesPerPixel(encode_info.format);
+                    for (int i = 0; i < count_; ++i)
+                    {
+                        std::memcpy(encode_spill.GetRow(encode_spilled++), rows_ + i * stride_, size);
+                    }
+                    return;
+                }
+
+                WritePacked(rows_, stride_, count_);
+            }
+            catch (...)
+            {
+                ReleaseEncode();
+                throw;
+            }
+        }
+
+        void PngImage::EndEncode()
+        {
+            try
+            {
+                if (!encode_idat)
+                {
+                    if (encode_spilled != encode_info.height)
+                    {
+                        throw std::runtime_error("PNG image is missing rows");
+                    }
+
+                    StartImageData(ChooseLayout(encode_spill));
+                    WritePacked(encode_spill.GetRow(0), static_cast<ptrdiff_t>(encode_spill.GetStrideBytes()), encode_info.height);
+                }
+
+                encode_idat->Finish();
+            }
+            catch (...)
+            {
+                ReleaseEncode();
+                throw;
+            }
+
+            if (setjmp(png_jmpbuf(encode_png)))
+            {
+                ReleaseEncode();
+                throw std::runtime_error("Error during PNG write");
+            }
+
+            png_write_chunk(encode_png, reinterpret_cast<png_const_bytep>("IEND"), nullptr, 0);
+
+            const bool flushed = fflush(encode_file) == 0;
+            ReleaseEncode();
+
+            if (!flushed)
+            {
+                throw std::runtime_error("Failed to write PNG file");
+            }
+        }
+
+        void PngImage::AbortEncode() noexcept
+        {
+            ReleaseEncode();
+        }
+
+        void PngImage::ReleaseDecode() noexcept
+        {
+            if (decode_png)
+            {
+                png_destroy_read_struct(&decode_png, decode_png_info ? &decode_png_info : nullptr, nullptr);
+            }
+            if (decode_file)
+            {
+                fclose(decode_file);
+            }
+
+            decode_png = nullptr;
+            decode_png_info = nullptr;
+            decode_file = nullptr;
+            decode_row_pointers.clear();
+        }
+
+        void PngImage::ReleaseEncode() noexcept
+        {
+            encode_idat.reset();
+            encode_packer.reset();
+            encode_spill = Image();
+            if (encode_png)
+            {
+                png_destroy_write_struct(&encode_png, encode_png_info ? &encode_png_info : nullptr);
+            }
+            if (encode_file)
+            {
+                fclose(encode_file);
+            }
+
+            encode_png = nullptr;
+            encode_png_info = nullptr;
+            encode_file = nullptr;
         }
 
     } // end namespace png_image
 
-} // end namespace img_lib
\ No newline at end of file
+} // end namespace img_lib
@@ -0,0 +1,551 @@
+#include "png_reduce.h"
+#include "pixel_ops.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#ifdef IMG_LIB_X86
+#include <immintrin.h>
+#endif
+
+namespace img_lib
+{
+    namespace png_image
+    {
+        static const int MIN_BAND_ROWS = 64;
+
+        static uint32_t LoadColor(const uint8_t* rgba_) noexcept
+        {
+            return rgba_[0] | rgba_[1] << 8 | rgba_[2] << 16 | static_cast<uint32_t>(rgba_[3]) << 24;
+        }
+
+        static uint8_t GetAlpha(uint32_t color_) noexcept
+        {
+            return static_cast<uint8_t>(color_ >> 24);
+        }
+
+        // every step_-th byte, from the last of the first step_, is 255
+        static bool IsOpaqueScalar(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+            for (size_t i = step_ - 1; i < size_; i += step_)
+            {
+                if (row_[i] != 255)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // R,G,B with step_ 3 or R,G,B,A with step_ 4
+        static bool IsGrayScalar(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+            for (size_t i = 0; i + 2 < size_; i += step_)
+            {
+                if (row_[i] != row_[i + 1] || row_[i] != row_[i + 2])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // 16-bit samples whose two bytes are equal, i.e. an 8-bit value times 257
+        static bool IsNarrowScalar(const uint8_t* row_, size_t size_) noexcept
+        {
+            for (size_t i = 0; i + 1 < size_; i += 2)
+            {
+                if (row_[i] != row_[i + 1])
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    #ifdef IMG_LIB_X86
+
+        // alpha bytes of 2 or 4 byte pixels are ORed with the complement of their mask, so the
+        // running AND stays all ones while every pixel is opaque
+        IMG_LIB_TARGET("sse2")
+        static bool IsOpaqueSse2(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+            const __m128i mask = step_ == 4 ? _mm_set1_epi32(0x00FFFFFF) : _mm_set1_epi16(0x00FF);
+            __m128i all = _mm_set1_epi8(-1);
+
+            size_t i = 0;
+            for (; i + 16 <= size_; i += 16)
+            {
+                all = _mm_and_si128(all, _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(row_ + i)), mask));
+            }
+
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(all, _mm_set1_epi8(-1))) == 0xFFFF && IsOpaqueScalar(row_ + i, step_, size_ - i);
+        }
+
+        IMG_LIB_TARGET("avx2")
+        static bool IsOpaqueAvx2(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+            const __m256i mask = step_ == 4 ? _mm256_set1_epi32(0x00FFFFFF) : _mm256_set1_epi16(0x00FF);
+            __m256i all = _mm256_set1_epi8(-1);
+
+            size_t i = 0;
+            for (; i + 32 <= size_; i += 32)
+            {
+                all = _mm256_and_si256(all, _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(row_ + i)), mask));
+            }
+
+            return _mm256_movemask_epi8(_mm256_cmpeq_epi8(all, _mm256_set1_epi8(-1))) == -1 && IsOpaqueScalar(row_ + i, step_, size_ - i);
+        }
+
+        // R,G,B,A: (p ^ p >> 8) & 0xFFFF is zero exactly when r == g and g == b
+        IMG_LIB_TARGET("sse2")
+        static bool IsGrayRgbaSse2(const uint8_t* row_, size_t size_) noexcept
+        {
+            const __m128i mask = _mm_set1_epi32(0xFFFF);
+            __m128i any = _mm_setzero_si128();
+
+            size_t i = 0;
+            for (; i + 16 <= size_; i += 16)
+            {
+                const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_ + i));
+                any = _mm_or_si128(any, _mm_and_si128(_mm_xor_si128(pixels, _mm_srli_epi32(pixels, 8)), mask));
+            }
+
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF && IsGrayScalar(row_ + i, 4, size_ - i);
+        }
+
+        IMG_LIB_TARGET("avx2")
+        static bool IsGrayRgbaAvx2(const uint8_t* row_, size_t size_) noexcept
+        {
+            const __m256i mask = _mm256_set1_epi32(0xFFFF);
+            __m256i any = _mm256_setzero_si256();
+
+            size_t i = 0;
+            for (; i + 32 <= size_; i += 32)
+            {
+                const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row_ + i));
+                any = _mm256_or_si256(any, _mm256_and_si256(_mm256_xor_si256(pixels, _mm256_srli_epi32(pixels, 8)), mask));
+            }
+
+            return _mm256_testz_si256(any, any) && IsGrayScalar(row_ + i, 4, size_ - i);
+        }
+
+        // R,G,B: five pixels per 16-byte load, comparing every byte with the next one; within
+        // each pixel the first and second comparison must hold
+        IMG_LIB_TARGET("sse2")
+        static bool IsGrayRgbSse2(const uint8_t* row_, size_t size_) noexcept
+        {
+            const int pairs = 0x36DB; // bits 0, 1, 3, 4, ... 12, 13
+
+            size_t i = 0;
+            for (; i + 16 <= size_; i += 15)
+            {
+                const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_ + i));
+                if ((_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_srli_si128(bytes, 1))) & pairs) != pairs)
+                {
+                    return false;
+                }
+            }
+
+            return IsGrayScalar(row_ + i, 3, size_ - i);
+        }
+
+        // the bytes of every 16-bit lane are equal when swapping them changes nothing
+        IMG_LIB_TARGET("sse2")
+        static bool IsNarrowSse2(const uint8_t* row_, size_t size_) noexcept
+        {
+            __m128i any = _mm_setzero_si128();
+
+            size_t i = 0;
+            for (; i + 16 <= size_; i += 16)
+            {
+                const __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row_ + i));
+                const __m128i swapped = _mm_or_si128(_mm_slli_epi16(samples, 8), _mm_srli_epi16(samples, 8));
+                any = _mm_or_si128(any, _mm_xor_si128(samples, swapped));
+            }
+
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xFFFF && IsNarrowScalar(row_ + i, size_ - i);
+        }
+
+    #endif // IMG_LIB_X86
+
+        static bool IsOpaqueRow(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return IsOpaqueAvx2(row_, step_, size_);
+
+            case SimdLevel::SSSE3:
+            case SimdLevel::SSE2:
+                return IsOpaqueSse2(row_, step_, size_);
+
+            default:
+                break;
+            }
+        #endif
+            return IsOpaqueScalar(row_, step_, size_);
+        }
+
+        static bool IsGrayRow(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+        #ifdef IMG_LIB_X86
+            const SimdLevel level = GetSimdLevel();
+            if (step_ == 4 && level == SimdLevel::AVX2)
+            {
+                return IsGrayRgbaAvx2(row_, size_);
+            }
+            if (level >= SimdLevel::SSE2)
+            {
+                return step_ == 4 ? IsGrayRgbaSse2(row_, size_) : IsGrayRgbSse2(row_, size_);
+            }
+        #endif
+            return IsGrayScalar(row_, step_, size_);
+        }
+
+        static bool IsNarrowRow(const uint8_t* row_, size_t size_) noexcept
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::SSE2)
+            {
+                return IsNarrowSse2(row_, size_);
+            }
+        #endif
+            return IsNarrowScalar(row_, size_);
+        }
+
+        static bool Is16BitOpaque(const uint8_t* row_, size_t size_) noexcept
+        {
+            for (size_t i = 6; i + 1 < size_; i += 8)
+            {
+                if (row_[i] != 255 || row_[i + 1] != 255)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static bool Is16BitGray(const uint8_t* row_, int step_, size_t size_) noexcept
+        {
+            for (size_t i = 0; i + 5 < size_; i += step_)
+            {
+                if (std::memcmp(row_ + i, row_ + i + 2, 2) != 0 || std::memcmp(row_ + i, row_ + i + 4, 2) != 0)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // What a band of rows rules out. A property starts false when the format makes it moot.
+        struct Analysis
+        {
+            bool opaque = false;     // every alpha is the maximum
+            bool gray = false;       // r == g == b everywhere
+            bool narrow = false;     // every 16-bit sample is an 8-bit one times 257
+            bool few_colors = true;  // colors holds every color, as 8-bit R,G,B,A
+            ColorTable colors;
+
+            explicit Analysis(PixelFormat format_) noexcept
+                : opaque(HasAlpha(format_))
+                , gray(!IsGray(format_))
+                , narrow(GetBitDepth(format_) == 16)
+            {
+            }
+
+            bool IsOpen() const noexcept
+            {
+                return opaque || gray || narrow || few_colors;
+            }
+
+            void Merge(const Analysis& other_) noexcept
+            {
+                opaque = opaque && other_.opaque;
+                gray = gray && other_.gray;
+                narrow = narrow && other_.narrow;
+                few_colors = few_colors && other_.few_colors;
+
+                for (int i = 0; few_colors && i < other_.colors.GetCount(); ++i)
+                {
+                    few_colors = colors.Insert(other_.colors.GetColor(i)) >= 0;
+                }
+            }
+        };
+
+        static void AnalyzeRows(const ImageView& image_, int begin_, int end_, Analysis& analysis_)
+        {
+            const PixelFormat format = image_.GetFormat();
+            const int width = image_.GetWidth();
+            const int channels = GetChannelCount(format);
+            const bool wide = GetBitDepth(format) == 16;
+            const size_t size = static_cast<size_t>(width) * GetBytesPerPixel(format);
+
+            std::vector<uint8_t> rgba(static_cast<size_t>(width) * 4);
+
+            for (int y = begin_; y < end_ && analysis_.IsOpen(); ++y)
+            {
+                const uint8_t* row = image_.GetRow(y);
+
+                if (analysis_.opaque)
+                {
+                    analysis_.opaque = wide ? Is16BitOpaque(row, size) : IsOpaqueRow(row, channels, size);
+                }
+                if (analysis_.gray)
+                {
+                    analysis_.gray = wide ? Is16BitGray(row, channels * 2, size) : IsGrayRow(row, channels, size);
+                }
+                if (analysis_.narrow)
+                {
+                    analysis_.narrow = IsNarrowRow(row, size);
+                }
+
+                if (analysis_.few_colors)
+                {
+                    // 16-bit samples keep their high byte, which only matters while narrow holds
+                    pixel_ops::ConvertPixels(row, format, rgba.data(), PixelFormat::RGBA8, width);
+
+                    uint32_t last = ~LoadColor(rgba.data());
+                    for (int x = 0; x < width; ++x)
+                    {
+                        const uint32_t color = LoadColor(rgba.data() + x * 4);
+                        if (color != last)
+                        {
+                            last = color;
+                            if (analysis_.colors.Insert(color) < 0)
+                            {
+                                analysis_.few_colors = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // 1, 2 or 4 when every gray level is a multiple of 255, 85 or 17, otherwise 8
+        static int GetGrayBits(const ColorTable& colors_) noexcept
+        {
+            for (int bits = 1; bits < 8; bits *= 2)
+            {
+                const uint32_t step = 255 / ((1u << bits) - 1);
+
+                bool fits = true;
+                for (int i = 0; fits && i < colors_.GetCount(); ++i)
+                {
+                    fits = (colors_.GetColor(i) & 0xFF) % step == 0;
+                }
+                if (fits)
+                {
+                    return bits;
+                }
+            }
+            return 8;
+        }
+
+        int PngLayout::GetTranslucentCount() const noexcept
+        {
+            return static_cast<int>(std::count_if(palette.begin(), palette.end(), [](uint32_t color_) { return GetAlpha(color_) != 255; }));
+        }
+
+        PngLayout GetDirectLayout(PixelFormat format_) noexcept
+        {
+            PngLayout layout;
+            layout.format = format_;
+            layout.bit_depth = GetBitDepth(format_);
+            return layout;
+        }
+
+        PngLayout ChooseLayout(const ImageView& image_)
+        {
+            const PixelFormat format = image_.GetFormat();
+
+            // the palette is sorted below, so the order bands merge in does not matter
+            Analysis result(format);
+            std::mutex mutex;
+            ParallelFor(image_.GetHeight(), MIN_BAND_ROWS, [&](int begin_, int end_)
+            {
+                Analysis band(format);
+                AnalyzeRows(image_, begin_, end_, band);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                result.Merge(band);
+            });
+
+            const bool alpha = HasAlpha(format) && !result.opaque;
+            const bool gray = IsGray(format) || result.gray;
+            const bool wide = GetBitDepth(format) == 16 && !result.narrow;
+            const bool palette = result.few_colors && !wide;
+
+            const int count = result.colors.GetCount();
+            const int palette_bits = count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+
+            PngLayout layout;
+            if (gray && !alpha)
+            {
+                if (wide)
+                {
+                    return GetDirectLayout(PixelFormat::GRAY16);
+                }
+
+                // gray levels beat a palette of the same depth, which costs a PLTE chunk
+                const int gray_bits = palette ? GetGrayBits(result.colors) : 8;
+                if (!palette || gray_bits <= palette_bits)
+                {
+                    layout.format = PixelFormat::GRAY8;
+                    layout.bit_depth = gray_bits;
+                    return layout;
+                }
+            }
+
+            if (palette)
+            {
+                layout.bit_depth = palette_bits;
+                for (int i = 0; i < count; ++i)
+                {
+                    layout.palette.push_back(result.colors.GetColor(i));
+                }
+
+                // translucent entries first keep tRNS short
+                std::sort(layout.palette.begin(), layout.palette.end(), [](uint32_t a_, uint32_t b_)
+                {
+                    return std::make_pair(GetAlpha(a_) == 255, a_) < std::make_pair(GetAlpha(b_) == 255, b_);
+                });
+                return layout;
+            }
+
+            if (gray && !wide)
+            {
+                return GetDirectLayout(PixelFormat::GRAYA8);
+            }
+            if (alpha)
+            {
+                return GetDirectLayout(wide ? PixelFormat::RGBA16 : PixelFormat::RGBA8);
+            }
+            return GetDirectLayout(wide ? PixelFormat::RGB16 : PixelFormat::RGB8);
+        }
+
+        ColorTable::ColorTable() noexcept
+        {
+            std::fill(std::begin(slots), std::end(slots), static_cast<int16_t>(-1));
+        }
+
+        static size_t GetSlot(uint32_t color_, int slots_) noexcept
+        {
+            return static_cast<size_t>((color_ * 2654435761u) >> 22) & (slots_ - 1);
+        }
+
+        int ColorTable::Insert(uint32_t color_) noexcept
+        {
+            for (size_t slot = GetSlot(color_, SLOTS);; slot = (slot + 1) & (SLOTS - 1))
+            {
+                if (slots[slot] < 0)
+                {
+                    if (count == MAX_COLORS)
+                    {
+                        return -1;
+                    }
+
+                    keys[slot] = color_;
+                    slots[slot] = static_cast<int16_t>(count);
+                    colors[count] = color_;
+                    return count++;
+                }
+                if (keys[slot] == color_)
+                {
+                    return slots[slot];
+                }
+            }
+        }
+
+        int ColorTable::Find(uint32_t color_) const noexcept
+        {
+            for (size_t slot = GetSlot(color_, SLOTS);; slot = (slot + 1) & (SLOTS - 1))
+            {
+                if (slots[slot] < 0)
+                {
+                    return -1;
+                }
+                if (keys[slot] == color_)
+                {
+                    return slots[slot];
+                }
+            }
+        }
+
+        RowPacker::RowPacker(const PngLayout& layout_, PixelFormat format_, int width_)
+            : layout(layout_)
+            , format(format_)
+            , width(width_)
+        {
+            direct = layout.palette.empty() && layout.format == format && layout.bit_depth == GetBitDepth(format);
+
+            for (uint32_t color : layout.palette)
+            {
+                indices.Insert(color);
+            }
+
+            if (layout.format != format)
+            {
+                converted.resize(static_cast<size_t>(width) * GetBytesPerPixel(layout.format));
+            }
+            if (!layout.palette.empty() || layout.bit_depth < 8)
+            {
+                packed.resize((static_cast<size_t>(width) * layout.bit_depth + 7) / 8);
+            }
+        }
+
+        const uint8_t* RowPacker::Pack(const uint8_t* row_)
+        {
+            const uint8_t* pixels = row_;
+            if (layout.format != format)
+            {
+                pixel_ops::ConvertPixels(row_, format, converted.data(), layout.format, width);
+                pixels = converted.data();
+            }
+
+            if (packed.empty())
+            {
+                return pixels;
+            }
+
+            const int bits = layout.bit_depth;
+            const bool indexed = !layout.palette.empty();
+            std::fill(packed.begin(), packed.end(), static_cast<uint8_t>(0));
+
+            uint32_t last_color = indexed ? ~LoadColor(pixels) : 0;
+            int last_index = 0;
+
+            for (int x = 0; x < width; ++x)
+            {
+                int value = 0;
+                if (indexed)
+                {
+                    const uint32_t color = LoadColor(pixels + x * 4);
+                    if (color != last_color)
+                    {
+                        last_color = color;
+                        last_index = std::max(indices.Find(color), 0);
+                    }
+                    value = last_index;
+                }
+                else
+                {
+                    value = pixels[x] >> (8 - bits);
+                }
+
+                // PNG packs samples from the most significant bit down
+                const size_t bit = static_cast<size_t>(x) * bits;
+                packed[bit / 8] |= static_cast<uint8_t>(value << (8 - bits - bit % 8));
+            }
+
+            return packed.data();
+        }
+
+    } // end namespace png_image
+
+} // end namespace img_lib
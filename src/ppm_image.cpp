@@ -1,222 +1,480 @@
 #include "ppm_image.h"
+#include "pixel_ops.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 namespace img_lib
 {
     namespace ppm_image
     {
+        static const uint64_t PPM_HEADER_MAX = 4096;
+
+        static const size_t PPM_TEXT_WINDOW = 1 << 18;       // P3 input is parsed this many bytes at a time
+        static const size_t PPM_TEXT_LOOKAHEAD = 64;         // keeps the 8-byte SWAR load inside the window
+        static const size_t PPM_TEXT_BUFFER = 1 << 20;       // P3 output is flushed past this size
+        static const size_t PPM_TEXT_PIXEL_MAX = 12;         // "255 255 255 "
+
+        // locale-independent; the separators allowed by the netpbm spec
+        static bool IsSpace(uint8_t c_)
+        {
+            return c_ == ' ' || c_ == '\n' || c_ == '\r' || c_ == '\t' || c_ == '\v' || c_ == '\f';
+        }
+
+        static bool IsSampleEnd(uint8_t c_)
+        {
+            return IsSpace(c_) || c_ == '#';
+        }
+
+        static unsigned CountTrailingZeros(uint64_t value_)
+        {
+        #ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward64(&index, value_);
+            return static_cast<unsigned>(index);
+        #else
+            return static_cast<unsigned>(__builtin_ctzll(value_));
+        #endif
+        }
+
         const Image PpmImage::LoadImagePPM(const Path& path_)
         {
-            std::ifstream file(path_, std::ios::binary);
-            if (!file)
+            return DecodeImage(*this, path_);
+        }
+
+        bool PpmImage::SaveImagePPM(const Path& file_, const ImageView& image_)
+        {
+            EncodeImage(*this, file_, image_);
+            return true;
+        }
+
+        // Parses "<magic> <width> <height> <max>" allowing '#' comments between the fields and
+        // returns the offset just past the single whitespace that ends the header.
+        static uint64_t ParseHeader(InputSource& source_, std::string& type_, int& width_, int& height_, int& max_color_)
+        {
+            const size_t size = static_cast<size_t>(std::min<uint64_t>(source_.GetSize(), PPM_HEADER_MAX));
+            const uint8_t* data = source_.View(0, size);
+
+            size_t pos = 0;
+            std::string fields[4];
+
+            for (std::string& field : fields)
+            {
+                while (pos < size && (IsSpace(data[pos]) || data[pos] == '#'))
+                {
+                    if (data[pos] == '#')
+                    {
+                        while (pos < size && data[pos] != '\n')
+                        {
+                            ++pos;
+                        }
+                    }
+                    else
+                    {
+                        ++pos;
+                    }
+                }
+
+                while (pos < size && !IsSpace(data[pos]) && data[pos] != '#')
+                {
+                    field += static_cast<char>(data[pos++]);
+                }
+            }
+
+            if (pos >= size || !IsSpace(data[pos]))
+            {
+                throw std::runtime_error("Invalid PPM header"s);
+            }
+
+            try
             {
-                throw std::runtime_error("Failed to open PPM/P3 file: "s + path_.string());
-                return {};
+                type_ = fields[0];
+                width_ = std::stoi(fields[1]);
+                height_ = std::stoi(fields[2]);
+                max_color_ = std::stoi(fields[3]);
             }
+            catch (const std::logic_error&)
+            {
+                throw std::runtime_error("Invalid PPM header"s);
+            }
+
+            return pos + 1;
+        }
+
+        ImageInfo PpmImage::BeginDecode(const Path& path_)
+        {
+            decode_source.Open(path_);
 
             std::string ppm_type = ""s;
-            file >> ppm_type;
+            int max_color = 0;
+            decode_offset = ParseHeader(decode_source, ppm_type, decode_info.width, decode_info.height, max_color);
 
             if (ppm_type == PPM_TYPE_P3)
             {
-                return LoadP3(path_);
+                decode_p3 = true;
             }
             else if (ppm_type == PPM_TYPE_P6)
             {
-                return LoadP6(path_);
+                decode_p3 = false;
             }
             else
             {
                 throw std::runtime_error("Unsupported PPM format"s);
-                return {};
             }
 
-            file.close();
+            if (max_color != PPM_MAX)
+            {
+                throw std::runtime_error("Unsupported max color value "s);
+            }
+
+            decode_info.format = PixelFormat::RGB8;
+            decode_text = {};
+            decode_row = 0;
+            return decode_info;
+        }
+
+        PixelFormat PpmImage::GetReadFormat() const noexcept
+        {
+            return decode_info.format;
+        }
+
+        bool PpmImage::SetReadFormat(PixelFormat format_)
+        {
+            if (format_ != PixelFormat::RGB8 && format_ != PixelFormat::RGBA8)
+            {
+                return false;
+            }
+            decode_info.format = format_;
+            return true;
         }
 
-        bool PpmImage::SaveImagePPM(const Path& file_, const Image& image_) const 
+        int PpmImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
         {
-            std::string extension = file_.extension().string();
+            const int rows = std::min(count_, decode_info.height - decode_row);
+
+            for (int i = 0; i < rows; ++i)
+            {
+                uint8_t* line = rows_ + i * stride_;
+
+                const bool ok = decode_p3 ? LoadP3(line, decode_info.width) : LoadP6(line, decode_info.width);
+                if (!ok)
+                {
+                    decode_row += i;
+                    return i;
+                }
+            }
+
+            decode_row += rows;
+            return rows;
+        }
+
+        void PpmImage::EndDecode()
+        {
+            decode_source.Close();
+        }
+
+        void PpmImage::BeginEncode(const Path& path_, const ImageInfo& info_)
+        {
+            std::string extension = path_.extension().string();
             if (extension == ".p3"s)
             {
-                return SaveP3(file_, image_);
+                encode_p3 = true;
             }
             else if (extension == ".ppm"s)
             {
-                return SaveP6(file_, image_);
+                encode_p3 = false;
             }
             else
             {
                 throw std::runtime_error("Unsupported PPM format"s);
-                return false;
             }
+
+            encode_file.close();
+            encode_file.clear();
+            encode_file.open(path_, encode_p3 ? std::ios::out : std::ios::binary);
+            if (!encode_file)
+            {
+                throw std::runtime_error("Failed to create PPM file: "s + path_.string());
+            }
+
+            // RGBA8 sources are stripped row by row here rather than converted by the caller
+            encode_info = info_;
+            encode_info.format = info_.format == PixelFormat::RGBA8 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+            encode_buffer.clear();
+            encode_buffer.reserve(encode_p3 ? PPM_TEXT_BUFFER + static_cast<size_t>(encode_info.width) * PPM_TEXT_PIXEL_MAX : static_cast<size_t>(encode_info.width) * 3);
+
+            encode_file << (encode_p3 ? PPM_TYPE_P3 : PPM_TYPE_P6) << '\n' << encode_info.width << ' ' << encode_info.height << '\n' << PPM_MAX << '\n';
         }
 
-        const Image PpmImage::LoadP3(const Path& path_)
+        PixelFormat PpmImage::GetWriteFormat() const noexcept
         {
-            std::ifstream file(path_);
-            if (!file)
+            return encode_info.format;
+        }
+
+        void PpmImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            for (int i = 0; i < count_; ++i)
             {
-                throw std::runtime_error("Failed to open P3 file: "s + path_.string());
-                return {};
+                const uint8_t* line = rows_ + i * stride_;
+
+                const bool ok = encode_p3 ? SaveP3(line, encode_info.width) : SaveP6(line, encode_info.width);
+                if (!ok)
+                {
+                    throw std::runtime_error("Failed to write PPM file"s);
+                }
             }
+        }
 
-            std::string sign = ""s;
-            int width = 0;
-            int height = 0;
-            int max_color = 0;
-            file >> sign >> width >> height >> max_color;
+        void PpmImage::EndEncode()
+        {
+            if (encode_p3)
+            {
+                FlushP3();
+            }
 
-            if (max_color != PPM_MAX)
+            encode_file.close();
+            if (!encode_file)
             {
-                throw std::runtime_error("Unsupported max color value "s);
-                return {};
+                throw std::runtime_error("Failed to write PPM file"s);
+            }
+        }
+
+        void PpmImage::AbortEncode() noexcept
+        {
+            encode_file.close();
+        }
+
+        // Keeps at least PPM_TEXT_LOOKAHEAD unread bytes in the window unless the file ends first.
+        void PpmImage::RefillP3()
+        {
+            TextWindow& text = decode_text;
+            if (text.size - text.pos >= PPM_TEXT_LOOKAHEAD)
+            {
+                return;
             }
 
-            Image image(width, height, Color::Black());
+            decode_offset += text.pos;
 
-            for (int y = 0; y < height; ++y)
+            const uint64_t remaining = decode_source.GetSize() - decode_offset;
+            text.size = static_cast<size_t>(std::min<uint64_t>(remaining, PPM_TEXT_WINDOW));
+            text.pos = 0;
+            text.data = decode_source.View(decode_offset, text.size);
+            if (!text.data)
             {
-                Color* line = image.GetLine(y);
-                for (int x = 0; x < width; ++x)
+                text.size = 0;
+            }
+        }
+
+        bool PpmImage::SkipP3Separators()
+        {
+            TextWindow& text = decode_text;
+            bool comment = false;
+
+            for (;;)
+            {
+                if (text.pos == text.size)
                 {
-                    uint8_t r = 0;
-                    uint8_t g = 0;
-                    uint8_t b = 0;
+                    RefillP3();
+                    if (text.size == 0)
+                    {
+                        return false;
+                    }
+                }
 
-                    file >> r >> g >> b;
-                    line[x] = { r, g, b, 255 };
+                const uint8_t c = text.data[text.pos];
+                if (comment)
+                {
+                    comment = c != '\n';
+                }
+                else if (c == '#')
+                {
+                    comment = true;
                 }
+                else if (!IsSpace(c))
+                {
+                    RefillP3();
+                    return true;
+                }
+                ++text.pos;
             }
-
-            file.close();
-            return image;
         }
 
-        bool PpmImage::SaveP3(const Path& path_, const Image& image_) const
+        bool PpmImage::ParseP3Sample(uint8_t& value_)
         {
-            std::ofstream file(path_);
-            if (!file)
+            if (!SkipP3Separators())
             {
-                throw std::runtime_error("Failed to create P3 file: "s + path_.string());
                 return false;
             }
 
-            file << PPM_TYPE_P3 << '\n' << image_.GetWidth() << ' ' << image_.GetHeight() << '\n' << PPM_MAX << '\n';
+            TextWindow& text = decode_text;
+            const uint8_t* p = text.data + text.pos;
 
-            const int w = image_.GetWidth();
-            const int h = image_.GetHeight();
-
-            for (int y = 0; y < h; ++y)
+            if (text.size - text.pos >= sizeof(uint64_t))
             {
-                const Color* line = image_.GetLine(y);
+                // SWAR: bytes that are not '0'..'9' get their top bit set in the mask, and the
+                // lowest one ends the number
+                uint64_t chunk;
+                std::memcpy(&chunk, p, sizeof(chunk));
 
-                for (int x = 0; x < w; ++x)
-                {
-                    const Color& color = line[x];
+                const uint64_t t = chunk ^ 0x3030303030303030ULL;
+                const uint64_t mask = ((t + 0x7676767676767676ULL) | t) & 0x8080808080808080ULL;
+                const size_t digits = mask ? CountTrailingZeros(mask) / 8 : sizeof(uint64_t);
 
-                    file << color.r << ' ' << color.g << ' ' << color.b << ' ';
+                if (digits >= 1 && digits <= 3)
+                {
+                    const uint32_t d0 = static_cast<uint32_t>(t & 0xFF);
+                    const uint32_t d1 = static_cast<uint32_t>((t >> 8) & 0xFF);
+                    const uint32_t d2 = static_cast<uint32_t>((t >> 16) & 0xFF);
+
+                    const uint32_t value = digits == 1 ? d0 : digits == 2 ? d0 * 10 + d1 : d0 * 100 + d1 * 10 + d2;
+                    if (value > PPM_MAX || !IsSampleEnd(p[digits]))
+                    {
+                        throw std::runtime_error("Invalid PPM/P3 sample"s);
+                    }
+
+                    text.pos += digits;
+                    value_ = static_cast<uint8_t>(value);
+                    return true;
                 }
-                file << '\n';
             }
 
-            file.close();
-            return file.good();
+            return ParseP3SampleSlow(value_);
         }
 
-        const Image PpmImage::LoadP6(const Path& path_)
+        // The tail of the file and samples with leading zeros, which may span windows.
+        bool PpmImage::ParseP3SampleSlow(uint8_t& value_)
         {
-            std::ifstream file(path_, std::ios::binary);
-            if (!file)
-            {
-                throw std::runtime_error("Failed to open PPM file: "s + path_.string());
-                return {};
-            }
+            TextWindow& text = decode_text;
 
-            std::string sign = ""s;
-            int w = 0;
-            int h = 0;
-            int color_max = 0;
+            uint32_t value = 0;
+            bool any = false;
 
-            file >> sign;
-            if (sign != PPM_TYPE_P6)
-            {
-                return {};
-            }
-            
-            file >> w >> h;
-            
-            file >> color_max;
-            if (color_max != PPM_MAX)
+            for (RefillP3(); text.pos < text.size; RefillP3())
             {
-                return {};
+                const uint8_t c = text.data[text.pos];
+                if (c < '0' || c > '9')
+                {
+                    break;
+                }
+
+                value = value * 10 + (c - '0');
+                if (value > PPM_MAX)
+                {
+                    throw std::runtime_error("Invalid PPM/P3 sample"s);
+                }
+
+                any = true;
+                ++text.pos;
             }
 
-            const char next = file.get();
-            if (next != '\n')
+            if (!any || (text.pos < text.size && !IsSampleEnd(text.data[text.pos])))
             {
-                return {};
+                throw std::runtime_error("Invalid PPM/P3 sample"s);
             }
 
-            Image image(w, h, Color::Black());
-            std::vector<char> buff(w * 3);
+            value_ = static_cast<uint8_t>(value);
+            return true;
+        }
 
-            for (int y = 0; y < h; ++y)
-            {
-                Color* line = image.GetLine(y);
+        bool PpmImage::LoadP3(uint8_t* line_, int width_)
+        {
+            const int channels = GetChannelCount(decode_info.format);
 
-                file.read(buff.data(), w * 3);
-                if (!file)
+            for (int x = 0; x < width_; ++x)
+            {
+                uint8_t* pixel = line_ + x * channels;
+                if (!ParseP3Sample(pixel[0]) || !ParseP3Sample(pixel[1]) || !ParseP3Sample(pixel[2]))
                 {
-                    return {};
+                    return false;
                 }
-
-                for (int x = 0; x < w; ++x)
+                if (channels == 4)
                 {
-                    line[x].r = buff[x * 3 + 0];
-                    line[x].g = buff[x * 3 + 1];
-                    line[x].b = buff[x * 3 + 2];
+                    pixel[3] = 255;
                 }
             }
-
-            file.close();
-            return image;
+            return true;
         }
 
-        bool PpmImage::SaveP6(const Path& path_, const Image& image_) const
+        bool PpmImage::SaveP3(const uint8_t* line_, int width_)
         {
-            std::ofstream file(path_, std::ios::binary);
-            if (!file)
+            const size_t start = encode_buffer.size();
+            encode_buffer.resize(start + static_cast<size_t>(width_) * PPM_TEXT_PIXEL_MAX + 1);
+
+            char* out = encode_buffer.data() + start;
+            char* const end = encode_buffer.data() + encode_buffer.size();
+
+            const int channels = GetChannelCount(encode_info.format);
+
+            for (int x = 0; x < width_; ++x)
             {
-                throw std::runtime_error("Failed to create PPM file: "s + path_.string());
-                return false;
+                const uint8_t* pixel = line_ + x * channels;
+
+                out = std::to_chars(out, end, pixel[0]).ptr;
+                *out++ = ' ';
+                out = std::to_chars(out, end, pixel[1]).ptr;
+                *out++ = ' ';
+                out = std::to_chars(out, end, pixel[2]).ptr;
+                *out++ = ' ';
             }
+            *out++ = '\n';
+
+            encode_buffer.resize(static_cast<size_t>(out - encode_buffer.data()));
 
-            file << PPM_TYPE_P6 << '\n' << image_.GetWidth() << ' ' << image_.GetHeight() << '\n' << PPM_MAX << '\n';
+            if (encode_buffer.size() >= PPM_TEXT_BUFFER)
+            {
+                return FlushP3();
+            }
+            return true;
+        }
 
-            const int w = image_.GetWidth();
-            const int h = image_.GetHeight();
-            std::vector<char> buff(w * 3);
+        bool PpmImage::FlushP3()
+        {
+            encode_file.write(encode_buffer.data(), static_cast<std::streamsize>(encode_buffer.size()));
+            encode_buffer.clear();
+            return encode_file.good();
+        }
 
-            for (int y = 0; y < h; ++y)
+        bool PpmImage::LoadP6(uint8_t* line_, int width_)
+        {
+            const size_t row_size = static_cast<size_t>(width_) * 3;
+
+            const uint8_t* row = decode_source.View(decode_offset, row_size);
+            if (!row)
             {
-                const Color* line = image_.GetLine(y);
+                return false;
+            }
 
-                for (int x = 0; x < w; ++x)
-                {
-                    buff[x * 3 + 0] = line[x].r;
-                    buff[x * 3 + 1] = line[x].g;
-                    buff[x * 3 + 2] = line[x].b;
-                }
-                file.write(buff.data(), w * 3);
-                if (!file)
-                {
-                    return false;
-                }
+            if (decode_info.format == PixelFormat::RGB8)
+            {
+                std::memcpy(line_, row, row_size);
             }
-            file.close();
-            return file.good();
+            else
+            {
+                pixel_ops::RgbToRgba(row, line_, width_);
+            }
+            decode_offset += row_size;
+            return true;
+        }
+
+        bool PpmImage::SaveP6(const uint8_t* line_, int width_)
+        {
+            const char* row = reinterpret_cast<const char*>(line_);
+            if (encode_info.format == PixelFormat::RGBA8)
+            {
+                encode_buffer.resize(static_cast<size_t>(width_) * 3);
+                pixel_ops::RgbaToRgb(line_, reinterpret_cast<uint8_t*>(encode_buffer.data()), width_);
+                row = encode_buffer.data();
+            }
+
+            encode_file.write(row, static_cast<std::streamsize>(width_) * 3);
+            return encode_file.good();
         }
 
     } // end namespace ppm_image
 
-} // end namespace img_lib
\ No newline at end of file
+} // end namespace img_lib
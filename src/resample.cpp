@@ -0,0 +1,914 @@
+#include "resample.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#ifdef IMG_LIB_X86
+#include <immintrin.h>
+#endif
+
+namespace img_lib
+{
+    namespace resample
+    {
+        static const int BILINEAR_ONE = 256;      // weights are 8-bit fixed point
+        static const int BILINEAR_SHIFT = 15;     // horizontal sums keep 7 fraction bits, vertical adds 8
+
+        static const int FILTER_BITS = 14;        // contribution weights are Q14, summing to 1 << 14
+        static const size_t CONTRIBUTION_CACHE_SIZE = 32;
+
+        // destination rows are split into bands of at least this many rows, one per thread;
+        // each band filters its own source rows, so the bands only overlap in reads
+        static const int MIN_BAND_ROWS = 16;
+
+        static const int MAX_BOX_FACTOR = 256;    // box column sums of 8-bit samples fit 16 bits
+
+        // Output sample i reads source samples first and second, the latter weighted by weight/256.
+        struct Tap
+        {
+            int first = 0;
+            int second = 0;
+            int weight = 0;
+        };
+
+        static std::vector<Tap> MakeTaps(int src_size_, int dst_size_)
+        {
+            std::vector<Tap> taps(dst_size_);
+
+            for (int i = 0; i < dst_size_; ++i)
+            {
+                // same source position as the float formula, so both pick the same pixels
+                const float src = i * static_cast<float>(src_size_) / static_cast<float>(dst_size_);
+
+                Tap& tap = taps[i];
+                tap.first = static_cast<int>(src);
+                tap.second = std::min(tap.first + 1, src_size_ - 1);
+                tap.weight = static_cast<int>(std::lround((src - tap.first) * BILINEAR_ONE));
+
+                // at the last pixel both taps coincide; shifting the pair left with all the weight
+                // on the second tap gives the same value and keeps the taps adjacent
+                if (tap.first == tap.second && tap.first > 0)
+                {
+                    --tap.first;
+                    tap.weight = BILINEAR_ONE;
+                }
+            }
+            return taps;
+        }
+
+        static void HorizontalScalar(const uint8_t* src_, int channels_, const Tap* taps_, int count_, int16_t* dst_)
+        {
+            for (int x = 0; x < count_; ++x)
+            {
+                const uint8_t* p1 = src_ + taps_[x].first * channels_;
+                const uint8_t* p2 = src_ + taps_[x].second * channels_;
+                const int w = taps_[x].weight;
+
+                for (int c = 0; c < channels_; ++c)
+                {
+                    *dst_++ = static_cast<int16_t>((p1[c] * (BILINEAR_ONE - w) + p2[c] * w) >> 1);
+                }
+            }
+        }
+
+        static void VerticalScalar(const int16_t* top_, const int16_t* bottom_, int weight_, uint8_t* dst_, int count_)
+        {
+            for (int i = 0; i < count_; ++i)
+            {
+                dst_[i] = static_cast<uint8_t>((top_[i] * (BILINEAR_ONE - weight_) + bottom_[i] * weight_) >> BILINEAR_SHIFT);
+            }
+        }
+
+    #ifdef IMG_LIB_X86
+
+        // RGBA8 only, two output pixels per step; needs adjacent taps (source width of 2 or more)
+        IMG_LIB_TARGET("sse2")
+        static void HorizontalRgbaSse2(const uint8_t* src_, const Tap* taps_, int count_, int16_t* dst_)
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            int x = 0;
+            for (; x + 2 <= count_; x += 2)
+            {
+                const Tap& a = taps_[x];
+                const Tap& b = taps_[x + 1];
+
+                // both taps of a pixel in one 8-byte load, then byte pairs (p1, p2) per channel
+                const __m128i pa = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src_ + a.first * 4));
+                const __m128i pb = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src_ + b.first * 4));
+                const __m128i taps = _mm_shuffle_epi32(_mm_unpacklo_epi64(pa, pb), _MM_SHUFFLE(3, 1, 2, 0));
+                const __m128i pairs = _mm_unpacklo_epi8(taps, _mm_srli_si128(taps, 8));
+
+                const __m128i wa = _mm_set1_epi32((a.weight << 16) | (BILINEAR_ONE - a.weight));
+                const __m128i wb = _mm_set1_epi32((b.weight << 16) | (BILINEAR_ONE - b.weight));
+
+                const __m128i sa = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(pairs, zero), wa), 1);
+                const __m128i sb = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi8(pairs, zero), wb), 1);
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_ + x * 4), _mm_packs_epi32(sa, sb));
+            }
+
+            HorizontalScalar(src_, 4, taps_ + x, count_ - x, dst_ + x * 4);
+        }
+
+        IMG_LIB_TARGET("sse2")
+        static void VerticalSse2(const int16_t* top_, const int16_t* bottom_, int weight_, uint8_t* dst_, int count_)
+        {
+            const __m128i weights = _mm_set1_epi32((weight_ << 16) | (BILINEAR_ONE - weight_));
+
+            int i = 0;
+            for (; i + 8 <= count_; i += 8)
+            {
+                const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top_ + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom_ + i));
+
+                const __m128i lo = _mm_srli_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(t, b), weights), BILINEAR_SHIFT);
+                const __m128i hi = _mm_srli_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(t, b), weights), BILINEAR_SHIFT);
+
+                const __m128i packed = _mm_packs_epi32(lo, hi);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst_ + i), _mm_packus_epi16(packed, packed));
+            }
+
+            VerticalScalar(top_ + i, bottom_ + i, weight_, dst_ + i, count_ - i);
+        }
+
+        // unpack and pack both work within 128-bit lanes, so the lanes come back in order and
+        // only the final byte pack needs a cross-lane permute
+        IMG_LIB_TARGET("avx2")
+        static void VerticalAvx2(const int16_t* top_, const int16_t* bottom_, int weight_, uint8_t* dst_, int count_)
+        {
+            const __m256i weights = _mm256_set1_epi32((weight_ << 16) | (BILINEAR_ONE - weight_));
+
+            int i = 0;
+            for (; i + 16 <= count_; i += 16)
+            {
+                const __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(top_ + i));
+                const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom_ + i));
+
+                const __m256i lo = _mm256_srli_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(t, b), weights), BILINEAR_SHIFT);
+                const __m256i hi = _mm256_srli_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(t, b), weights), BILINEAR_SHIFT);
+
+                const __m256i packed = _mm256_packs_epi32(lo, hi);
+                const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed, packed), _MM_SHUFFLE(3, 1, 2, 0));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_ + i), _mm256_castsi256_si128(bytes));
+            }
+
+            VerticalSse2(top_ + i, bottom_ + i, weight_, dst_ + i, count_ - i);
+        }
+
+    #endif // IMG_LIB_X86
+
+        static void Horizontal(const uint8_t* src_, int src_width_, int channels_, const Tap* taps_, int count_, int16_t* dst_)
+        {
+        #ifdef IMG_LIB_X86
+            if (channels_ == 4 && src_width_ >= 2 && GetSimdLevel() >= SimdLevel::SSE2)
+            {
+                return HorizontalRgbaSse2(src_, taps_, count_, dst_);
+            }
+        #endif
+            HorizontalScalar(src_, channels_, taps_, count_, dst_);
+        }
+
+        static void Vertical(const int16_t* top_, const int16_t* bottom_, int weight_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return VerticalAvx2(top_, bottom_, weight_, dst_, count_);
+
+            case SimdLevel::SSSE3:
+            case SimdLevel::SSE2:
+                return VerticalSse2(top_, bottom_, weight_, dst_, count_);
+
+            default:
+                break;
+            }
+        #endif
+            VerticalScalar(top_, bottom_, weight_, dst_, count_);
+        }
+
+        struct FilterKernel
+        {
+            double support = 0.0;         // half-width at scale 1
+            double (*weight)(double) = nullptr;
+        };
+
+        static double BoxWeight(double x_)
+        {
+            return x_ > -0.5 && x_ <= 0.5 ? 1.0 : 0.0;
+        }
+
+        static double TriangleWeight(double x_)
+        {
+            x_ = std::fabs(x_);
+            return x_ < 1.0 ? 1.0 - x_ : 0.0;
+        }
+
+        // Mitchell-Netravali family of cubics with parameters b_ and c_
+        static double CubicWeight(double x_, double b_, double c_)
+        {
+            x_ = std::fabs(x_);
+            if (x_ < 1.0)
+            {
+                return ((12.0 - 9.0 * b_ - 6.0 * c_) * x_ * x_ * x_ + (-18.0 + 12.0 * b_ + 6.0 * c_) * x_ * x_ + (6.0 - 2.0 * b_)) / 6.0;
+            }
+            if (x_ < 2.0)
+            {
+                return ((-b_ - 6.0 * c_) * x_ * x_ * x_ + (6.0 * b_ + 30.0 * c_) * x_ * x_ + (-12.0 * b_ - 48.0 * c_) * x_ + (8.0 * b_ + 24.0 * c_)) / 6.0;
+            }
+            return 0.0;
+        }
+
+        static double CatmullRomWeight(double x_)
+        {
+            return CubicWeight(x_, 0.0, 0.5);
+        }
+
+        static double MitchellWeight(double x_)
+        {
+            return CubicWeight(x_, 1.0 / 3.0, 1.0 / 3.0);
+        }
+
+        static double Sinc(double x_)
+        {
+            if (x_ == 0.0)
+            {
+                return 1.0;
+            }
+            x_ *= 3.14159265358979323846;
+            return std::sin(x_) / x_;
+        }
+
+        static double Lanczos3Weight(double x_)
+        {
+            return std::fabs(x_) < 3.0 ? Sinc(x_) * Sinc(x_ / 3.0) : 0.0;
+        }
+
+        static FilterKernel GetKernel(Filter filter_)
+        {
+            switch (filter_)
+            {
+            case Filter::BOX:
+                return { 0.5, BoxWeight };
+
+            case Filter::TRIANGLE:
+                return { 1.0, TriangleWeight };
+
+            case Filter::CATMULL_ROM:
+                return { 2.0, CatmullRomWeight };
+
+            case Filter::MITCHELL:
+                return { 2.0, MitchellWeight };
+
+            default:
+                return { 3.0, Lanczos3Weight };
+            }
+        }
+
+        // Output sample i is the sum of source samples first[i] .. first[i] + count[i] - 1 times
+        // weights[i * taps ...]. first[] never decreases, which lets rows stream through a ring.
+        struct Contributions
+        {
+            int taps = 0;
+            std::vector<int> first;
+            std::vector<int> count;
+            std::vector<int16_t> weights;
+        };
+
+        static Contributions MakeContributions(int src_size_, int dst_size_, Filter filter_)
+        {
+            const FilterKernel kernel = GetKernel(filter_);
+
+            // downscales widen the filter so it covers every source sample
+            const double scale = static_cast<double>(src_size_) / dst_size_;
+            const double filter_scale = std::max(scale, 1.0);
+            const double support = kernel.support * filter_scale;
+
+            Contributions table;
+            table.taps = static_cast<int>(std::ceil(support)) * 2 + 1;
+            table.first.resize(dst_size_);
+            table.count.resize(dst_size_);
+            table.weights.assign(static_cast<size_t>(dst_size_) * table.taps, 0);
+
+            std::vector<double> weights(table.taps);
+
+            for (int i = 0; i < dst_size_; ++i)
+            {
+                const double center = (i + 0.5) * scale;
+                const int begin = std::max(0, static_cast<int>(center - support + 0.5));
+                const int end = std::min(src_size_, static_cast<int>(center + support + 0.5));
+                const int count = std::max(1, std::min(end - begin, table.taps));
+
+                double total = 0.0;
+                for (int k = 0; k < count; ++k)
+                {
+                    weights[k] = kernel.weight((begin + k - center + 0.5) / filter_scale);
+                    total += weights[k];
+                }
+
+                int16_t* quantized = &table.weights[static_cast<size_t>(i) * table.taps];
+                if (total == 0.0)
+                {
+                    quantized[0] = 1 << FILTER_BITS;
+                }
+                else
+                {
+                    // round, then give the rounding error to the largest tap so flat areas stay flat
+                    int sum = 0;
+                    int largest = 0;
+                    for (int k = 0; k < count; ++k)
+                    {
+                        quantized[k] = static_cast<int16_t>(std::lround(weights[k] / total * (1 << FILTER_BITS)));
+                        sum += quantized[k];
+                        largest = std::abs(weights[k]) > std::abs(weights[largest]) ? k : largest;
+                    }
+                    quantized[largest] = static_cast<int16_t>(quantized[largest] + (1 << FILTER_BITS) - sum);
+                }
+
+                table.first[i] = begin;
+                table.count[i] = count;
+            }
+            return table;
+        }
+
+        static std::shared_ptr<const Contributions> GetContributions(int src_size_, int dst_size_, Filter filter_)
+        {
+            struct CacheEntry
+            {
+                int src_size;
+                int dst_size;
+                Filter filter;
+                std::shared_ptr<const Contributions> table;
+            };
+
+            // most recently used first; shared by every thread
+            static std::mutex mutex;
+            static std::list<CacheEntry> cache;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto it = cache.begin(); it != cache.end(); ++it)
+                {
+                    if (it->src_size == src_size_ && it->dst_size == dst_size_ && it->filter == filter_)
+                    {
+                        cache.splice(cache.begin(), cache, it);
+                        return it->table;
+                    }
+                }
+            }
+
+            auto table = std::make_shared<const Contributions>(MakeContributions(src_size_, dst_size_, filter_));
+
+            std::lock_guard<std::mutex> lock(mutex);
+            cache.push_front({ src_size_, dst_size_, filter_, table });
+            if (cache.size() > CONTRIBUTION_CACHE_SIZE)
+            {
+                cache.pop_back();
+            }
+            return table;
+        }
+
+        static uint8_t ClampSample(int value_)
+        {
+            return static_cast<uint8_t>(std::min(std::max(value_, 0), 255));
+        }
+
+        static void FilterRowScalar(const uint8_t* src_, int channels_, const Contributions& table_, int count_, uint8_t* dst_)
+        {
+            for (int x = 0; x < count_; ++x)
+            {
+                const uint8_t* p = src_ + table_.first[x] * channels_;
+                const int16_t* w = &table_.weights[static_cast<size_t>(x) * table_.taps];
+                const int taps = table_.count[x];
+
+                for (int c = 0; c < channels_; ++c)
+                {
+                    int sum = 1 << (FILTER_BITS - 1);
+                    for (int k = 0; k < taps; ++k)
+                    {
+                        sum += p[k * channels_ + c] * w[k];
+                    }
+                    *dst_++ = ClampSample(sum >> FILTER_BITS);
+                }
+            }
+        }
+
+        // samples begin_ .. end_ - 1 of the row
+        static void FilterColumnsScalar(const uint8_t* const* rows_, const int16_t* weights_, int taps_, uint8_t* dst_, int begin_, int end_)
+        {
+            for (int i = begin_; i < end_; ++i)
+            {
+                int sum = 1 << (FILTER_BITS - 1);
+                for (int k = 0; k < taps_; ++k)
+                {
+                    sum += rows_[k][i] * weights_[k];
+                }
+                dst_[i] = ClampSample(sum >> FILTER_BITS);
+            }
+        }
+
+    #ifdef IMG_LIB_X86
+
+        // two Q14 weights as the (low, high) int16 pair pmaddwd multiplies with
+        static int PackWeights(int16_t low_, int16_t high_)
+        {
+            return static_cast<int>((static_cast<uint32_t>(static_cast<uint16_t>(high_)) << 16) | static_cast<uint16_t>(low_));
+        }
+
+        // RGBA8 only: all four channels of one output pixel in one register, two taps per pmaddwd
+        IMG_LIB_TARGET("sse2")
+        static void FilterRowRgbaSse2(const uint8_t* src_, const Contributions& table_, int count_, uint8_t* dst_)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi32(1 << (FILTER_BITS - 1));
+
+            for (int x = 0; x < count_; ++x)
+            {
+                const uint8_t* p = src_ + table_.first[x] * 4;
+                const int16_t* w = &table_.weights[static_cast<size_t>(x) * table_.taps];
+                const int taps = table_.count[x];
+
+                __m128i sum = round;
+                int k = 0;
+                for (; k + 2 <= taps; k += 2)
+                {
+                    const __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + k * 4));
+                    const __m128i pairs = _mm_unpacklo_epi8(_mm_unpacklo_epi8(v, _mm_srli_si128(v, 4)), zero);
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(pairs, _mm_set1_epi32(PackWeights(w[k], w[k + 1]))));
+                }
+                if (k < taps)
+                {
+                    int pixel;
+                    std::memcpy(&pixel, p + k * 4, sizeof(pixel));
+                    const __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+                    sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_set1_epi32(PackWeights(w[k], 0))));
+                }
+
+                const __m128i packed = _mm_packs_epi32(_mm_srai_epi32(sum, FILTER_BITS), zero);
+                const int out = _mm_cvtsi128_si32(_mm_packus_epi16(packed, zero));
+                std::memcpy(dst_ + x * 4, &out, sizeof(out));
+            }
+        }
+
+        // 16 samples per step, two source rows per pmaddwd
+        IMG_LIB_TARGET("sse2")
+        static void FilterColumnsSse2(const uint8_t* const* rows_, const int16_t* weights_, int taps_, uint8_t* dst_, int begin_, int end_)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi32(1 << (FILTER_BITS - 1));
+
+            int i = begin_;
+            for (; i + 16 <= end_; i += 16)
+            {
+                __m128i sum0 = round;
+                __m128i sum1 = round;
+                __m128i sum2 = round;
+                __m128i sum3 = round;
+
+                for (int k = 0; k < taps_; k += 2)
+                {
+                    const bool pair = k + 1 < taps_;
+                    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows_[k] + i));
+                    const __m128i b = pair ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows_[k + 1] + i)) : zero;
+                    const __m128i w = _mm_set1_epi32(PackWeights(weights_[k], pair ? weights_[k + 1] : 0));
+
+                    const __m128i lo = _mm_unpacklo_epi8(a, b);
+                    const __m128i hi = _mm_unpackhi_epi8(a, b);
+                    sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+                    sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+                    sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+                    sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+                }
+
+                const __m128i low = _mm_packs_epi32(_mm_srai_epi32(sum0, FILTER_BITS), _mm_srai_epi32(sum1, FILTER_BITS));
+                const __m128i high = _mm_packs_epi32(_mm_srai_epi32(sum2, FILTER_BITS), _mm_srai_epi32(sum3, FILTER_BITS));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_ + i), _mm_packus_epi16(low, high));
+            }
+
+            FilterColumnsScalar(rows_, weights_, taps_, dst_, i, end_);
+        }
+
+        // same as the SSE2 version on 32 samples; every unpack and pack stays within its lane,
+        // so the bytes come back in order
+        IMG_LIB_TARGET("avx2")
+        static void FilterColumnsAvx2(const uint8_t* const* rows_, const int16_t* weights_, int taps_, uint8_t* dst_, int begin_, int end_)
+        {
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i round = _mm256_set1_epi32(1 << (FILTER_BITS - 1));
+
+            int i = begin_;
+            for (; i + 32 <= end_; i += 32)
+            {
+                __m256i sum0 = round;
+                __m256i sum1 = round;
+                __m256i sum2 = round;
+                __m256i sum3 = round;
+
+                for (int k = 0; k < taps_; k += 2)
+                {
+                    const bool pair = k + 1 < taps_;
+                    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows_[k] + i));
+                    const __m256i b = pair ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows_[k + 1] + i)) : zero;
+                    const __m256i w = _mm256_set1_epi32(PackWeights(weights_[k], pair ? weights_[k + 1] : 0));
+
+                    const __m256i lo = _mm256_unpacklo_epi8(a, b);
+                    const __m256i hi = _mm256_unpackhi_epi8(a, b);
+                    sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+                    sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+                    sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+                    sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+                }
+
+                const __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(sum0, FILTER_BITS), _mm256_srai_epi32(sum1, FILTER_BITS));
+                const __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(sum2, FILTER_BITS), _mm256_srai_epi32(sum3, FILTER_BITS));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_ + i), _mm256_packus_epi16(low, high));
+            }
+
+            FilterColumnsSse2(rows_, weights_, taps_, dst_, i, end_);
+        }
+
+    #endif // IMG_LIB_X86
+
+        static void FilterRow(const uint8_t* src_, int channels_, const Contributions& table_, int count_, uint8_t* dst_)
+        {
+        #ifdef IMG_LIB_X86
+            if (channels_ == 4 && GetSimdLevel() >= SimdLevel::SSE2)
+            {
+                return FilterRowRgbaSse2(src_, table_, count_, dst_);
+            }
+        #endif
+            FilterRowScalar(src_, channels_, table_, count_, dst_);
+        }
+
+        static void FilterColumns(const uint8_t* const* rows_, const int16_t* weights_, int taps_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return FilterColumnsAvx2(rows_, weights_, taps_, dst_, 0, count_);
+
+            case SimdLevel::SSSE3:
+            case SimdLevel::SSE2:
+                return FilterColumnsSse2(rows_, weights_, taps_, dst_, 0, count_);
+
+            default:
+                break;
+            }
+        #endif
+            FilterColumnsScalar(rows_, weights_, taps_, dst_, 0, count_);
+        }
+
+        static void HalveRowScalar(const uint8_t* top_, const uint8_t* bottom_, int channels_, uint8_t* dst_, int begin_, int end_)
+        {
+            for (int i = begin_ * channels_; i < end_ * channels_; ++i)
+            {
+                const int x = i / channels_ * 2 * channels_ + i % channels_;
+                dst_[i] = static_cast<uint8_t>((top_[x] + top_[x + channels_] + bottom_[x] + bottom_[x + channels_] + 2) >> 2);
+            }
+        }
+
+    #ifdef IMG_LIB_X86
+
+        // One 16-byte load per row holds as many whole pixel pairs as fit; pshufb zero-extends
+        // the even and the odd pixels of the pairs to 16 bits, so four adds give the 2x2 sums.
+        // Loads stay inside the source row and the 8-byte stores inside the destination row.
+        IMG_LIB_TARGET("ssse3")
+        static void HalveRowSsse3(const uint8_t* top_, const uint8_t* bottom_, int channels_, int src_width_, uint8_t* dst_, int count_)
+        {
+            const int pairs = 16 / (2 * channels_);
+
+            alignas(16) int8_t even_bytes[16];
+            alignas(16) int8_t odd_bytes[16];
+            std::fill(even_bytes, even_bytes + 16, static_cast<int8_t>(-1));
+            std::fill(odd_bytes, odd_bytes + 16, static_cast<int8_t>(-1));
+            for (int k = 0; k < pairs * channels_; ++k)
+            {
+                even_bytes[k * 2] = static_cast<int8_t>(k / channels_ * 2 * channels_ + k % channels_);
+                odd_bytes[k * 2] = static_cast<int8_t>(even_bytes[k * 2] + channels_);
+            }
+
+            const __m128i even = _mm_load_si128(reinterpret_cast<const __m128i*>(even_bytes));
+            const __m128i odd = _mm_load_si128(reinterpret_cast<const __m128i*>(odd_bytes));
+            const __m128i round = _mm_set1_epi16(2);
+
+            int x = 0;
+            for (; (x * 2 * channels_ + 16 <= src_width_ * channels_) && (x * channels_ + 8 <= count_ * channels_); x += pairs)
+            {
+                const __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top_ + x * 2 * channels_));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom_ + x * 2 * channels_));
+
+                const __m128i sum = _mm_add_epi16(
+                    _mm_add_epi16(_mm_shuffle_epi8(t, even), _mm_shuffle_epi8(t, odd)),
+                    _mm_add_epi16(_mm_shuffle_epi8(b, even), _mm_shuffle_epi8(b, odd)));
+                const __m128i average = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst_ + x * channels_), _mm_packus_epi16(average, average));
+            }
+
+            HalveRowScalar(top_, bottom_, channels_, dst_, x, count_);
+        }
+
+    #endif // IMG_LIB_X86
+
+        static void HalveRow(const uint8_t* top_, const uint8_t* bottom_, int channels_, int src_width_, uint8_t* dst_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            if (GetSimdLevel() >= SimdLevel::SSSE3)
+            {
+                return HalveRowSsse3(top_, bottom_, channels_, src_width_, dst_, count_);
+            }
+        #endif
+            HalveRowScalar(top_, bottom_, channels_, dst_, 0, count_);
+        }
+
+        static void AccumulateRowScalar(const uint8_t* src_, uint16_t* sums_, int begin_, int end_)
+        {
+            for (int i = begin_; i < end_; ++i)
+            {
+                sums_[i] = static_cast<uint16_t>(sums_[i] + src_[i]);
+            }
+        }
+
+    #ifdef IMG_LIB_X86
+
+        IMG_LIB_TARGET("sse2")
+        static void AccumulateRowSse2(const uint8_t* src_, uint16_t* sums_, int count_)
+        {
+            const __m128i zero = _mm_setzero_si128();
+
+            int i = 0;
+            for (; i + 16 <= count_; i += 16)
+            {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ + i));
+                __m128i* sums = reinterpret_cast<__m128i*>(sums_ + i);
+                _mm_storeu_si128(sums, _mm_add_epi16(_mm_loadu_si128(sums), _mm_unpacklo_epi8(v, zero)));
+                _mm_storeu_si128(sums + 1, _mm_add_epi16(_mm_loadu_si128(sums + 1), _mm_unpackhi_epi8(v, zero)));
+            }
+
+            AccumulateRowScalar(src_, sums_, i, count_);
+        }
+
+        IMG_LIB_TARGET("avx2")
+        static void AccumulateRowAvx2(const uint8_t* src_, uint16_t* sums_, int count_)
+        {
+            int i = 0;
+            for (; i + 16 <= count_; i += 16)
+            {
+                const __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src_ + i)));
+                __m256i* sums = reinterpret_cast<__m256i*>(sums_ + i);
+                _mm256_storeu_si256(sums, _mm256_add_epi16(_mm256_loadu_si256(sums), v));
+            }
+
+            AccumulateRowScalar(src_, sums_, i, count_);
+        }
+
+    #endif // IMG_LIB_X86
+
+        static void AccumulateRow(const uint8_t* src_, uint16_t* sums_, int count_)
+        {
+        #ifdef IMG_LIB_X86
+            switch (GetSimdLevel())
+            {
+            case SimdLevel::AVX2:
+                return AccumulateRowAvx2(src_, sums_, count_);
+
+            case SimdLevel::SSSE3:
+            case SimdLevel::SSE2:
+                return AccumulateRowSse2(src_, sums_, count_);
+
+            default:
+                break;
+            }
+        #endif
+            AccumulateRowScalar(src_, sums_, 0, count_);
+        }
+
+        static void CheckFormats(const ImageView& src_, const MutableImageView& dst_)
+        {
+            if (src_.GetFormat() != dst_.GetFormat() || GetBitDepth(src_.GetFormat()) != 8)
+            {
+                throw std::invalid_argument("Resize needs matching 8-bit formats"s);
+            }
+        }
+
+        void ResizeBilinear(const ImageView& src_, const MutableImageView& dst_)
+        {
+            CheckFormats(src_, dst_);
+            if (!src_ || !dst_)
+            {
+                return;
+            }
+
+            const int channels = GetChannelCount(src_.GetFormat());
+            const int src_width = src_.GetWidth();
+            const int dst_width = dst_.GetWidth();
+            const int row_size = dst_width * channels;
+
+            const std::vector<Tap> columns = MakeTaps(src_width, dst_width);
+            const std::vector<Tap> rows = MakeTaps(src_.GetHeight(), dst_.GetHeight());
+
+            ParallelFor(dst_.GetHeight(), MIN_BAND_ROWS, [&](int begin_, int end_)
+            {
+                // the two source rows of an output row are adjacent, so odd and even rows get one
+                // slot each and a slot is reused while consecutive output rows read the same row
+                std::vector<int16_t> filtered(static_cast<size_t>(row_size) * 2);
+                int cached[2] = { -1, -1 };
+
+                auto filter = [&](int y_)
+                {
+                    int16_t* slot = filtered.data() + static_cast<size_t>(y_ & 1) * row_size;
+                    if (cached[y_ & 1] != y_)
+                    {
+                        Horizontal(src_.GetRow(y_), src_width, channels, columns.data(), dst_width, slot);
+                        cached[y_ & 1] = y_;
+                    }
+                    return slot;
+                };
+
+                for (int y = begin_; y < end_; ++y)
+                {
+                    const Tap& tap = rows[y];
+                    const int16_t* top = filter(tap.first);
+                    const int16_t* bottom = filter(tap.second);
+
+                    Vertical(top, bottom, tap.weight, dst_.GetRow(y), row_size);
+                }
+            });
+        }
+
+        void Resize(const ImageView& src_, const MutableImageView& dst_, Filter filter_)
+        {
+            CheckFormats(src_, dst_);
+            if (!src_ || !dst_)
+            {
+                return;
+            }
+
+            const int channels = GetChannelCount(src_.GetFormat());
+            const int dst_width = dst_.GetWidth();
+            const size_t row_size = static_cast<size_t>(dst_width) * channels;
+
+            const std::shared_ptr<const Contributions> columns = GetContributions(src_.GetWidth(), dst_width, filter_);
+            const std::shared_ptr<const Contributions> rows = GetContributions(src_.GetHeight(), dst_.GetHeight(), filter_);
+
+            ParallelFor(dst_.GetHeight(), MIN_BAND_ROWS, [&](int begin_, int end_)
+            {
+                // source row r is filtered once into slot r % taps; an output row never spans more
+                // than taps rows and first[] never decreases, so its rows are all still in the ring
+                const int ring_rows = rows->taps;
+                std::vector<uint8_t> ring(row_size * ring_rows);
+                std::vector<const uint8_t*> window(ring_rows);
+                int filtered = 0;
+
+                for (int y = begin_; y < end_; ++y)
+                {
+                    const int first = rows->first[y];
+                    const int count = rows->count[y];
+
+                    // rows that no output row reads are skipped
+                    for (filtered = std::max(filtered, first); filtered < first + count; ++filtered)
+                    {
+                        FilterRow(src_.GetRow(filtered), channels, *columns, dst_width, &ring[(filtered % ring_rows) * row_size]);
+                    }
+
+                    for (int k = 0; k < count; ++k)
+                    {
+                        window[k] = &ring[((first + k) % ring_rows) * row_size];
+                    }
+
+                    FilterColumns(window.data(), &rows->weights[static_cast<size_t>(y) * rows->taps], count, dst_.GetRow(y), static_cast<int>(row_size));
+                }
+            });
+        }
+
+        void ReduceBox(const ImageView& src_, const MutableImageView& dst_, int factor_)
+        {
+            CheckFormats(src_, dst_);
+            if (factor_ < 1 || factor_ > MAX_BOX_FACTOR)
+            {
+                throw std::invalid_argument("Box reduction factor out of range: "s + std::to_string(factor_));
+            }
+            if (dst_.GetWidth() != src_.GetWidth() / factor_ || dst_.GetHeight() != src_.GetHeight() / factor_)
+            {
+                throw std::invalid_argument("Box reduction needs a destination of the source size divided by the factor"s);
+            }
+
+            const int channels = GetChannelCount(src_.GetFormat());
+            const int row_size = dst_.GetWidth() * channels;
+
+            ParallelFor(dst_.GetHeight(), MIN_BAND_ROWS, [&](int begin_, int end_)
+            {
+                if (factor_ == 2)
+                {
+                    for (int y = begin_; y < end_; ++y)
+                    {
+                        HalveRow(src_.GetRow(y * 2), src_.GetRow(y * 2 + 1), channels, src_.GetWidth(), dst_.GetRow(y), dst_.GetWidth());
+                    }
+                    return;
+                }
+
+                // columns first: factor_ rows summed into 16-bit lanes, then each run of factor_
+                // pixels of the sums is added up and divided with rounding
+                std::vector<uint16_t> sums(static_cast<size_t>(row_size) * factor_);
+                const int area = factor_ * factor_;
+
+                for (int y = begin_; y < end_; ++y)
+                {
+                    std::fill(sums.begin(), sums.end(), static_cast<uint16_t>(0));
+                    for (int k = 0; k < factor_; ++k)
+                    {
+                        AccumulateRow(src_.GetRow(y * factor_ + k), sums.data(), static_cast<int>(sums.size()));
+                    }
+
+                    uint8_t* dst = dst_.GetRow(y);
+                    for (int x = 0; x < dst_.GetWidth(); ++x)
+                    {
+                        const uint16_t* box = &sums[static_cast<size_t>(x) * factor_ * channels];
+                        for (int c = 0; c < channels; ++c)
+                        {
+                            int sum = area / 2;
+                            for (int k = 0; k < factor_; ++k)
+                            {
+                                sum += box[k * channels + c];
+                            }
+                            dst[x * channels + c] = static_cast<uint8_t>(sum / area);
+                        }
+                    }
+                }
+            });
+        }
+
+        std::vector<Image> ResizeToSizes(const ImageView& src_, const std::vector<std::pair<int, int>>& sizes_, Filter filter_)
+        {
+            int min_width = INT_MAX;
+            int min_height = INT_MAX;
+            int max_width = 0;
+            int max_height = 0;
+            for (const auto& size : sizes_)
+            {
+                min_width = std::min(min_width, size.first);
+                min_height = std::min(min_height, size.second);
+                max_width = std::max(max_width, size.first);
+                max_height = std::max(max_height, size.second);
+            }
+
+            // levels larger than twice the largest size are never read, so the first level is
+            // boxed down from the source in one pass instead of halving through them
+            int shift = 0;
+            while ((1 << (shift + 1)) <= MAX_BOX_FACTOR && (src_.GetWidth() >> (shift + 1)) >= max_width && (src_.GetHeight() >> (shift + 1)) >= max_height)
+            {
+                ++shift;
+            }
+
+            // moving a level keeps its pixels where they are, so the views stay valid
+            std::vector<Image> levels;
+            std::vector<ImageView> views = { src_ };
+            if (shift > 0)
+            {
+                levels.emplace_back(src_.GetWidth() >> shift, src_.GetHeight() >> shift, src_.GetFormat());
+                ReduceBox(src_, levels.back(), 1 << shift);
+                views.push_back(levels.back());
+            }
+
+            while (views.back().GetWidth() / 2 >= min_width && views.back().GetHeight() / 2 >= min_height)
+            {
+                const ImageView& level = views.back();
+                levels.emplace_back(level.GetWidth() / 2, level.GetHeight() / 2, level.GetFormat());
+                ReduceBox(level, levels.back(), 2);
+                views.push_back(levels.back());
+            }
+
+            std::vector<Image> resized(sizes_.size());
+
+            ParallelFor(static_cast<int>(sizes_.size()), 1, [&](int begin_, int end_)
+            {
+                for (int i = begin_; i < end_; ++i)
+                {
+                    const int width = sizes_[i].first;
+                    const int height = sizes_[i].second;
+
+                    auto level = views.rbegin();
+                    while (level + 1 != views.rend() && (level->GetWidth() < width || level->GetHeight() < height))
+                    {
+                        ++level;
+                    }
+
+                    resized[i] = Image(width, height, src_.GetFormat());
+                    Resize(*level, resized[i], filter_);
+                }
+            });
+            return resized;
+        }
+
+    } // end namespace resample
+
+} // end namespace img_lib
@@ -0,0 +1,273 @@
+#include "scanline.h"
+#include "pixel_ops.h"
+
+#include <algorithm>
+#include <filesystem>
+
+namespace img_lib
+{
+    static void ReadAllRows(ScanlineReader& reader_, Image& image_)
+    {
+        const int height = image_.GetHeight();
+        const ptrdiff_t stride = static_cast<ptrdiff_t>(image_.GetStrideBytes());
+
+        // bottom-up readers fill the image from its last line with a negative stride
+        const bool top_down = reader_.GetReadOrder() == RowOrder::TOP_DOWN;
+        uint8_t* first = top_down ? image_.GetRow(0) : image_.GetRow(height - 1);
+
+        if (reader_.ReadRows(first, top_down ? stride : -stride, height) != height)
+        {
+            throw std::runtime_error("Unexpected end of image data"s);
+        }
+    }
+
+    // Writes count_ rows of format_ pixels, converting them into converted_ first when the
+    // writer wants another format.
+    static void WriteRowsAs(ScanlineWriter& writer_, const uint8_t* rows_, ptrdiff_t stride_, int count_, int width_, PixelFormat format_, uint8_t* converted_)
+    {
+        const PixelFormat write_format = writer_.GetWriteFormat();
+        if (write_format == format_)
+        {
+            writer_.WriteRows(rows_, stride_, count_);
+            return;
+        }
+
+        const size_t converted_stride = Image::GetAlignedStride(width_, write_format);
+        for (int i = 0; i < count_; ++i)
+        {
+            pixel_ops::ConvertPixels(rows_ + i * stride_, format_, converted_ + i * converted_stride, write_format, width_);
+        }
+        writer_.WriteRows(converted_, static_cast<ptrdiff_t>(converted_stride), count_);
+    }
+
+    static void WriteAllRows(ScanlineWriter& writer_, const ImageView& image_)
+    {
+        const int width = image_.GetWidth();
+        const int height = image_.GetHeight();
+        const ptrdiff_t stride = static_cast<ptrdiff_t>(image_.GetStrideBytes());
+
+        const bool top_down = writer_.GetWriteOrder() == RowOrder::TOP_DOWN;
+        const uint8_t* first = top_down ? image_.GetRow(0) : image_.GetRow(height - 1);
+        const ptrdiff_t ordered_stride = top_down ? stride : -stride;
+
+        if (writer_.GetWriteFormat() == image_.GetFormat())
+        {
+            writer_.WriteRows(first, ordered_stride, height);
+            return;
+        }
+
+        const int batch = std::min(DEFAULT_ROWS_IN_FLIGHT, height);
+        PixelBuffer converted(Image::GetAlignedStride(width, writer_.GetWriteFormat()) * batch);
+
+        for (int done = 0; done < height;)
+        {
+            const int count = std::min(batch, height - done);
+            WriteRowsAs(writer_, first + done * ordered_stride, ordered_stride, count, width, image_.GetFormat(), converted.data());
+            done += count;
+        }
+    }
+
+    static void CheckInfo(const ImageInfo& info_)
+    {
+        if (info_.width <= 0 || info_.height <= 0)
+        {
+            throw std::runtime_error("Invalid image dimensions"s);
+        }
+    }
+
+    Image DecodeImage(ScanlineReader& reader_, const Path& path_, PixelBuffer buffer_)
+    {
+        return DecodeImage(reader_, path_, 0, 0, std::move(buffer_));
+    }
+
+    Image DecodeImage(ScanlineReader& reader_, const Path& path_, int min_width_, int min_height_, PixelBuffer buffer_)
+    {
+        ImageInfo info = reader_.BeginDecode(path_);
+        CheckInfo(info);
+
+        if (min_width_ > 0 && min_height_ > 0)
+        {
+            int width = min_width_;
+            int height = min_height_;
+            if (reader_.SetReadSize(width, height))
+            {
+                info.width = width;
+                info.height = height;
+            }
+        }
+
+        reader_.SetReadOrder(RowOrder::TOP_DOWN);
+
+        Image image(info.width, info.height, reader_.GetReadFormat(), std::move(buffer_));
+        ReadAllRows(reader_, image);
+
+        reader_.EndDecode();
+        return image;
+    }
+
+    Image DecodeRegion(ScanlineReader& reader_, const Path& path_, int x_, int y_, int width_, int height_, PixelBuffer buffer_)
+    {
+        const ImageInfo info = reader_.BeginDecode(path_);
+        CheckInfo(info);
+
+        if (x_ < 0 || y_ < 0 || width_ <= 0 || height_ <= 0 || width_ > info.width - x_ || height_ > info.height - y_)
+        {
+            throw std::invalid_argument("Region is outside the image"s);
+        }
+
+        // the rows delivered: the region or more when the reader can cut it out, otherwise the image
+        int left = x_;
+        int top = y_;
+        int width = width_;
+        int height = height_;
+        if (!reader_.SetReadRegion(left, top, width, height))
+        {
+            left = 0;
+            top = 0;
+            width = info.width;
+            height = info.height;
+        }
+
+        reader_.SetReadOrder(RowOrder::TOP_DOWN);
+        const PixelFormat format = reader_.GetReadFormat();
+
+        Image image(width_, height_, format, std::move(buffer_));
+        if (left == x_ && top == y_ && width == width_ && height == height_)
+        {
+            ReadAllRows(reader_, image);
+            reader_.EndDecode();
+            return image;
+        }
+
+        // whole rows pass through a batch and the region's part of them is kept
+        const bool top_down = reader_.GetReadOrder() == RowOrder::TOP_DOWN;
+        const size_t pixel_bytes = GetBytesPerPixel(format);
+        const size_t stride = Image::GetAlignedStride(width, format);
+        const int batch = std::min(DEFAULT_ROWS_IN_FLIGHT, height);
+        PixelBuffer rows(stride * batch);
+
+        for (int done = 0; done < height;)
+        {
+            const int count = reader_.ReadRows(rows.data(), static_cast<ptrdiff_t>(stride), std::min(batch, height - done));
+            if (count <= 0)
+            {
+                throw std::runtime_error("Unexpected end of image data"s);
+            }
+
+            for (int i = 0; i < count; ++i)
+            {
+                const int y = (top_down ? done + i : height - 1 - done - i) + top - y_;
+                if (y >= 0 && y < height_)
+                {
+                    std::copy_n(rows.data() + i * stride + (x_ - left) * pixel_bytes, width_ * pixel_bytes, image.GetRow(y));
+                }
+            }
+            done += count;
+        }
+
+        reader_.EndDecode();
+        return image;
+    }
+
+    // Only called once BeginEncode() has succeeded, so the file deleted is the one being written
+    // and not one that could not be replaced; never the input_ it was being decoded from.
+    static void DiscardOutput(ScanlineWriter& writer_, const Path& path_, const Path& input_ = {}) noexcept
+    {
+        writer_.AbortEncode();
+
+        std::error_code error;
+        if (!input_.empty() && std::filesystem::equivalent(input_, path_, error))
+        {
+            return;
+        }
+        std::filesystem::remove(path_, error);
+    }
+
+    void EncodeImage(ScanlineWriter& writer_, const Path& path_, const ImageView& image_)
+    {
+        writer_.BeginEncode(path_, { image_.GetWidth(), image_.GetHeight(), image_.GetFormat() });
+
+        try
+        {
+            WriteAllRows(writer_, image_);
+            writer_.EndEncode();
+        }
+        catch (...)
+        {
+            DiscardOutput(writer_, path_);
+            throw;
+        }
+    }
+
+    void TranscodeImage(ScanlineReader& reader_, const Path& input_, ScanlineWriter& writer_, const Path& output_, int rows_in_flight_)
+    {
+        PixelBuffer scratch;
+        TranscodeImage(reader_, input_, writer_, output_, scratch, rows_in_flight_);
+    }
+
+    void TranscodeImage(ScanlineReader& reader_, const Path& input_, ScanlineWriter& writer_, const Path& output_, PixelBuffer& scratch_, int rows_in_flight_)
+    {
+        // BeginEncode() truncates the output, which would destroy the rows still to be read
+        std::error_code error;
+        if (std::filesystem::equivalent(input_, output_, error))
+        {
+            throw std::invalid_argument("Cannot stream an image onto its own file: "s + input_.string());
+        }
+
+        const ImageInfo info = reader_.BeginDecode(input_);
+        CheckInfo(info);
+
+        writer_.BeginEncode(output_, info);
+
+        try
+        {
+            const RowOrder order = reader_.GetReadOrder();
+            const bool negotiated = writer_.SetWriteOrder(order) || reader_.SetReadOrder(writer_.GetWriteOrder());
+
+            if (negotiated)
+            {
+                const PixelFormat write_format = writer_.GetWriteFormat();
+                reader_.SetReadFormat(write_format);
+                const PixelFormat read_format = reader_.GetReadFormat();
+
+                // rows in flight are laid out like Image rows, aligned and padded, followed by their
+                // conversion to the writer's format when the reader could not produce it
+                const size_t read_stride = Image::GetAlignedStride(info.width, read_format);
+                const size_t write_stride = read_format == write_format ? 0 : Image::GetAlignedStride(info.width, write_format);
+                const int batch = std::min(std::max(rows_in_flight_, 1), info.height);
+                scratch_.resize((read_stride + write_stride) * batch);
+
+                uint8_t* rows = scratch_.data();
+                uint8_t* converted = rows + read_stride * batch;
+
+                for (int done = 0; done < info.height;)
+                {
+                    const int count = std::min(batch, info.height - done);
+                    if (reader_.ReadRows(rows, static_cast<ptrdiff_t>(read_stride), count) != count)
+                    {
+                        throw std::runtime_error("Unexpected end of image data"s);
+                    }
+
+                    WriteRowsAs(writer_, rows, static_cast<ptrdiff_t>(read_stride), count, info.width, read_format, converted);
+                    done += count;
+                }
+            }
+            else
+            {
+                Image spill(info.width, info.height, reader_.GetReadFormat(), std::move(scratch_));
+                ReadAllRows(reader_, spill);
+                WriteAllRows(writer_, spill);
+                scratch_ = spill.ReleasePixels();
+            }
+
+            reader_.EndDecode();
+            writer_.EndEncode();
+        }
+        catch (...)
+        {
+            DiscardOutput(writer_, output_, input_);
+            throw;
+        }
+    }
+
+} // end namespace img_lib
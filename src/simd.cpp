@@ -0,0 +1,100 @@
+#include "simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(IMG_LIB_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace img_lib
+{
+    static SimdLevel DetectSimdLevel() noexcept
+    {
+    #if defined(IMG_LIB_X86) && defined(_MSC_VER)
+        int info[4] = {};
+        __cpuid(info, 0);
+        const int max_leaf = info[0];
+
+        __cpuid(info, 1);
+        const bool sse2 = (info[3] & (1 << 26)) != 0;
+        const bool ssse3 = (info[2] & (1 << 9)) != 0;
+        const bool os_avx = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+
+        bool avx2 = false;
+        if (max_leaf >= 7 && os_avx)
+        {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+
+        return avx2 ? SimdLevel::AVX2 : ssse3 ? SimdLevel::SSSE3 : sse2 ? SimdLevel::SSE2 : SimdLevel::SCALAR;
+    #elif defined(IMG_LIB_X86)
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx2"))
+        {
+            return SimdLevel::AVX2;
+        }
+        if (__builtin_cpu_supports("ssse3"))
+        {
+            return SimdLevel::SSSE3;
+        }
+        if (__builtin_cpu_supports("sse2"))
+        {
+            return SimdLevel::SSE2;
+        }
+        return SimdLevel::SCALAR;
+    #else
+        return SimdLevel::SCALAR;
+    #endif
+    }
+
+    static SimdLevel ReadSimdCap() noexcept
+    {
+        const char* cap = std::getenv("IMG_LIB_SIMD");
+        if (!cap)
+        {
+            return SimdLevel::AVX2;
+        }
+
+        if (std::strcmp(cap, "scalar") == 0)
+        {
+            return SimdLevel::SCALAR;
+        }
+        if (std::strcmp(cap, "sse2") == 0)
+        {
+            return SimdLevel::SSE2;
+        }
+        if (std::strcmp(cap, "ssse3") == 0)
+        {
+            return SimdLevel::SSSE3;
+        }
+        return SimdLevel::AVX2;
+    }
+
+    static SimdLevel GetCpuSimdLevel() noexcept
+    {
+        static const SimdLevel level = DetectSimdLevel();
+        return level;
+    }
+
+    static std::atomic<SimdLevel>& GetCurrentSimdLevel() noexcept
+    {
+        static std::atomic<SimdLevel> level{ std::min(GetCpuSimdLevel(), ReadSimdCap()) };
+        return level;
+    }
+
+    SimdLevel GetSimdLevel() noexcept
+    {
+        return GetCurrentSimdLevel().load(std::memory_order_relaxed);
+    }
+
+    void SetSimdLevel(SimdLevel level_) noexcept
+    {
+        GetCurrentSimdLevel().store(std::min(level_, GetCpuSimdLevel()), std::memory_order_relaxed);
+    }
+
+} // end namespace img_lib
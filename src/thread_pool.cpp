@@ -0,0 +1,268 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+namespace img_lib
+{
+    static thread_local const ThreadPool* current_pool = nullptr;
+    static thread_local int current_worker = -1;
+
+    static std::mutex parallel_mutex;
+    static int parallel_threads = 0;
+    static std::shared_ptr<ThreadPool> parallel_pool;
+
+    // Progress of one ParallelFor call; helper tasks may start after the call has returned, so
+    // they hold it by shared_ptr and only touch the body while bands are left.
+    struct ParallelBands
+    {
+        const std::function<void(int, int)>* body = nullptr;
+        int count = 0;
+        int bands = 0;
+
+        std::atomic<int> next{ 0 };
+        std::mutex mutex;
+        std::condition_variable done;
+        int finished = 0;
+        std::exception_ptr error;
+
+        void Run()
+        {
+            for (int band = next++; band < bands; band = next++)
+            {
+                std::exception_ptr failure;
+                try
+                {
+                    (*body)(static_cast<int>(static_cast<long long>(count) * band / bands), static_cast<int>(static_cast<long long>(count) * (band + 1) / bands));
+                }
+                catch (...)
+                {
+                    failure = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failure && !error)
+                {
+                    error = failure;
+                }
+                if (++finished == bands)
+                {
+                    done.notify_all();
+                }
+            }
+        }
+    };
+
+    static int ResolveThreadCount(int threads_)
+    {
+        return threads_ > 0 ? threads_ : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    ThreadPool::ThreadPool(int threads_)
+    {
+        threads_ = ResolveThreadCount(threads_);
+
+        for (int i = 0; i < threads_; ++i)
+        {
+            queues.push_back(std::make_unique<Queue>());
+        }
+
+        for (int i = 0; i < threads_; ++i)
+        {
+            threads.emplace_back(&ThreadPool::Run, this, i);
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    int ThreadPool::GetThreadCount() const noexcept
+    {
+        return static_cast<int>(threads.size());
+    }
+
+    void ThreadPool::Submit(Task task_)
+    {
+        // tasks spawned by a worker stay on its own deque, external ones are spread round-robin
+        size_t target = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            target = current_pool == this ? static_cast<size_t>(current_worker) : next_queue++ % queues.size();
+            ++pending;
+            ++queued;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queues[target]->mutex);
+            queues[target]->tasks.push_back(std::move(task_));
+        }
+        wake.notify_one();
+    }
+
+    void ThreadPool::Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+
+        if (error)
+        {
+            std::exception_ptr first = error;
+            error = nullptr;
+            std::rethrow_exception(first);
+        }
+    }
+
+    void ThreadPool::Run(int worker_)
+    {
+        current_pool = this;
+        current_worker = worker_;
+
+        while (true)
+        {
+            Task task;
+            if (TryPop(worker_, task) || TrySteal(worker_, task))
+            {
+                --queued;
+
+                std::exception_ptr failure;
+                try
+                {
+                    task(worker_);
+                }
+                catch (...)
+                {
+                    failure = std::current_exception();
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (failure && !error)
+                {
+                    error = failure;
+                }
+                if (--pending == 0)
+                {
+                    idle.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    bool ThreadPool::TryPop(int worker_, Task& task_)
+    {
+        Queue& queue = *queues[worker_];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+
+        task_ = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool ThreadPool::TrySteal(int worker_, Task& task_)
+    {
+        const int count = static_cast<int>(queues.size());
+        for (int i = 1; i < count; ++i)
+        {
+            Queue& victim = *queues[(worker_ + i) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty())
+            {
+                task_ = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void SetParallelThreads(int threads_)
+    {
+        std::lock_guard<std::mutex> lock(parallel_mutex);
+        if (threads_ != parallel_threads)
+        {
+            // calls still running keep the old pool alive through their own reference
+            parallel_threads = threads_;
+            parallel_pool.reset();
+        }
+    }
+
+    int GetParallelThreads()
+    {
+        std::lock_guard<std::mutex> lock(parallel_mutex);
+        return ResolveThreadCount(parallel_threads);
+    }
+
+    std::shared_ptr<ThreadPool> GetParallelPool()
+    {
+        std::lock_guard<std::mutex> lock(parallel_mutex);
+        const int threads = ResolveThreadCount(parallel_threads);
+        if (threads > 1 && !parallel_pool)
+        {
+            // the caller is one of the threads
+            parallel_pool = std::make_shared<ThreadPool>(threads - 1);
+        }
+        return parallel_pool;
+    }
+
+    void ParallelFor(int count_, int min_band_, const std::function<void(int begin_, int end_)>& body_)
+    {
+        if (count_ <= 0)
+        {
+            return;
+        }
+
+        const std::shared_ptr<ThreadPool> pool = GetParallelPool();
+        const int threads = pool ? pool->GetThreadCount() + 1 : 1;
+
+        const int max_bands = (count_ + std::max(min_band_, 1) - 1) / std::max(min_band_, 1);
+        const int bands = std::min(threads, max_bands);
+        if (bands <= 1)
+        {
+            body_(0, count_);
+            return;
+        }
+
+        auto state = std::make_shared<ParallelBands>();
+        state->body = &body_;
+        state->count = count_;
+        state->bands = bands;
+
+        for (int i = 1; i < bands; ++i)
+        {
+            pool->Submit([state](int)
+            {
+                state->Run();
+            });
+        }
+        state->Run();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->done.wait(lock, [&] { return state->finished == bands; });
+        if (state->error)
+        {
+            std::rethrow_exception(state->error);
+        }
+    }
+
+} // end namespace img_lib
@@ -1,43 +1,59 @@
 #include "tiff_image.h"
+#include "pixel_ops.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace img_lib
 {
     namespace tiff_image
     {
+        static const size_t TIFF_READ_CHUNK_BYTES = 1 << 20;
+
         const Image TiffImage::LoadImageTIFF(const Path& path_)
         {
-            std::ifstream file(path_, std::ios::binary);
-            if (!file)
-            {
-                throw std::runtime_error("Failed to open TIFF file: "s + path_.string());
-                return {};
-            }
+            return DecodeImage(*this, path_);
+        }
+
+        bool TiffImage::SaveImageTIFF(const Path& path_, const ImageView& image_)
+        {
+            EncodeImage(*this, path_, image_);
+            return true;
+        }
+
+        ImageInfo TiffImage::BeginDecode(const Path& path_)
+        {
+            decode_source.Open(path_);
+            InputSource& source = decode_source;
 
             TiffHeader header;
 
-            file.read(reinterpret_cast<char*>(&header), sizeof(TiffHeader));
-            if (!file || header.byteOrder != 0x4949 || header.magic != 42)
+            const uint8_t* data = source.View(0, sizeof(TiffHeader));
+            if (!data)
+            {
+                throw std::runtime_error("Invalid TIFF file: "s + path_.string());
+            }
+            std::memcpy(&header, data, sizeof(TiffHeader));
+            if (header.byteOrder != 0x4949 || header.magic != 42)
             {
                 throw std::runtime_error("Invalid TIFF file: "s + path_.string());
-                return {};
             }
-
-            std::vector<IFDEntry> ifdEntries;
-            file.seekg(header.ifdOffset, std::ios::beg);
 
             uint16_t entryCount;
-            file.read(reinterpret_cast<char*>(&entryCount), sizeof(entryCount));
-            if (!file)
+            data = source.View(header.ifdOffset, sizeof(entryCount));
+            if (!data)
             {
-                return {};
+                throw std::runtime_error("Invalid TIFF file: "s + path_.string());
             }
+            std::memcpy(&entryCount, data, sizeof(entryCount));
 
-            ifdEntries.resize(entryCount);
-            file.read(reinterpret_cast<char*>(ifdEntries.data()), entryCount * sizeof(IFDEntry));
-            if (!file)
+            std::vector<IFDEntry> ifdEntries(entryCount);
+            data = source.View(static_cast<uint64_t>(header.ifdOffset) + sizeof(entryCount), entryCount * sizeof(IFDEntry));
+            if (!data)
             {
-                return {};
+                throw std::runtime_error("Invalid TIFF file: "s + path_.string());
             }
+            std::memcpy(ifdEntries.data(), data, entryCount * sizeof(IFDEntry));
 
             uint32_t width = 0;
             uint32_t height = 0;
@@ -84,66 +100,105 @@ namespace img_lib
             if (bitsPerSample != 8 || samplesPerPixel != 3)
             {
                 throw std::runtime_error("Unsupported TIFF format"s);
-                return {};
             }
 
-            Image image(width, height, Color::Black());
+            // the single strip holds rows back to back
+            decode_offset = stripOffsets;
 
-            file.seekg(stripOffsets, std::ios::beg);
-            std::vector<uint8_t> buffer(width * height * samplesPerPixel);
+            decode_info.width = static_cast<int>(width);
+            decode_info.height = static_cast<int>(height);
+            decode_info.format = PixelFormat::RGB8;
+            decode_row = 0;
 
-            file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
-            if (!file)
-            {
-                return {};
-            }
+            return decode_info;
+        }
 
-            for (int y = 0; y < height; ++y)
+        int TiffImage::ReadRows(uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            const size_t row_size = static_cast<size_t>(decode_info.width) * 3;
+            const int chunk_rows = static_cast<int>(std::max<size_t>(1, TIFF_READ_CHUNK_BYTES / row_size));
+
+            int done = 0;
+            const int rows = std::min(count_, decode_info.height - decode_row);
+
+            while (done < rows)
             {
-                for (int x = 0; x < width; ++x)
+                const int chunk = std::min(chunk_rows, rows - done);
+
+                const uint8_t* block = decode_source.View(decode_offset, chunk * row_size);
+                if (!block)
                 {
-                    int index = (y * width + x) * samplesPerPixel;
-                    image.GetPixel(x, y) = { buffer[index], buffer[index + 1], buffer[index + 2] };
+                    break;
                 }
+
+                for (int i = 0; i < chunk; ++i)
+                {
+                    uint8_t* line = rows_ + (done + i) * stride_;
+                    if (decode_info.format == PixelFormat::RGBA8)
+                    {
+                        pixel_ops::RgbToRgba(block + i * row_size, line, decode_info.width);
+                    }
+                    else
+                    {
+                        std::memcpy(line, block + i * row_size, row_size);
+                    }
+                }
+
+                decode_offset += chunk * row_size;
+                done += chunk;
             }
 
-            file.close();
-            return image;
+            decode_row += done;
+            return done;
+        }
+
+        void TiffImage::EndDecode()
+        {
+            decode_source.Close();
+        }
+
+        PixelFormat TiffImage::GetReadFormat() const noexcept
+        {
+            return decode_info.format;
+        }
+
+        bool TiffImage::SetReadFormat(PixelFormat format_)
+        {
+            if (format_ != PixelFormat::RGB8 && format_ != PixelFormat::RGBA8)
+            {
+                return false;
+            }
+            decode_info.format = format_;
+            return true;
         }
 
-        bool TiffImage::SaveImageTIFF(const Path& path_, const Image& image_) const
+        void TiffImage::BeginEncode(const Path& path_, const ImageInfo& info_)
         {
-            std::ofstream file(path_, std::ios::binary);
+            encode_file.close();
+            encode_file.clear();
+            encode_file.open(path_, std::ios::binary);
+            std::ofstream& file = encode_file;
             if (!file)
             {
                 throw std::runtime_error("Failed to create TIFF file: "s + path_.string());
-                return false;
             }
 
             uint32_t ifdOffset = sizeof(TiffHeader);
             TiffHeader header = { 0x4949, 42, ifdOffset };
 
             file.write(reinterpret_cast<char*>(&header), sizeof(header));
-            if (!file)
-            {
-                return false;
-            }
 
             uint16_t entryCount = 8;
 
             file.write(reinterpret_cast<char*>(&entryCount), sizeof(entryCount));
-            if (!file)
-            {
-                return false;
-            }
 
-            uint32_t width = image_.GetWidth();
-            uint32_t height = image_.GetHeight();
+            uint32_t width = info_.width;
+            uint32_t height = info_.height;
             uint32_t bitsPerSample = 8;
             uint32_t samplesPerPixel = 3;
             uint32_t rowsPerStrip = height;
             uint32_t stripOffsets = sizeof(TiffHeader) + sizeof(entryCount) + entryCount * sizeof(IFDEntry) + sizeof(uint32_t);
-            uint32_t stripByteCounts = width * height * sizeof(Color);
+            uint32_t stripByteCounts = width * height * samplesPerPixel;
 
             IFDEntry entries[] =
             {
@@ -158,33 +213,56 @@ namespace img_lib
             };
 
             file.write(reinterpret_cast<char*>(entries), sizeof(entries));
-            if (!file)
-            {
-                return false;
-            }
 
             uint32_t nextIFDOffset = 0;
 
             file.write(reinterpret_cast<char*>(&nextIFDOffset), sizeof(nextIFDOffset));
             if (!file)
             {
-                return false;
+                throw std::runtime_error("Failed to write TIFF file: "s + path_.string());
             }
 
-            for (int y = 0; y < image_.GetHeight(); ++y)
+            encode_info = info_;
+            encode_info.format = info_.format == PixelFormat::RGBA8 ? PixelFormat::RGBA8 : PixelFormat::RGB8;
+            encode_buffer.resize(static_cast<size_t>(width) * samplesPerPixel);
+        }
+
+        PixelFormat TiffImage::GetWriteFormat() const noexcept
+        {
+            return encode_info.format;
+        }
+
+        void TiffImage::WriteRows(const uint8_t* rows_, ptrdiff_t stride_, int count_)
+        {
+            for (int i = 0; i < count_; ++i)
             {
-                for (int x = 0; x < image_.GetWidth(); ++x)
+                const uint8_t* line = rows_ + i * stride_;
+                if (encode_info.format == PixelFormat::RGBA8)
                 {
-                    const Color& color = image_.GetPixel(x, y);
+                    pixel_ops::RgbaToRgb(line, encode_buffer.data(), encode_info.width);
+                    line = encode_buffer.data();
+                }
 
-                    file.write(reinterpret_cast<const char*>(&color.r), sizeof(color.r));
-                    file.write(reinterpret_cast<const char*>(&color.g), sizeof(color.g));
-                    file.write(reinterpret_cast<const char*>(&color.b), sizeof(color.b));
+                encode_file.write(reinterpret_cast<const char*>(line), encode_buffer.size());
+                if (!encode_file)
+                {
+                    throw std::runtime_error("Failed to write TIFF file"s);
                 }
             }
+        }
 
-            file.close();
-            return true;
+        void TiffImage::EndEncode()
+        {
+            encode_file.close();
+            if (!encode_file)
+            {
+                throw std::runtime_error("Failed to write TIFF file"s);
+            }
+        }
+
+        void TiffImage::AbortEncode() noexcept
+        {
+            encode_file.close();
         }
 
     } // end namespace tiff_image